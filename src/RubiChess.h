@@ -20,10 +20,6 @@
 #define VERNUM "1.8"
 //#define VERSTABLE
 
-#if 0
-#define STATISTICS
-#endif
-
 #if 0
 #define SDEBUG
 #endif
@@ -44,6 +40,11 @@
 #define FINDMEMORYLEAKS
 #endif
 
+#if 0
+// Generate legal moves only so playMove can skip its own legality test
+#define LEGALMOVEGEN
+#endif
+
 #ifdef FINDMEMORYLEAKS
 #ifdef _DEBUG  
 #define DEBUG_CLIENTBLOCK   new( _CLIENT_BLOCK, __FILE__, __LINE__)  
@@ -76,6 +77,9 @@
 #include <algorithm>
 #include <iterator>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <map>
 #include <time.h>
 #include <array>
@@ -110,6 +114,9 @@
 #define myassert(expression, pos, num, ...) (void)(0)
 #define sprintf_s sprintf
 void Sleep(long x);
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
 #ifdef __ANDROID__
 #define allocalign64(x) malloc(x)
 #define freealigned64(x) free(x)
@@ -135,6 +142,15 @@ using namespace std;
 #endif
 #endif
 
+// Builds for x86-64 with gcc on Linux get the hot functions compiled for several instruction set levels;
+// the ifunc resolvers select the best one at startup. Builds that set PROCDESC target a fixed level.
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && defined(__linux__) && !defined(PROCDESC)
+#define ISADISPATCH
+#define HOTFUNC __attribute__((target_clones("arch=x86-64-v3", "arch=x86-64-v2", "default")))
+#define PROCDESC "%s"  // filled in with the selected level
+#else
+#define HOTFUNC
+#endif
 #ifndef PROCDESC
 #define PROCDESC "general"
 #endif
@@ -154,6 +170,13 @@ using namespace std;
 #define BUILD __DATE__ " " __TIME__
 #endif
 
+// Rare special cases (castling, promotion, en passant) are kept out of the hot code
+#ifdef _MSC_VER
+#define COLDFUNC __declspec(noinline)
+#else
+#define COLDFUNC __attribute__((cold, noinline))
+#endif
+
 #define BITSET(x) (1ULL << (x))
 #define MORETHANONE(x) ((x) & ((x) - 1)) 
 #define ONEORZERO(x) (!MORETHANONE(x))
@@ -173,6 +196,10 @@ inline int pullMsb(unsigned long long *x) {
     return i;
 }
 #define POPCOUNT(x) (int)(__popcnt64(x))
+#if defined(_M_X64)
+#define PEXTAVAILABLE
+#define PEXT(x,m) _pext_u64((x), (m))
+#endif
 #else
 #define GETLSB(i,x) (i = __builtin_ctzll(x))
 inline int pullLsb(unsigned long long *x) {
@@ -187,6 +214,19 @@ inline int pullMsb(unsigned long long *x) {
     return i;
 }
 #define POPCOUNT(x) __builtin_popcountll(x)
+#if defined(__x86_64__)
+// The instruction is used via inline asm so the code needs no -mbmi2 and runs on every cpu as long as it's not executed
+#define PEXTAVAILABLE
+inline unsigned long long pext(unsigned long long x, unsigned long long m) {
+    unsigned long long r;
+    __asm__("pextq %2, %1, %0" : "=r" (r) : "r" (x), "r" (m));
+    return r;
+}
+#define PEXT(x,m) pext((x), (m))
+#endif
+#endif
+#ifndef PEXTAVAILABLE
+#define PEXT(x,m) 0ULL
 #endif
 
 enum { WHITE, BLACK };
@@ -534,6 +574,20 @@ string IndexToAlgebraic(int i);
 string AlgebraicFromShort(string s, chessposition *pos);
 void BitboardDraw(U64 b);
 U64 getTime();
+struct numanode {
+    int node;
+    vector<int> cpus;
+};
+extern vector<numanode> numanodes;
+bool numaInit();
+int numaBindThread(int index);     // pins the calling thread; returns its node
+bool numaBindMemory(void *p, size_t size, int node);
+bool numaInterleaveMemory(void *p, size_t size);
+// Page sizes for large allocations; allocHuge tries them in this order starting with firstmode
+enum pagemode { PAGES1G, PAGES2M, PAGESTHP, PAGESNORMAL };
+void *allocHuge(size_t size, int *mode, int firstmode);
+void freeHuge(void *p, size_t size, int mode);
+const char *pageModeName(int mode);
 #ifdef STACKDEBUG
 void GetStackWalk(chessposition *pos, const char* message, const char* _File, int Line, int num, ...);
 #endif
@@ -570,13 +624,11 @@ public:
     u8 getMaterialHash(chessposition *pos);
 };
 
-#define TTBUCKETNUM 3
-
-typedef uint16_t hashupper_t;
+typedef uint32_t hashupper_t;
 #define GETHASHUPPER(x) (hashupper_t)((x) >> (64 - sizeof(hashupper_t) * 8))
 
+// The data part of an entry; fits in one 64bit word so it is written and read in one go
 struct transpositionentry {
-    hashupper_t hashupper;
     uint16_t movecode;
     int16_t value;
     int16_t staticeval;
@@ -584,44 +636,136 @@ struct transpositionentry {
     uint8_t boundAndAge;
 };
 
-struct transpositioncluster {
-    transpositionentry entry[TTBUCKETNUM];
-    uint8_t padding[(64 - sizeof(transpositionentry) * TTBUCKETNUM) % 16];
+static_assert(sizeof(transpositionentry) == sizeof(U64), "transpositionentry doesn't fit into 64 bits");
+
+// Formats of the table as buckets x bytes per entry / bytes per cluster
+enum ttformat { TTFORMAT5X12, TTFORMAT3X10, TTFORMAT6X10, TTFORMAT4X8 };
+#define TTFORMATNAMES "5x12/64 3x10/32 6x10/64 4x8/32"
+
+// Replacement policies of addHash: entry of an older search first or shallowest entry first
+enum ttreplace { TTREPLACEDEPTHAGE, TTREPLACEAGEDEPTH };
+#define TTREPLACENAMES "depth-age age-depth"
+
+// A cluster of N buckets with a hash check of type K and the clear epoch of type E in the padding.
+// The hash check of an entry is stored xor'ed with the data so an entry torn by concurrent
+// writers of different threads doesn't verify anymore and is just ignored (lockless hashing).
+// Key 0 is reserved for the empty (all zero) bucket which would otherwise decode as an exact entry.
+template <typename K, typename E, int N>
+struct ttcluster {
+    static const int buckets = N;
+    K hashcheck[N];
+    E epoch;            // clear generation of the entries; entries of an older one count as empty
+    U64 data[N];
+    static K key(U64 hash) { return (K)((hash >> (64 - sizeof(K) * 8)) | 1); }
+    static K fold(U64 d) {
+        K f = (K)d;
+        for (unsigned int s = sizeof(K) * 8; s < 64; s += sizeof(K) * 8)
+            f ^= (K)(d >> s);
+        return f;
+    }
+    bool isCurrent(uint32_t ep) { return epoch == (E)ep; }
+    void renew(uint32_t ep) {
+        memset(hashcheck, 0, sizeof(hashcheck));
+        memset(data, 0, sizeof(data));
+        epoch = (E)ep;
+    }
+    K get(int i, transpositionentry *e) {
+        U64 d = data[i];
+        memcpy(e, &d, sizeof(*e));
+        return hashcheck[i] ^ fold(d);
+    }
+    void set(int i, K k, transpositionentry *e) {
+        U64 d;
+        memcpy(&d, e, sizeof(d));
+        data[i] = d;
+        hashcheck[i] = k ^ fold(d);
+    }
 };
 
+// Four entries with a 16bit key packed into one 64bit word each; no room for the static eval and the epoch
+struct ttclusterpacked {
+    static const int buckets = 4;
+    U64 data[4];
+    static uint16_t key(U64 hash) { return (uint16_t)((hash >> 48) | 1); }
+    bool isCurrent(uint32_t) { return true; }
+    void renew(uint32_t) {}
+    uint16_t get(int i, transpositionentry *e);
+    void set(int i, uint16_t k, transpositionentry *e);
+};
+
+typedef ttcluster<hashupper_t, uint32_t, 5> transpositioncluster;  // the default format
+typedef ttcluster<uint16_t, uint16_t, 3> ttcluster3x10;
+typedef ttcluster<uint16_t, uint32_t, 6> ttcluster6x10;
+
+static_assert(sizeof(transpositioncluster) == 64, "transpositioncluster should fill a cache line");
+static_assert(sizeof(ttcluster3x10) == 32, "ttcluster3x10 should fill half a cache line");
+static_assert(sizeof(ttcluster6x10) == 64, "ttcluster6x10 should fill a cache line");
+static_assert(sizeof(ttclusterpacked) == 32, "ttclusterpacked should fill half a cache line");
+
 
 #define FIXMATESCOREPROBE(v,p) (MATEFORME(v) ? (v) - p : (MATEFOROPPONENT(v) ? (v) + p : v))
 #define FIXMATESCOREADD(v,p) (MATEFORME(v) ? (v) + p : (MATEFOROPPONENT(v) ? (v) - p : v))
 
+struct ttshmheader;
+
 class transposition
 {
 public:
-    transpositioncluster *table;
+    char *table;
     U64 size;
     U64 sizemask;
+    int format = TTFORMAT5X12;
+    int replace = TTREPLACEDEPTHAGE;
+    int clustershift;           // log2 of the cluster size of the format
     int numOfSearchShiftTwo;
+    string hashfile;            // file to keep the table between sessions; empty for none
+    string shmname;             // name of the shared memory table used by several processes; empty for none
+    ttshmheader *shm = nullptr;
+    int shmfd = -1;             // kept open for the lock that marks this process as attached
+    char *filemap = nullptr;    // start of the mapped hash file or shared memory; the table follows the header page
+    size_t filemapsize = 0;
+    int pagemode;               // page size the table got from allocHuge
+    uint32_t epoch = 0;         // incremented by a lazy clean
+    thread bgclean;             // zeroes the stale clusters while the engine is idle
+    atomic<bool> bgcleanstop;
     ~transposition();
     int setSize(int sizeMb);    // returns the number of Mb not used by allignment
-    void clean();
+    void releaseTable();
+    bool isForeignFile();
+    bool mapFile();
+    bool mapShm();
+    bool loadFile();
+    bool saveFile(bool overwrite = false);
+    void clean(bool lazy = false);
+    void backgroundClean();
+    void stopBackgroundClean();
+    template <class Cluster> void cleanStale();
+    template <class Cluster, class Replace> void addHash(U64 hash, int val, int16_t staticeval, int bound, int depth, uint16_t movecode);
     void addHash(U64 hash, int val, int16_t staticeval, int bound, int depth, uint16_t movecode);
+    template <class Cluster> void printHashentry(U64 hash);
     void printHashentry(U64 hash);
-    bool probeHash(U64 hash, int *val, int *staticeval, uint16_t *movecode, int depth, int alpha, int beta, int ply);
+    template <class Cluster> bool probeHash(U64 hash, int *val, int *staticeval, uint16_t *movecode, int depth, int alpha, int beta, int ply, bool *found);
+    bool probeHash(U64 hash, int *val, int *staticeval, uint16_t *movecode, int depth, int alpha, int beta, int ply, bool *found = nullptr);
+    template <class Cluster> uint16_t getMoveCode(U64 hash);
     uint16_t getMoveCode(U64 hash);
+    template <class Cluster> unsigned int getUsedinPermill();
     unsigned int getUsedinPermill();
-    void nextSearch() { numOfSearchShiftTwo = (numOfSearchShiftTwo + 4) & 0xfc; }
+    void nextSearch();
+    void *getCluster(U64 hash) { return table + ((hash & sizemask) << clustershift); }
 };
 
 
+// Pawn attacks and semiopen files are cheap to get from the pawn bitboards and not stored in the pawn hash
 typedef struct pawnhashentry {
-    uint32_t hashupper;
+    uint32_t hashupper;     // xor'ed with the data so a torn entry of the shared pawn hash doesn't verify
     int32_t value;
-    U64 passedpawnbb[2];
-    U64 attacked[2];
-    U64 attackedBy2[2];
-    bool bothFlanks;
-    unsigned char semiopen[2];
+    U64 passedpawnbb;       // passed pawns of both sides
 } S_PAWNHASHENTRY;
 
+#define PAWNHASHFOLD(e) ((uint32_t)(e)->value ^ (uint32_t)(e)->passedpawnbb ^ (uint32_t)((e)->passedpawnbb >> 32))
+
+static_assert(sizeof(S_PAWNHASHENTRY) == 16, "pawnhashentry should fit four times into a cache line");
+
 
 class Pawnhash
 {
@@ -629,33 +773,58 @@ public:
     S_PAWNHASHENTRY *table;
     U64 size;
     U64 sizemask;
+    int pagemode;
     Pawnhash(int sizeMb);
     ~Pawnhash();
-    bool probeHash(U64 hash, pawnhashentry **entry);
+    bool probeHash(U64 hash, pawnhashentry *entry);
+    void addHash(U64 hash, pawnhashentry *entry);
 };
 
 
-#define MATERIALHASHSIZE 0x10000
-#define MATERIALHASHMASK (MATERIALHASHSIZE - 1)
+// Direct mapped per-thread cache of the static eval; an entry holds the upper 48 bits of the hash and the score
+#define EVALHASHSCOREMASK 0xffffULL
+
+class Evalhash
+{
+public:
+    U64 *table;
+    U64 size;
+    U64 sizemask;
+    Evalhash(int sizeMb);
+    ~Evalhash();
+    bool probeHash(U64 hash, int *score) {
+        U64 e = table[hash & sizemask];
+        *score = (int16_t)(e & EVALHASHSCOREMASK);
+        return !((e ^ hash) & ~EVALHASHSCOREMASK);
+    }
+    void addHash(U64 hash, int score) { table[hash & sizemask] = (hash & ~EVALHASHSCOREMASK) | (uint16_t)score; }
+    void clean();
+};
+
 
+// Shared material table indexed by the piece counts of both sides; built once at startup
+// Up to 8 pawns, 2 knights, 2 bishops, 2 rooks and 1 queen per side are indexed, other material is computed on the fly
+#define MATERIALSIDESIZE (9 * 3 * 3 * 3 * 2)
+#define MATERIALTABLESIZE (MATERIALSIDESIZE * MATERIALSIDESIZE)
 
-struct Materialhashentry {
-    U64 hash;
-    int scale[2];
+struct materialentry {
+    uint8_t scale[2];
+    uint8_t numOfPawns;
     bool onlyPawns;
-    int numOfPawns;
-    int(*endgame)(chessposition*);
+    bool oppositeBishops;   // single bishops that scale with SCALE_OCB when on different colors
+    uint8_t endgame;        // index of a special endgame evaluation; 0 for none
+    uint8_t padding[2];
 };
 
+static_assert(sizeof(materialentry) == 8, "materialentry should fit into 64 bits");
 
-class Materialhash
-{
-public:
-    Materialhashentry *table;
-    Materialhash();
-    ~Materialhash();
-    bool probeHash(U64 hash, Materialhashentry **entry);
-};
+// The material index of a position is kept incrementally as sum of the piece weights;
+// promoted material that doesn't fit into the table sets the overflow bit
+#define MATERIALOVERFLOW (1 << 24)
+extern const int materialweight[14];
+
+void initMaterialTable();
+int getMaterialIndex(chessposition *pos);
 
 
 extern zobrist zb;
@@ -898,6 +1067,7 @@ struct chessmovestack
     unsigned long long hash;
     unsigned long long pawnhash;
     unsigned long long materialhash;
+    int materialindex;
     int halfmovescounter;
     int fullmovescounter;
     U64 isCheckbb;
@@ -998,39 +1168,62 @@ extern U64 pawn_attacks_to[64][2];
 extern U64 knight_attacks[64];
 extern U64 king_attacks[64];
 
+// Slider attacks of all squares share one table; the subtable of a square has 2^(bits of mask) entries
+// and is indexed by a fancy magic or by PEXT on cpus with a fast BMI2 implementation
 struct SMagic {
-    U64 mask;  // to mask relevant squares of both lines (no outer squares)
-    U64 magic; // magic 64-bit factor
+    U64 mask;       // to mask relevant squares of both lines (no outer squares)
+    U64 magic;      // magic 64-bit factor
+    U64 *attacks;   // subtable in mSliderAttacks
+    int shift;      // 64 - bits of mask
 };
 
 extern SMagic mBishopTbl[64];
 extern SMagic mRookTbl[64];
-
-#define BISHOPINDEXBITS 9
-#define ROOKINDEXBITS 12
-#define MAGICBISHOPINDEX(m,x) (int)((((m) & mBishopTbl[x].mask) * mBishopTbl[x].magic) >> (64 - BISHOPINDEXBITS))
-#define MAGICROOKINDEX(m,x) (int)((((m) & mRookTbl[x].mask) * mRookTbl[x].magic) >> (64 - ROOKINDEXBITS))
-#define MAGICBISHOPATTACKS(m,x) (mBishopAttacks[x][MAGICBISHOPINDEX(m,x)])
-#define MAGICROOKATTACKS(m,x) (mRookAttacks[x][MAGICROOKINDEX(m,x)])
-
-extern U64 mBishopAttacks[64][1 << BISHOPINDEXBITS];
-extern U64 mRookAttacks[64][1 << ROOKINDEXBITS];
+extern bool usePext;
+
+// The index scheme P is a compile time constant in the hot code; the slider using functions are templates
+// on it (bool Pext) and their entry points dispatch once on usePext together with the side to move
+#define BISHOPATTACKTABLESIZE 5248
+#define ROOKATTACKTABLESIZE 102400
+#define MAGICINDEX(P,m,t) (P ? (int)PEXT((m), (t).mask) : (int)((((m) & (t).mask) * (t).magic) >> (t).shift))
+#define MAGICBISHOPATTACKS(P,m,x) (mBishopTbl[x].attacks[MAGICINDEX(P, m, mBishopTbl[x])])
+#define MAGICROOKATTACKS(P,m,x) (mRookTbl[x].attacks[MAGICINDEX(P, m, mRookTbl[x])])
+
+extern U64 mSliderAttacks[BISHOPATTACKTABLESIZE + ROOKATTACKTABLESIZE];
+extern const U64 bishopMagics[64];  // generated in tables.cpp
+extern const U64 rookMagics[64];
+bool cpuHasFastPext();
+const char *cpuIsaLevel();
+void initSliderAttacks(bool withPext, bool findMagics = false);
+
+#define CUCKOOSIZE 0x2000
+#define CUCKOOH1(x) ((int)((x) & (CUCKOOSIZE - 1)))
+#define CUCKOOH2(x) ((int)(((x) >> 16) & (CUCKOOSIZE - 1)))
+extern U64 cuckooKey[CUCKOOSIZE];
+extern uint16_t cuckooMove[CUCKOOSIZE];
 
 enum MoveType { QUIET = 1, CAPTURE = 2, PROMOTE = 4, TACTICAL = 6, ALL = 7 };
 enum RootsearchType { SinglePVSearch, MultiPVSearch, PonderSearch };
 
+// The generators dispatch once on the side to move and the slider index scheme to the templated versions
 int CreateEvasionMovelist(chessposition *pos, chessmove* mstart);
+template <int Me, bool Pext> int CreateEvasionMovelist(chessposition *pos, chessmove* mstart);
 template <MoveType Mt> int CreateMovelist(chessposition *pos, chessmove* mstart);
-template <PieceType Pt> inline int CreateMovelistPiece(chessposition *pos, chessmove* mstart, U64 occ, U64 targets, int me);
-template <MoveType Mt> inline int CreateMovelistPawn(chessposition *pos, chessmove* mstart, int me);
-inline int CreateMovelistCastle(chessposition *pos, chessmove* mstart, int me);
+template <MoveType Mt, int Me, bool Pext> int CreateMovelist(chessposition *pos, chessmove* mstart);
+template <PieceType Pt, int Me, bool Pext> inline int CreateMovelistPiece(chessposition *pos, chessmove* mstart, U64 occ, U64 targets);
+template <MoveType Mt, int Me> inline int CreateMovelistPawn(chessposition *pos, chessmove* mstart);
+template <int Me> int CreateMovelistCastle(chessposition *pos, chessmove* mstart);
 template <MoveType Mt> void evaluateMoves(chessmovelist *ml, chessposition *pos, int16_t **cmptr);
 
 enum AttackType { FREE, OCCUPIED, OCCUPIEDANDKING };
 
 struct positioneval {
     pawnhashentry *phentry;
-    Materialhashentry *mhentry;
+    materialentry *mhentry;
+    U64 pawnattacks[2];
+    U64 pawnattacksBy2[2];
+    unsigned char semiopen[2];
+    bool bothFlanks;
     int kingattackpiececount[2][7] = { { 0 } };
     int kingringattacks[2] = { 0 };
     int kingattackers[2];
@@ -1042,6 +1235,76 @@ enum PvAbortType {
     PVA_FUTILITYPRUNED, PVA_SEEPRUNED, PVA_BADHISTORYPRUNED, PVA_MULTICUT, PVA_BESTMOVE, PVA_NOTBESTMOVE, PVA_OMITTED, PVA_BETACUT, PVA_BELOWALPHA }; 
 #endif
 
+// NNUE evaluation with HalfKP networks; see nnue.cpp
+#define NNUEHIDDEN 256
+extern bool NnueReady;
+bool NnueReadNet(string path);
+const char *NnueSimdName();
+
+// Search statistics; every thread counts in its own position and the counters are summed up on request
+// The struct fills whole cache lines so the counters of a thread never share a line with other data
+struct alignas(64) statistic {
+    U64 qs_n[2];                // total calls to qs split into no check / check
+    U64 qs_tt;                  // qs hits tt
+    U64 qs_pat;                 // qs returns with pat score
+    U64 qs_lazy;                // qs stand pat evaluations that exit lazily
+    U64 qs_delta;               // qs return with delta pruning before move loop
+    U64 qs_loop_n;              // qs enters moves loop
+    U64 qs_move_delta;          // qs moves delta-pruned
+    U64 qs_moves;               // moves done in qs
+    U64 qs_moves_fh;            // qs moves that cause a fail high
+
+    U64 eval_n;                 // static evaluations requested by alphabeta and qs
+    U64 eval_cache_hit;         // static evaluations found in the eval cache
+    U64 eval_pawn_n;            // pawn hash probes
+    U64 eval_pawn_hit;          // pawn hash hits
+
+    U64 tt_probe;               // tt probes of alphabeta and qs
+    U64 tt_hit;                 // tt probes that found the position
+
+    U64 ab_n;                   // total calls to alphabeta
+    U64 ab_pv;                  // number of PV nodes
+    U64 ab_tt;                  // alphabeta exit by tt hit
+    U64 ab_draw_or_win;         // alphabeta returns draw or mate score
+    U64 ab_qs;                  // alphabeta calls qsearch
+    U64 ab_tb;                  // alphabeta exits with tb score
+
+    U64 prune_futility;         // nodes pruned by reverse futility
+    U64 prune_nm;               // nodes pruned by null move;
+    U64 prune_probcut;          // nodes pruned by PobCut
+    U64 prune_multicut;         // nodes pruned by Multicut (detected by failed singular test)
+
+    U64 moves_loop_n;           // counts how often the moves loop is entered
+    U64 moves_n[2];             // all moves in alphabeta move loop split into quites ans tactical
+    U64 moves_pruned_lmp;       // moves pruned by lmp
+    U64 moves_pruned_futility;  // moves pruned by futility
+    U64 moves_pruned_badsee;    // moves pruned by bad see
+    U64 moves_played[2];        // moves that are played split into quites ans tactical
+    U64 moves_fail_high;        // moves that cause a fail high;
+    U64 moves_bad_hash;         // hash moves that are repicked in the bad tactical stage
+
+    U64 red_total;              // total reductions
+    U64 red_lmr[2];             // total late-move-reductions for (not) improved moves
+    U64 red_pi[2];              // number of quiets moves that are reduced split into (not) / improved moves
+    S64 red_history;            // total reduction by history
+    S64 red_pv;                 // total reduction by pv nodes
+    S64 red_correction;         // total reduction correction by over-/underflow
+    U64 red_research;           // reduced moves that fail high and are searched again without reduction
+
+    U64 extend_singular;        // total extended moves
+};
+static_assert(sizeof(statistic) % 64 == 0, "statistic should fill whole cache lines");
+
+// Per ply buffers of a thread position; allocated with the thread and never copied
+struct plybuffers
+{
+    uint32_t pvtable[MAXDEPTH][MAXDEPTH];
+    chessmovelist captureslist[MAXDEPTH];
+    chessmovelist quietslist[MAXDEPTH];
+    chessmovelist singularcaptureslist[MAXDEPTH];
+    chessmovelist singularquietslist[MAXDEPTH];
+};
+
 class chessposition
 {
 public:
@@ -1058,6 +1321,7 @@ public:
     unsigned long long hash;
     unsigned long long pawnhash;
     unsigned long long materialhash;
+    int materialindex;
     int halfmovescounter;
     int fullmovescounter;
     U64 isCheckbb;
@@ -1066,9 +1330,6 @@ public:
     U64 kingPinned[2];
 
     uint8_t mailbox[BOARDSIZE]; // redundand for faster "which piece is on field x"
-    chessmovestack movestack[MAXMOVESEQUENCELENGTH];
-    uint16_t excludemovestack[MAXMOVESEQUENCELENGTH];
-    int16_t staticevalstack[MAXMOVESEQUENCELENGTH];
     int mstop;      // 0 at last non-reversible move before root, rootheight at root position
     int ply;        // 0 at root position
     int rootheight; // fixed stack offset in root position 
@@ -1083,7 +1344,6 @@ public:
     int LegalMoves[MAXDEPTH];
     uint32_t killer[MAXDEPTH][2];
     uint32_t bestFailingLow;
-    Pawnhash *pwnhsh;
     int threadindex;
     int psqval;
 #ifdef SDEBUG
@@ -1094,19 +1354,16 @@ public:
     PvAbortType pvaborttype[MAXMOVESEQUENCELENGTH];
     int pvabortval[MAXMOVESEQUENCELENGTH];
 #endif
-    uint32_t pvtable[MAXDEPTH][MAXDEPTH];
-    uint32_t multipvtable[MAXMULTIPV][MAXDEPTH];
     uint32_t lastpv[MAXDEPTH];
     int ph; // to store the phase during different evaluation functions
     int sc; // to stor scaling factor used for evaluation
+    bool lazyeval;  // last getEval returned early with the window based lazy score
     int useTb;
     int useRootmoveScore;
     int tbPosition;
     chessmove defaultmove; // fallback if search in time trouble didn't finish a single iteration
-    chessmovelist captureslist[MAXDEPTH];
-    chessmovelist quietslist[MAXDEPTH];
-    chessmovelist singularcaptureslist[MAXDEPTH];   // extra move lists for singular testing
-    chessmovelist singularquietslist[MAXDEPTH];
+    int16_t nnueaccumulator[2][NNUEHIDDEN];
+    int nnueksq[2];     // king square the accumulator was calculated for; -1 forces a refresh
 #ifdef EVALTUNE
     bool isQuiet;
     bool noQs;
@@ -1118,29 +1375,56 @@ public:
     void copyPositionTuneSet(positiontuneset *from, evalparam *efrom, positiontuneset *to, evalparam *eto);
     string getGradientString();
 #endif
-    // ...
+
+    // The stacks are copied to the threads only up to mstop
+    chessmovestack movestack[MAXMOVESEQUENCELENGTH];
+    uint16_t excludemovestack[MAXMOVESEQUENCELENGTH];
+    int16_t staticevalstack[MAXMOVESEQUENCELENGTH];
+
+    // Everything below is per thread and never copied
+    Pawnhash *pwnhsh = nullptr;
+    Evalhash *evlhsh = nullptr;
+    plybuffers *plybuf = nullptr;
+    uint32_t (*pvtable)[MAXDEPTH] = nullptr;
+    uint32_t (*multipvtable)[MAXDEPTH] = nullptr;
+    int multipvrows = 0;
+    chessmovelist *captureslist = nullptr;
+    chessmovelist *quietslist = nullptr;
+    chessmovelist *singularcaptureslist = nullptr;   // extra move lists for singular testing
+    chessmovelist *singularquietslist = nullptr;
     int16_t history[2][64][64];
     int16_t counterhistory[14][64][14 * 64];
     uint32_t countermove[14][64];
-    Materialhash mtrlhsh;
+    alignas(64) statistic statistics = {};
 
+    ~chessposition();
+    void allocPlyBuffers(int multipv);
+    size_t copyFrom(chessposition *src);
     bool w2m();
     void BitboardSet(int index, PieceCode p);
     void BitboardClear(int index, PieceCode p);
     void BitboardMove(int from, int to, PieceCode p);
     void BitboardPrint(U64 b);
+    void NnueRefresh(int c);
+    void NnueUpdate(int from, int to, PieceCode p);
+    int NnueGetEval();
     int getFromFen(const char* sFen);
     string toFen();
     bool applyMove(string s);
     void print(ostream* os = &cout);
     int phase();
     U64 movesTo(PieceCode pc, int from);
-    template <PieceType Pt> U64 pieceMovesTo(int from);
+    template <bool Pext> U64 movesTo(PieceCode pc, int from);
+    template <PieceType Pt, bool Pext> U64 pieceMovesTo(int from);
     bool isAttacked(int index, int me);
+    template <int Me, bool Pext> bool isAttacked(int index);
     U64 isAttackedByMySlider(int index, U64 occ, int me);  // special simple version to detect giving check by removing blocker
-    U64 attackedByBB(int index, U64 occ);  // returns bitboard of all pieces of both colors attacking index square 
+    template <bool Pext> U64 isAttackedByMySlider(int index, U64 occ, int me);
+    template <bool Pext> U64 attackedByBB(int index, U64 occ);  // returns bitboard of all pieces of both colors attacking index square 
     template <AttackType At> U64 isAttackedBy(int index, int col);    // returns the bitboard of cols pieces attacking the index square; At controls if pawns are moved to block or capture
+    template <AttackType At, bool Pext> U64 isAttackedBy(int index, int col);
     bool see(uint32_t move, int threshold);
+    template <int Me, bool Pext> bool see(uint32_t move, int threshold);
     int getBestPossibleCapture();
     void getRootMoves();
     void tbFilterRootMoves();
@@ -1148,24 +1432,46 @@ public:
     string movesOnStack();
     bool playMove(chessmove *cm);
     void unplayMove(chessmove *cm);
+    template <int Me, bool TestLegal, bool Pext> bool playMove(chessmove *cm);
+    template <int Me> void unplayMove(chessmove *cm);
+    template <int Me> void playCastle(uint32_t code);
+    template <int Me> void unplayCastle(uint32_t code);
+    template <int Me> void playPromotion(int from, int to, PieceCode promote);
+    template <int Me> void playEpCapture(int from, int to);
+    template <int Me> void restorePieces(int from, int to, PieceCode pfrom, PieceCode promote, PieceCode capture);
     void playNullMove();
     void unplayNullMove();
     void updatePins();
+    template <bool Pext> void updatePins();
     bool moveGivesCheck(uint32_t c);  // simple and imperfect as it doesn't handle special moves and cases (mainly to avoid pruning of important moves)
+    template <bool Pext> bool moveGivesCheck(uint32_t c);
     bool moveIsPseudoLegal(uint32_t c);     // test if move is possible in current position
+    template <bool Pext> bool moveIsPseudoLegal(uint32_t c);
+    bool moveIsLegal(uint32_t c);           // test if pseudo legal move doesn't leave the king in check
+    template <bool Pext> bool moveIsLegal(uint32_t c);
     uint32_t shortMove2FullMove(uint16_t c); // transfer movecode from tt to full move code without checking if pseudoLegal
     int getpsqval(bool showDetails = false);  // only for eval trace and mirror test
     template <EvalType Et, int Me> int getGeneralEval(positioneval *pe);
-    template <EvalType Et, PieceType Pt, int Me> int getPieceEval(positioneval *pe);
-    template <EvalType Et, int Me> int getLateEval(positioneval *pe);
+    template <EvalType Et, PieceType Pt, int Me, bool Pext> int getPieceEval(positioneval *pe);
+    template <EvalType Et, int Me, bool Pext> int getLateEval(positioneval *pe);
     template <EvalType Et, int Me> void getPawnAndKingEval(pawnhashentry *entry);
-    template <EvalType Et> int getEval();
-    void getScaling(Materialhashentry *mhentry);
-    int getComplexity(int eval, pawnhashentry *phentry, Materialhashentry *mhentry);
+    template <EvalType Et> int getEval(int alpha = NOSCORE, int beta = -NOSCORE);
+    int getCachedEval(int alpha = NOSCORE, int beta = -NOSCORE);
+    void getMaterialEntry(materialentry *mentry);
+    int getComplexity(int eval, positioneval *pe);
 
     template <RootsearchType RT> int rootsearch(int alpha, int beta, int depth);
     int alphabeta(int alpha, int beta, int depth);
     int getQuiescence(int alpha, int beta, int depth);
+
+    // HOTFUNC bodies of functions that are also called from other units. gcc keeps the clones local to their
+    // unit, so only that unit calls them directly; the others call the plain function without the Hot suffix.
+    void NnueUpdateHot(int from, int to, PieceCode p);
+    int NnueGetEvalHot();
+    int phaseHot();
+    template <EvalType Et, bool Pext> int getEvalHot(int alpha, int beta);
+    int getQuiescenceHot(int alpha, int beta, int depth);
+
     void updateHistory(uint32_t code, int16_t **cmptr, int value);
     void getCmptr(int16_t **cmptr);
     void updatePvTable(uint32_t mc, bool recursive);
@@ -1179,6 +1485,7 @@ public:
     void pvdebugout();
 #endif
     int testRepetiton();
+    bool hasGameCycle();
     void mirror();
 };
 
@@ -1186,7 +1493,7 @@ public:
 // uci stuff
 //
 
-enum GuiToken { UNKNOWN, UCI, UCIDEBUG, ISREADY, SETOPTION, REGISTER, UCINEWGAME, POSITION, GO, STOP, PONDERHIT, QUIT, EVAL, PERFT
+enum GuiToken { UNKNOWN, UCI, UCIDEBUG, ISREADY, SETOPTION, REGISTER, UCINEWGAME, POSITION, GO, STOP, PONDERHIT, QUIT, EVAL, PERFT, STATS
 };
 
 const map<string, GuiToken> GuiCommandMap = {
@@ -1202,7 +1509,8 @@ const map<string, GuiToken> GuiCommandMap = {
     { "ponderhit", PONDERHIT },
     { "quit", QUIT },
     { "eval", EVAL },
-    { "perft", PERFT }
+    { "perft", PERFT },
+    { "stats", STATS }
 };
 
 //
@@ -1249,7 +1557,7 @@ class engine
 public:
     engine();
     ~engine();
-    const char* name = ENGINEVER;
+    char name[64];
     const char* author = "Andreas Matthies";
     bool isWhite;
     U64 tbhits;
@@ -1262,11 +1570,18 @@ public:
     bool infinite;
     bool debug = false;
     bool evaldetails = false;
+    bool searchstatistics = false;
+    int statisticsinterval;
+    U64 statisticstime;
     bool moveoutput;
     int stopLevel = ENGINETERMINATEDSEARCH;
     int Hash;
+    string HashFile;
+    string SharedHash;
     int restSizeOfTp = 0;
     int sizeOfPh;
+    bool sharedPawnhash;
+    Pawnhash *sharedpwnhsh = nullptr;
     int moveOverhead;
     int MultiPV;
     bool ponder;
@@ -1274,14 +1589,28 @@ public:
     string SyzygyPath;
     bool Syzygy50MoveRule = true;
     int SyzygyProbeLimit;
+    bool useNnue = false;
+    string NnueNetpath;
+    int lazyEvalMargin;
+    int sizeOfEh = 0;
     chessposition rootposition;
     int Threads;
+    bool useNuma;
+    bool hugePages;
+    bool lazyClearHash;
+    int ttFormat;
+    int ttReplace;
+    int pageMode = PAGES1G;     // first page size tried for the large tables
+    int threadsPageMode;
+    bool reportPageModes = false;   // set by the uci command; the options set their defaults before
     searchthread *sthread;
     enum { NO, PONDERING, HITPONDER } pondersearch;
     int terminationscore = SHRT_MAX;
     int lastReport;
     int benchdepth;
     string benchmove;
+    U64 firstinfotime;
+    size_t threadCopyBytes;
     ucioptions_t ucioptions;
 #ifdef STACKDEBUG
     string assertfile = "";
@@ -1295,8 +1624,15 @@ public:
     void send(const char* format, ...);
     void communicate(string inputstring);
     void allocThreads();
+    void freeThreads();
+    void sendPageModes(bool hash, bool threads);
     void allocPawnhash();
+    void allocEvalhash();
+    void startThreads(void (*job)(searchthread*));
+    void waitThreads();
     U64 getTotalNodes();
+    void getStatistics(statistic *st);
+    void resetStatistics();
     bool isPondering() { return (pondersearch == PONDERING); }
     void HitPonder() { pondersearch = HITPONDER; }
     bool testPonderHit() { return (pondersearch == HITPONDER); }
@@ -1312,10 +1648,11 @@ PieceType GetPieceType(char c);
 struct enginestate
 {
 public:
-    int phase;
+    atomic<int> phase;  // set by the reader thread; the results are written before phase 3 is published
+    U64 uciokTime;
     string bestmoves;
     string avoidmoves;
-    clock_t starttime;
+    U64 starttime;
     int firstbesttimesec;
     int score;
     int allscore;
@@ -1329,6 +1666,14 @@ public:
 
 extern engine en;
 
+void search_statistics(statistic *st);
+
+// some macros to limit the statistics code inside the search; counting is switched on by the Statistics option
+#define STATISTICSINC(x)            STATISTICSADD(x, 1)
+#define STATISTICSADD(x, v)         STATISTICSPOSADD(this, x, v)
+#define STATISTICSPOSINC(p, x)      STATISTICSPOSADD(p, x, 1)
+#define STATISTICSPOSADD(p, x, v)   do { if (en.searchstatistics) (p)->statistics.x += (v); } while (0)
+
 #ifdef SDEBUG
 #define SDEBUGDO(c, s) if (c) {s}
 #else
@@ -1344,19 +1689,31 @@ class searchthread
 public:
     chessposition pos;
     Pawnhash *pwnhsh;
+    Evalhash *evlhsh;
     thread thr;
+    mutex mtx;
+    condition_variable cv;
+    void (*job)(searchthread*);     // job to run or running; nullptr when the thread is parked
+    bool exitThread;
     int index;
     int depth;
     int numofthreads;
     int lastCompleteDepth;
+    int numaNode;
     searchthread *searchthreads;
     searchthread();
     ~searchthread();
+    void idleLoop();
+    void startJob(void (*j)(searchthread*));
+    void waitForJob();
 };
 
 void searchStart();
 void searchWaitStop(bool forceStop = true);
-void searchinit();
+#define MAXLMPDEPTH 9
+extern const int reductiontable[2][MAXDEPTH][64];   // generated in tables.cpp
+extern const int lmptable[2][MAXLMPDEPTH];
+void calcSearchTables(int reduction[2][MAXDEPTH][64], int lmp[2][MAXLMPDEPTH]);
 void resetEndTime(int constantRootMoves, bool complete = true);
 
 
@@ -1375,60 +1732,5 @@ int root_probe_wdl(chessposition *pos);
 //
 // statistics stuff
 //
-#ifdef STATISTICS
-struct statistic {
-    U64 qs_n[2];                // total calls to qs split into no check / check
-    U64 qs_tt;                  // qs hits tt
-    U64 qs_pat;                 // qs returns with pat score
-    U64 qs_delta;               // qs return with delta pruning before move loop
-    U64 qs_loop_n;              // qs enters moves loop
-    U64 qs_move_delta;          // qs moves delta-pruned
-    U64 qs_moves;               // moves done in qs
-    U64 qs_moves_fh;            // qs moves that cause a fail high
-
-    U64 ab_n;                   // total calls to alphabeta
-    U64 ab_pv;                  // number of PV nodes
-    U64 ab_tt;                  // alphabeta exit by tt hit
-    U64 ab_draw_or_win;         // alphabeta returns draw or mate score
-    U64 ab_qs;                  // alphabeta calls qsearch
-    U64 ab_tb;                  // alphabeta exits with tb score
-
-    U64 prune_futility;         // nodes pruned by reverse futility
-    U64 prune_nm;               // nodes pruned by null move;
-    U64 prune_probcut;          // nodes pruned by PobCut
-    U64 prune_multicut;         // nodes pruned by Multicut (detected by failed singular test)
-
-    U64 moves_loop_n;           // counts how often the moves loop is entered
-    U64 moves_n[2];             // all moves in alphabeta move loop split into quites ans tactical
-    U64 moves_pruned_lmp;       // moves pruned by lmp
-    U64 moves_pruned_futility;  // moves pruned by futility
-    U64 moves_pruned_badsee;    // moves pruned by bad see
-    U64 moves_played[2];        // moves that are played split into quites ans tactical
-    U64 moves_fail_high;        // moves that cause a fail high;
-    U64 moves_bad_hash;         // hash moves that are repicked in the bad tactical stage
-
-    U64 red_total;              // total reductions
-    U64 red_lmr[2];             // total late-move-reductions for (not) improved moves
-    U64 red_pi[2];              // number of quiets moves that are reduced split into (not) / improved moves
-    S64 red_history;            // total reduction by history
-    S64 red_pv;                 // total reduction by pv nodes
-    S64 red_correction;         // total reduction correction by over-/underflow
-
-    U64 extend_singular;        // total extended moves
-};
 
-extern struct statistic statistics;
-
-void search_statistics();
-
-// some macros to limit the ifdef STATISTICS inside the code
-#define STATISTICSINC(x)        statistics.x++ 
-#define STATISTICSADD(x, v)     statistics.x += (v)
-#define STATISTICSDO(x)         x
-
-#else
-#define STATISTICSINC(x)
-#define STATISTICSADD(x, v)
-#define STATISTICSDO(x)
-#endif
 
@@ -230,6 +230,45 @@ void chessmovesequencelist::print()
 }
 
 
+chessposition::~chessposition()
+{
+    delete plybuf;
+    delete[] multipvtable;
+}
+
+
+void chessposition::allocPlyBuffers(int multipv)
+{
+    if (!plybuf)
+    {
+        plybuf = new plybuffers;
+        pvtable = plybuf->pvtable;
+        captureslist = plybuf->captureslist;
+        quietslist = plybuf->quietslist;
+        singularcaptureslist = plybuf->singularcaptureslist;
+        singularquietslist = plybuf->singularquietslist;
+    }
+    if (multipv > multipvrows)
+    {
+        delete[] multipvtable;
+        multipvtable = new uint32_t[multipv][MAXDEPTH];
+        multipvrows = multipv;
+    }
+}
+
+
+// copy the position and the used part of the stacks but keep history and buffers; returns the number of bytes copied
+size_t chessposition::copyFrom(chessposition *src)
+{
+    size_t n = src->mstop + 1;
+    memcpy((void*)this, src, offsetof(chessposition, movestack));
+    memcpy(movestack, src->movestack, n * sizeof(chessmovestack));
+    memcpy(excludemovestack, src->excludemovestack, n * sizeof(uint16_t));
+    memcpy(staticevalstack, src->staticevalstack, n * sizeof(int16_t));
+    return offsetof(chessposition, movestack) + n * (sizeof(chessmovestack) + sizeof(uint16_t) + sizeof(int16_t));
+}
+
+
 bool chessposition::w2m()
 {
     return !(state & S2MMASK);
@@ -274,6 +313,7 @@ int chessposition::getFromFen(const char* sFen)
     int numToken = (int)token.size();
 
     psqval = 0;
+    nnueksq[WHITE] = nnueksq[BLACK] = -1;
 
     for (int i = 0; i < 14; i++)
         piece00[i] = 0ULL;
@@ -450,6 +490,7 @@ int chessposition::getFromFen(const char* sFen)
     hash = zb.getHash(this);
     pawnhash = zb.getPawnHash(this);
     materialhash = zb.getMaterialHash(this);
+    materialindex = getMaterialIndex(this);
     mstop = 0;
     rootheight = 0;
     lastnullmove = -1;
@@ -481,7 +522,11 @@ bool chessposition::applyMove(string s)
 
     prepareStack();
 
+#ifdef LEGALMOVEGEN
+    if (m.code && moveIsLegal(m.code) && playMove(&m))
+#else
     if (playMove(&m))
+#endif
     {
         if (halfmovescounter == 0)
         {
@@ -654,6 +699,73 @@ int chessposition::testRepetiton()
 }
 
 
+// Cuckoo tables with the hash differences of all reversible piece moves on an empty board
+// used to detect a possible repetition by a single move of the side to move (same paper as above)
+U64 cuckooKey[CUCKOOSIZE];
+uint16_t cuckooMove[CUCKOOSIZE];
+
+static void initCuckoo()
+{
+    memset(cuckooKey, 0, sizeof(cuckooKey));
+    memset(cuckooMove, 0, sizeof(cuckooMove));
+    int count = 0;
+    for (PieceCode pc = WKNIGHT; pc <= BKING; pc++)
+    {
+        PieceType p = pc >> 1;
+        for (int from = 0; from < 64; from++)
+        {
+            U64 attacks = (p == KNIGHT ? knight_attacks[from]
+                : p == KING ? king_attacks[from]
+                : (p == BISHOP || p == QUEEN ? MAGICBISHOPATTACKS(usePext, 0ULL, from) : 0ULL)
+                | (p == ROOK || p == QUEEN ? MAGICROOKATTACKS(usePext, 0ULL, from) : 0ULL));
+            for (int to = from + 1; to < 64; to++)
+            {
+                if (!(attacks & BITSET(to)))
+                    continue;
+                U64 key = zb.boardtable[(from << 4) | pc] ^ zb.boardtable[(to << 4) | pc] ^ zb.s2m;
+                uint16_t move = (uint16_t)((from << 6) | to);
+                int i = CUCKOOH1(key);
+                while (true)
+                {
+                    swap(cuckooKey[i], key);
+                    swap(cuckooMove[i], move);
+                    if (!move)
+                        break;
+                    // push the old entry to its alternative slot
+                    i = (i == CUCKOOH1(key) ? CUCKOOH2(key) : CUCKOOH1(key));
+                }
+                count++;
+            }
+        }
+    }
+    myassert(count == 3668, nullptr, 1, count);
+}
+
+
+// test if the side to move can reach a position of the stack with one reversible move
+bool chessposition::hasGameCycle()
+{
+    int lastrepply = max(mstop - halfmovescounter, lastnullmove + 1);
+    U64 occupied = occupied00[0] | occupied00[1];
+    for (int i = mstop - 3; i >= lastrepply; i -= 2)
+    {
+        U64 movekey = hash ^ movestack[i].hash;
+        int j = CUCKOOH1(movekey);
+        if (cuckooKey[j] != movekey)
+        {
+            j = CUCKOOH2(movekey);
+            if (cuckooKey[j] != movekey)
+                continue;
+        }
+        if (betweenMask[cuckooMove[j] >> 6][cuckooMove[j] & 0x3f] & occupied)
+            continue;
+        // only trust cycles completely inside the search tree
+        if (i > rootheight)
+            return true;
+    }
+    return false;
+}
+
 
 void chessposition::mirror()
 {
@@ -705,6 +817,7 @@ void chessposition::mirror()
     kingpos[0] = kingpos[1] ^ RANKMASK;
     kingpos[1] = kingpostemp ^ RANKMASK;
     materialhash = zb.getMaterialHash(this);
+    materialindex = getMaterialIndex(this);
     updatePins();
 }
 
@@ -789,7 +902,7 @@ uint32_t chessposition::shortMove2FullMove(uint16_t c)
 
 
 // FIXME: moveIsPseudoLegal gets more and more complicated with making it "thread safe"; maybe using 32bit for move in tp would be better?
-bool chessposition::moveIsPseudoLegal(uint32_t c)
+template <bool Pext> HOTFUNC bool chessposition::moveIsPseudoLegal(uint32_t c)
 {
     if (!c)
         return false;
@@ -858,7 +971,7 @@ bool chessposition::moveIsPseudoLegal(uint32_t c)
     myassert(capture >= BLANK && capture <= BQUEEN, this, 1, capture);
 
     // correct target for type of piece?
-    if (!(movesTo(pc, from) & BITSET(to)))
+    if (!(movesTo<Pext>(pc, from) & BITSET(to)))
         return false;
 
     // correct s2m?
@@ -882,7 +995,7 @@ bool chessposition::moveIsPseudoLegal(uint32_t c)
             // test if "making ep capture possible" is both true or false
             int myept = GETEPT(c);
             {
-                if (!myept == (bool)(epthelper[to] & piece00[pc ^ 1]))
+                if ((myept != 0) != ((epthelper[to] & piece00[pc ^ 1]) != 0))
                     return false;
             }
         }
@@ -904,7 +1017,55 @@ bool chessposition::moveIsPseudoLegal(uint32_t c)
 }
 
 
-void chessposition::updatePins()
+bool chessposition::moveIsPseudoLegal(uint32_t c)
+{
+    return usePext ? moveIsPseudoLegal<true>(c) : moveIsPseudoLegal<false>(c);
+}
+
+
+// Tests a pseudo legal move for legality without playing it; checks, ep captures and castles are rare and just tested by playing
+template <bool Pext> bool chessposition::moveIsLegal(uint32_t c)
+{
+    int me = state & S2MMASK;
+    int you = me ^ S2MMASK;
+    int from = GETFROM(c);
+    int to = GETTO(c);
+    int k = kingpos[me];
+
+    if (isCheckbb || ISEPCAPTUREORCASTLE(c))
+    {
+        chessmove m;
+        m.code = c;
+        prepareStack();
+        if (!(me ? playMove<BLACK, true, Pext>(&m) : playMove<WHITE, true, Pext>(&m)))
+            return false;
+        unplayMove(&m);
+        return true;
+    }
+
+    if (from == k)
+    {
+        // king must not move to an attacked square; remove it from occupancy to find sliders behind it
+        U64 occ = (occupied00[0] | occupied00[1]) ^ BITSET(from);
+        return !(knight_attacks[to] & piece00[WKNIGHT | you]
+            || king_attacks[to] & piece00[WKING | you]
+            || pawn_attacks_to[to][me] & piece00[(PAWN << 1) | you]
+            || MAGICROOKATTACKS(Pext, occ, to) & (piece00[WROOK | you] | piece00[WQUEEN | you])
+            || MAGICBISHOPATTACKS(Pext, occ, to) & (piece00[WBISHOP | you] | piece00[WQUEEN | you]));
+    }
+
+    // pinned pieces may only move on the line to the king
+    return !(kingPinned[me] & BITSET(from)) || (betweenMask[k][to] & BITSET(from)) || (betweenMask[k][from] & BITSET(to));
+}
+
+
+bool chessposition::moveIsLegal(uint32_t c)
+{
+    return usePext ? moveIsLegal<true>(c) : moveIsLegal<false>(c);
+}
+
+
+template <bool Pext> void chessposition::updatePins()
 {
     for (int me = WHITE; me <= BLACK; me++)
     {
@@ -912,8 +1073,8 @@ void chessposition::updatePins()
         int k = kingpos[me];
         kingPinned[me] = 0ULL;
         U64 occ = occupied00[you];
-        U64 attackers = MAGICROOKATTACKS(occ, k) & (piece00[WROOK | you] | piece00[WQUEEN | you]);
-        attackers |= MAGICBISHOPATTACKS(occ, k) & (piece00[WBISHOP | you] | piece00[WQUEEN | you]);
+        U64 attackers = MAGICROOKATTACKS(Pext, occ, k) & (piece00[WROOK | you] | piece00[WQUEEN | you]);
+        attackers |= MAGICBISHOPATTACKS(Pext, occ, k) & (piece00[WBISHOP | you] | piece00[WQUEEN | you]);
         
         while (attackers)
         {
@@ -926,7 +1087,16 @@ void chessposition::updatePins()
 }
 
 
-bool chessposition::moveGivesCheck(uint32_t c)
+void chessposition::updatePins()
+{
+    if (usePext)
+        updatePins<true>();
+    else
+        updatePins<false>();
+}
+
+
+template <bool Pext> bool chessposition::moveGivesCheck(uint32_t c)
 {
     int pc = GETPIECE(c);
 
@@ -939,17 +1109,23 @@ bool chessposition::moveGivesCheck(uint32_t c)
     int yourKing = kingpos[you];
 
     // test if moving piece gives check
-    if (movesTo(pc, GETTO(c)) & BITSET(yourKing))
+    if (movesTo<Pext>(pc, GETTO(c)) & BITSET(yourKing))
         return true;
 
     // test for discovered check
-    if (isAttackedByMySlider(yourKing, (occupied00[0] | occupied00[1]) ^ BITSET(GETTO(c)) ^ BITSET(GETFROM(c)), me))
+    if (isAttackedByMySlider<Pext>(yourKing, (occupied00[0] | occupied00[1]) ^ BITSET(GETTO(c)) ^ BITSET(GETFROM(c)), me))
         return true;
 
     return false;
 }
 
 
+bool chessposition::moveGivesCheck(uint32_t c)
+{
+    return usePext ? moveGivesCheck<true>(c) : moveGivesCheck<false>(c);
+}
+
+
 void chessposition::print(ostream* os)
 {
 
@@ -1182,12 +1358,12 @@ void chessposition::pvdebugout()
 
 #endif
 
-// shameless copy from http://chessprogramming.wikispaces.com/Magic+Bitboards#Plain
-U64 mBishopAttacks[64][1 << BISHOPINDEXBITS];
-U64 mRookAttacks[64][1 << ROOKINDEXBITS];
+// shameless copy from http://chessprogramming.wikispaces.com/Magic+Bitboards#Fancy
+U64 mSliderAttacks[BISHOPATTACKTABLESIZE + ROOKATTACKTABLESIZE];
 
 SMagic mBishopTbl[64];
 SMagic mRookTbl[64];
+bool usePext = false;
 
 
 
@@ -1214,73 +1390,164 @@ U64 patternToMask(int i, int d, int p)
 U64 getAttacks(int index, U64 occ, int delta)
 {
     U64 attacks = 0ULL;
-    U64 blocked = 0ULL;
     for (int shift = index + delta; ISNEIGHBOUR(shift, shift - delta); shift += delta)
     {
-        if (!blocked)
-        {
-            attacks |= BITSET(shift);
-        }
-        blocked |= ((1ULL << shift) & occ);
+        attacks |= BITSET(shift);
+        if (occ & BITSET(shift))
+            break;
     }
     return attacks;
 }
 
 
-U64 getOccupiedFromMBIndex(int j, U64 mask)
+static const int bishopdeltas[] = { -9, -7, 7, 9 };
+static const int rookdeltas[] = { -8, -1, 1, 8 };
+
+// PEXT needs BMI2; AMD before Zen 3 (family 0x19) implements it in microcode which is slower than magics
+bool cpuHasFastPext()
 {
-    U64 occ = 0ULL;
-    int k;
-    int i = 0;
-    while (mask)
-    {
-        k = pullLsb(&mask);
-        if (j & BITSET(i))
-            occ |= (1ULL << k);
-        i++;
-    }
-    return occ;
+#if defined(PEXTAVAILABLE)
+    unsigned int regs[4] = { 0 };
+    char vendor[13] = { 0 };
+#ifdef _MSC_VER
+    __cpuid((int*)regs, 0);
+#else
+    __cpuid(0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+    unsigned int maxleaf = regs[0];
+    memcpy(vendor, &regs[1], 4);
+    memcpy(vendor + 4, &regs[3], 4);
+    memcpy(vendor + 8, &regs[2], 4);
+    if (maxleaf < 7)
+        return false;
+#ifdef _MSC_VER
+    __cpuid((int*)regs, 1);
+#else
+    __cpuid(1, regs[0], regs[1], regs[2], regs[3]);
+#endif
+    unsigned int family = ((regs[0] >> 8) & 0xf) + ((regs[0] >> 20) & 0xff);
+#ifdef _MSC_VER
+    __cpuidex((int*)regs, 7, 0);
+#else
+    __cpuid_count(7, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+    bool bmi2 = (regs[1] & (1 << 8));
+    return bmi2 && !(strcmp(vendor, "AuthenticAMD") == 0 && family < 0x19);
+#else
+    return false;
+#endif
 }
 
-#if 0  // Code to generate magics below, don't remove
-U64 getMagicCandidate(U64 mask)
+// Name of the instruction set level the hot functions run with; checks the levels in the order of the HOTFUNC clones
+const char *cpuIsaLevel()
 {
-    U64 magic;
-    do {
-        magic = zb.getRnd() & zb.getRnd() & zb.getRnd();
-    } while (POPCOUNT((mask * magic) & 0xFF00000000000000ULL) < 6);
-    return magic;
-}
+#ifdef ISADISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("x86-64-v3"))
+        return "AVX2";
+    if (__builtin_cpu_supports("x86-64-v2"))
+        return "Popcnt";
+    return "Oldcpu";
+#else
+    return PROCDESC;
 #endif
+}
 
-// Use precalculated macigs for better to save time at startup
-const U64 bishopmagics[] = {
-    0x1002004102008200, 0x1002004102008200, 0x4310002248214800, 0x402010c110014208, 0xa000a06240114001, 0xa000a06240114001, 0x402010c110014208, 0xa000a06240114001,
-    0x1002004102008200, 0x1002004102008200, 0x1002004102008200, 0x1002004102008200, 0x100c009840001000, 0x4310002248214800, 0xa000a06240114001, 0x4310002248214800,
-    0x4310002248214800, 0x822143005020a148, 0x0001901c00420040, 0x0880504024308060, 0x0100201004200002, 0xa000a06240114001, 0x822143005020a148, 0x1002004102008200,
-    0x1002004102008200, 0x1002004102008200, 0x1002004102008200, 0x2008080100820102, 0x1481010004104010, 0x0002052000100024, 0xc880221002060081, 0xc880221002060081,
-    0x4310002248214800, 0xc880221002060081, 0x0001901c00420040, 0x8400208020080201, 0x000e008400060020, 0x00449210e3902028, 0x402010c110014208, 0xc880221002060081,
-    0x100c009840001000, 0xc880221002060081, 0x1000820800c00060, 0x2803101084008800, 0x2200608200100080, 0x0040900130840090, 0x0024010008800a00, 0x0400110410804810,
-    0x402010c110014208, 0xa000a06240114001, 0xa000a06240114001, 0x1002004102008200, 0x1002004102008200, 0x1002004102008200, 0x1002004102008200, 0x1002004102008200,
-    0xa000a06240114001, 0x4310002248214800, 0x1002004102008200, 0x1002004102008200, 0x1002004102008200, 0x1002004102008200, 0x1002004102008200, 0x1002004102008200
-};
+static U64 magicRnd(U64 *seed)
+{
+    // xorshift64star
+    *seed ^= *seed >> 12;
+    *seed ^= *seed << 25;
+    *seed ^= *seed >> 27;
+    return *seed * 2685821657736338717ULL;
+}
 
-const U64 rookmagics[] = {
-    0x8200108041020020, 0x8200108041020020, 0xc880221002060081, 0x0009100804021000, 0x0500010004107800, 0x0024010008800a00, 0x0400110410804810, 0x8300038100004222,
-    0x004a800182c00020, 0x0009100804021000, 0x3002200010c40021, 0x0020100104000208, 0x01021001a0080020, 0x0884020010082100, 0x1000820800c00060, 0x8020480110020020,
-    0x0002052000100024, 0x0200190040088100, 0x0030802001a00800, 0x8010002004000202, 0x0040010100080010, 0x2200608200100080, 0x0001901c00420040, 0x0001400a24008010,
-    0x1400a22008001042, 0x8200108041020020, 0x2004500023002400, 0x8105100028001048, 0x8010024d00014802, 0x8000820028030004, 0x402010c110014208, 0x8300038100004222,
-    0x0001804002800124, 0x0084022014041400, 0x0030802001a00800, 0x0110a01001080008, 0x0b10080850081100, 0x000010040049020c, 0x0024010008800a00, 0x014c800040100426,
-    0x1100400010208000, 0x0009100804021000, 0x0010024871202002, 0x8014001028c80801, 0x1201082010a00200, 0x0002008004102009, 0x8300038100004222, 0x0000401001a00408,
-    0x4520920010210200, 0x0400110410804810, 0x8105100028001048, 0x8105100028001048, 0x0802801009083002, 0x8200108041020020, 0x8200108041020020, 0x4000a12400848110,
-    0x2000804026001102, 0x2000804026001102, 0x800040a010040901, 0x80001802002c0422, 0x0010b018200c0122, 0x200204802a080401, 0x8880604201100844, 0x80000cc281092402
-};
+// Find a magic for the subtable of one square by trial and error; the subtable is filled as a side effect
+static U64 findMagic(SMagic *m, const U64 *occ, const U64 *attack, int n, U64 *seed)
+{
+    vector<int> tried(n, 0);
+    for (int t = 1; ; t++)
+    {
+        U64 magic;
+        do
+            magic = magicRnd(seed) & magicRnd(seed) & magicRnd(seed);
+        while (POPCOUNT((m->mask * magic) & 0xFF00000000000000ULL) < 6);
 
+        int i;
+        for (i = 0; i < n; i++)
+        {
+            int index = (int)((occ[i] * magic) >> m->shift);
+            if (tried[index] < t)
+            {
+                tried[index] = t;
+                m->attacks[index] = attack[i];
+            }
+            else if (m->attacks[index] != attack[i])
+                break;
+        }
+        if (i == n)
+            return magic;
+    }
+}
+
+// Fill the slider attack table for the magic or the PEXT index; the magics come from the generated tables.cpp
+// and are only searched by the table generator
+void initSliderAttacks(bool withPext, bool findMagics)
+{
+    U64 occ[1 << 12];
+    U64 attack[1 << 12];
+    // seeds per rank that find the magics fast (taken from Stockfish)
+    const U64 seeds[8] = { 728, 10316, 55013, 32803, 12281, 15100, 16645, 255 };
+    U64 *table = mSliderAttacks;
+    usePext = withPext;
+
+    for (int p = 0; p < 2; p++)
+    {
+        const int *deltas = (p ? rookdeltas : bishopdeltas);
+        for (int from = 0; from < 64; from++)
+        {
+            SMagic *m = (p ? &mRookTbl[from] : &mBishopTbl[from]);
+            int bits = POPCOUNT(m->mask);
+            m->shift = 64 - bits;
+            m->attacks = table;
+            int n = 0;
+            U64 o = 0ULL;
+            do {
+                // enumerate all subsets of the mask
+                occ[n] = o;
+                attack[n] = 0ULL;
+                for (int d = 0; d < 4; d++)
+                    attack[n] |= getAttacks(from, o, deltas[d]);
+                n++;
+                o = (o - m->mask) & m->mask;
+            } while (o);
+
+            if (withPext)
+            {
+                for (int i = 0; i < n; i++)
+                    table[PEXT(occ[i], m->mask)] = attack[i];
+            }
+            else if (findMagics)
+            {
+                U64 seed = seeds[RANK(from)];
+                m->magic = findMagic(m, occ, attack, n, &seed);
+            }
+            else
+            {
+                m->magic = (p ? rookMagics[from] : bishopMagics[from]);
+                for (int i = 0; i < n; i++)
+                    table[(occ[i] * m->magic) >> m->shift] = attack[i];
+            }
+            table += n;
+        }
+    }
+}
 
 void initBitmaphelper()
 {
     int to;
     initPsqtable();
+    initMaterialTable();
     for (int from = 0; from < 64; from++)
     {
         king_attacks[from] = knight_attacks[from] = 0ULL;
@@ -1415,30 +1682,6 @@ void initBitmaphelper()
                 mBishopTbl[from].mask |= BITSET(j);
         }
 
-        // mBishopTbl[from].magic = getMagicCandidate(mBishopTbl[from].mask);
-        mBishopTbl[from].magic = bishopmagics[from];
-
-        for (int j = 0; j < (1 << BISHOPINDEXBITS); j++) {
-            // First get the subset of mask corresponding to j
-            U64 occ = getOccupiedFromMBIndex(j, mBishopTbl[from].mask);
-            // Now get the attack bitmap for this subset and store to attack table
-            U64 attack = (getAttacks(from, occ, -7) | getAttacks(from, occ, 7) | getAttacks(from, occ, -9) | getAttacks(from, occ, 9));
-            int hashindex = MAGICBISHOPINDEX(occ, from);
-            mBishopAttacks[from][hashindex] = attack;
-        }
-
-        // mRookTbl[from].magic = getMagicCandidate(mRookTbl[from].mask);
-        mRookTbl[from].magic = rookmagics[from];
-
-        for (int j = 0; j < (1 << ROOKINDEXBITS); j++) {
-            // First get the subset of mask corresponding to j
-            U64 occ = getOccupiedFromMBIndex(j, mRookTbl[from].mask);
-            // Now get the attack bitmap for this subset and store to attack table
-            U64 attack = (getAttacks(from, occ, -1) | getAttacks(from, occ, 1) | getAttacks(from, occ, -8) | getAttacks(from, occ, 8));
-            int hashindex = MAGICROOKINDEX(occ, from);
-            mRookAttacks[from][hashindex] = attack;
-        }
-
         epthelper[from] = 0ULL;
         if (RANK(from) == 3 || RANK(from) == 4)
         {
@@ -1448,6 +1691,9 @@ void initBitmaphelper()
                 epthelper[from] |= BITSET(from + 1);
         }
     }
+
+    initSliderAttacks(cpuHasFastPext());
+    initCuckoo();
 }
 
 
@@ -1459,6 +1705,8 @@ void chessposition::BitboardSet(int index, PieceCode p)
     piece00[p] |= BITSET(index);
     occupied00[s2m] |= BITSET(index);
     psqval += psqtable[p][index];
+    if (NnueReady)
+        NnueUpdate(-1, index, p);
 }
 
 
@@ -1470,6 +1718,8 @@ void chessposition::BitboardClear(int index, PieceCode p)
     piece00[p] ^= BITSET(index);
     occupied00[s2m] ^= BITSET(index);
     psqval -= psqtable[p][index];
+    if (NnueReady)
+        NnueUpdate(index, -1, p);
 }
 
 
@@ -1482,6 +1732,8 @@ void chessposition::BitboardMove(int from, int to, PieceCode p)
     piece00[p] ^= (BITSET(from) | BITSET(to));
     occupied00[s2m] ^= (BITSET(from) | BITSET(to));
     psqval += psqtable[p][to] - psqtable[p][from];
+    if (NnueReady)
+        NnueUpdate(from, to, p);
 }
 
 
@@ -1498,44 +1750,152 @@ void chessposition::BitboardPrint(U64 b)
 }
 
 
-bool chessposition::playMove(chessmove *cm)
+// Tests if square index is attacked by the opponent of Me
+template <int Me, bool Pext> inline bool chessposition::isAttacked(int index)
 {
-    int s2m = state & S2MMASK;
-    int eptnew = 0;
-    int oldcastle = (state & CASTLEMASK);
+    const int You = Me ^ S2MMASK;
 
-    halfmovescounter++;
+    return knight_attacks[index] & piece00[WKNIGHT | You]
+        || king_attacks[index] & piece00[WKING | You]
+        || pawn_attacks_to[index][Me] & piece00[WPAWN | You]
+        || MAGICROOKATTACKS(Pext, occupied00[0] | occupied00[1], index) & (piece00[WROOK | You] | piece00[WQUEEN | You])
+        || MAGICBISHOPATTACKS(Pext, occupied00[0] | occupied00[1], index) & (piece00[WBISHOP | You] | piece00[WQUEEN | You]);
+}
 
-    // Castle has special play
-    if (ISCASTLE(cm->code))
+
+template <int Me> COLDFUNC void chessposition::playCastle(uint32_t code)
+{
+    // Get castle squares and move king and rook
+    int kingfrom = GETFROM(code);
+    int rookfrom = GETTO(code);
+    int cstli = GETCASTLEINDEX(code);
+    int kingto = castlekingto[cstli];
+    int rookto = castlerookto[cstli];
+    const PieceCode kingpc = (PieceCode)(WKING | Me);
+    const PieceCode rookpc = (PieceCode)(WROOK | Me);
+
+    mailbox[kingfrom] = BLANK;
+    mailbox[rookfrom] = BLANK;
+    mailbox[kingto] = kingpc;
+    mailbox[rookto] = rookpc;
+
+    if (kingfrom != kingto)
     {
-        // Get castle squares and move king and rook
-        int kingfrom = GETFROM(cm->code);
-        int rookfrom = GETTO(cm->code);
-        int cstli = GETCASTLEINDEX(cm->code);
-        int kingto = castlekingto[cstli];
-        int rookto = castlerookto[cstli];
-        PieceCode kingpc = (PieceCode)(WKING | s2m);
-        PieceCode rookpc = (PieceCode)(WROOK | s2m);
+        kingpos[Me] = kingto;
+        BitboardMove(kingfrom, kingto, kingpc);
+        hash ^= zb.boardtable[(kingfrom << 4) | kingpc] ^ zb.boardtable[(kingto << 4) | kingpc];
+        pawnhash ^= zb.boardtable[(kingfrom << 4) | kingpc] ^ zb.boardtable[(kingto << 4) | kingpc];
+    }
+    if (rookfrom != rookto)
+    {
+        BitboardMove(rookfrom, rookto, rookpc);
+        hash ^= zb.boardtable[(rookfrom << 4) | rookpc] ^ zb.boardtable[(rookto << 4) | rookpc];
+    }
+    state &= (Me ? ~(BQCMASK | BKCMASK) : ~(WQCMASK | WKCMASK));
+}
+
+
+template <int Me> COLDFUNC void chessposition::unplayCastle(uint32_t code)
+{
+    // Get castle squares and undo king and rook move
+    int kingfrom = GETFROM(code);
+    int rookfrom = GETTO(code);
+    int cstli = GETCASTLEINDEX(code);
+    int kingto = castlekingto[cstli];
+    int rookto = castlerookto[cstli];
+    const PieceCode kingpc = (PieceCode)(WKING | Me);
+    const PieceCode rookpc = (PieceCode)(WROOK | Me);
+
+    mailbox[kingto] = BLANK;
+    mailbox[rookto] = BLANK;
+    mailbox[kingfrom] = kingpc;
+    mailbox[rookfrom] = rookpc;
 
-        mailbox[kingfrom] = BLANK;
-        mailbox[rookfrom] = BLANK;
-        mailbox[kingto] = kingpc;
-        mailbox[rookto] = rookpc;
+    if (kingfrom != kingto)
+        BitboardMove(kingto, kingfrom, kingpc);
 
-        if (kingfrom != kingto)
+    if (rookfrom != rookto)
+        BitboardMove(rookto, rookfrom, rookpc);
+}
+
+
+template <int Me> COLDFUNC void chessposition::playPromotion(int from, int to, PieceCode promote)
+{
+    const PieceCode pfrom = (PieceCode)(WPAWN | Me);
+    mailbox[to] = promote;
+    BitboardClear(from, pfrom);
+    materialhash ^= zb.boardtable[(POPCOUNT(piece00[pfrom]) << 4) | pfrom];
+    materialhash ^= zb.boardtable[(POPCOUNT(piece00[promote]) << 4) | promote];
+    materialindex += materialweight[promote] - materialweight[pfrom];
+    BitboardSet(to, promote);
+    if (POPCOUNT(piece00[promote]) > ((promote >> 1) == QUEEN ? 1 : 2))
+        // promoted material beyond the material table
+        materialindex |= MATERIALOVERFLOW;
+    // just double the hash-switch for target to make the pawn vanish
+    pawnhash ^= zb.boardtable[(to << 4) | promote];
+}
+
+
+template <int Me> COLDFUNC void chessposition::playEpCapture(int from, int to)
+{
+    const PieceCode capture = (PieceCode)(WPAWN | (Me ^ S2MMASK));
+    int epfield = (from & 0x38) | (to & 0x07);
+    BitboardClear(epfield, capture);
+    mailbox[epfield] = BLANK;
+    hash ^= zb.boardtable[(epfield << 4) | capture];
+    pawnhash ^= zb.boardtable[(epfield << 4) | capture];
+    materialhash ^= zb.boardtable[(POPCOUNT(piece00[capture]) << 4) | capture];
+    materialindex -= materialweight[capture];
+}
+
+
+// Puts the pieces of a normal move back; used by unplayMove and for the illegal move in playMove
+template <int Me> inline void chessposition::restorePieces(int from, int to, PieceCode pfrom, PieceCode promote, PieceCode capture)
+{
+    mailbox[from] = pfrom;
+    if (promote != BLANK)
+    {
+        BitboardClear(to, promote);
+        BitboardSet(from, pfrom);
+    }
+    else {
+        BitboardMove(to, from, pfrom);
+    }
+
+    if (capture != BLANK)
+    {
+        if (ept && to == ept)
         {
-            kingpos[s2m] = kingto;
-            BitboardMove(kingfrom, kingto, kingpc);
-            hash ^= zb.boardtable[(kingfrom << 4) | kingpc] ^ zb.boardtable[(kingto << 4) | kingpc];
-            pawnhash ^= zb.boardtable[(kingfrom << 4) | kingpc] ^ zb.boardtable[(kingto << 4) | kingpc];
+            // special ep capture
+            int epfield = (from & 0x38) | (to & 0x07);
+            BitboardSet(epfield, capture);
+            mailbox[epfield] = capture;
+            mailbox[to] = BLANK;
         }
-        if (rookfrom != rookto)
+        else
         {
-            BitboardMove(rookfrom, rookto, rookpc);
-            hash ^= zb.boardtable[(rookfrom << 4) | rookpc] ^ zb.boardtable[(rookto << 4) | rookpc];
+            BitboardSet(to, capture);
+            mailbox[to] = capture;
         }
-        state &= (s2m ? ~(BQCMASK | BKCMASK) : ~(WQCMASK | WKCMASK));
+    }
+    else {
+        mailbox[to] = BLANK;
+    }
+}
+
+
+template <int Me, bool TestLegal, bool Pext> HOTFUNC bool chessposition::playMove(chessmove *cm)
+{
+    const int You = Me ^ S2MMASK;
+    int eptnew = 0;
+    int oldcastle = (state & CASTLEMASK);
+
+    halfmovescounter++;
+
+    // Castle has special play
+    if (ISCASTLE(cm->code))
+    {
+        playCastle<Me>(cm->code);
     }
     else
     {
@@ -1546,7 +1906,7 @@ bool chessposition::playMove(chessmove *cm)
         PieceCode promote = GETPROMOTION(cm->code);
         PieceCode capture = GETCAPTURE(cm->code);
 
-        myassert(!promote || (ptype == PAWN && RRANK(to, s2m) == 7), this, 4, promote, ptype, to, s2m);
+        myassert(!promote || (ptype == PAWN && RRANK(to, Me) == 7), this, 4, promote, ptype, to, Me);
         myassert(pfrom == mailbox[from], this, 3, pfrom, from, mailbox[from]);
         myassert(ISEPCAPTURE(cm->code) || capture == mailbox[to], this, 2, capture, mailbox[to]);
 
@@ -1558,6 +1918,7 @@ bool chessposition::playMove(chessmove *cm)
                 pawnhash ^= zb.boardtable[(to << 4) | capture];
             BitboardClear(to, capture);
             materialhash ^= zb.boardtable[(POPCOUNT(piece00[capture]) << 4) | capture];
+            materialindex -= materialweight[capture];
             halfmovescounter = 0;
         }
 
@@ -1567,13 +1928,7 @@ bool chessposition::playMove(chessmove *cm)
             BitboardMove(from, to, pfrom);
         }
         else {
-            mailbox[to] = promote;
-            BitboardClear(from, pfrom);
-            materialhash ^= zb.boardtable[(POPCOUNT(piece00[pfrom]) << 4) | pfrom];
-            materialhash ^= zb.boardtable[(POPCOUNT(piece00[promote]) << 4) | promote];
-            BitboardSet(to, promote);
-            // just double the hash-switch for target to make the pawn vanish
-            pawnhash ^= zb.boardtable[(to << 4) | mailbox[to]];
+            playPromotion<Me>(from, to, promote);
         }
 
         hash ^= zb.boardtable[(to << 4) | mailbox[to]];
@@ -1590,57 +1945,23 @@ bool chessposition::playMove(chessmove *cm)
             halfmovescounter = 0;
 
             if (ept && to == ept)
-            {
-                int epfield = (from & 0x38) | (to & 0x07);
-                BitboardClear(epfield, (pfrom ^ S2MMASK));
-                mailbox[epfield] = BLANK;
-                hash ^= zb.boardtable[(epfield << 4) | (pfrom ^ S2MMASK)];
-                pawnhash ^= zb.boardtable[(epfield << 4) | (pfrom ^ S2MMASK)];
-                materialhash ^= zb.boardtable[(POPCOUNT(piece00[(pfrom ^ S2MMASK)]) << 4) | (pfrom ^ S2MMASK)];
-            }
+                playEpCapture<Me>(from, to);
         }
 
         if (ptype == KING)
-            kingpos[s2m] = to;
+            kingpos[Me] = to;
 
         // Here we can test the move for being legal
-        if (isAttacked(kingpos[s2m], s2m))
+        if (TestLegal && isAttacked<Me, Pext>(kingpos[Me]))
         {
             // Move is illegal; just do the necessary subset of unplayMove
             hash = movestack[mstop].hash;
             pawnhash = movestack[mstop].pawnhash;
             materialhash = movestack[mstop].materialhash;
-            kingpos[s2m] = movestack[mstop].kingpos[s2m];
+            materialindex = movestack[mstop].materialindex;
+            kingpos[Me] = movestack[mstop].kingpos[Me];
             halfmovescounter = movestack[mstop].halfmovescounter;
-            mailbox[from] = pfrom;
-            if (promote != BLANK)
-            {
-                BitboardClear(to, mailbox[to]);
-                BitboardSet(from, pfrom);
-            }
-            else {
-                BitboardMove(to, from, pfrom);
-            }
-
-            if (capture != BLANK)
-            {
-                if (ept && to == ept)
-                {
-                    // special ep capture
-                    int epfield = (from & 0x38) | (to & 0x07);
-                    BitboardSet(epfield, capture);
-                    mailbox[epfield] = capture;
-                    mailbox[to] = BLANK;
-                }
-                else
-                {
-                    BitboardSet(to, capture);
-                    mailbox[to] = capture;
-                }
-            }
-            else {
-                mailbox[to] = BLANK;
-            }
+            restorePieces<Me>(from, to, pfrom, promote, capture);
             return false;
         }
 
@@ -1653,15 +1974,14 @@ bool chessposition::playMove(chessmove *cm)
         }
     }
 
-    PREFETCH(&mtrlhsh.table[materialhash & MATERIALHASHMASK]);
     PREFETCH(&pwnhsh->table[pawnhash & pwnhsh->sizemask]);
 
     state ^= S2MMASK;
-    isCheckbb = isAttackedBy<OCCUPIED>(kingpos[s2m ^ S2MMASK], s2m);
+    isCheckbb = isAttackedBy<OCCUPIED, Pext>(kingpos[You], Me);
 
     hash ^= zb.s2m;
 
-    if (!(state & S2MMASK))
+    if (Me == BLACK)
         fullmovescounter++;
 
     // Fix hash regarding ept
@@ -1673,18 +1993,32 @@ bool chessposition::playMove(chessmove *cm)
     oldcastle ^= (state & CASTLEMASK);
     hash ^= zb.cstl[oldcastle];
 
-    PREFETCH(&tp.table[hash & tp.sizemask]);
+    PREFETCH(tp.getCluster(hash));
 
     ply++;
     movestack[mstop++].movecode = cm->code;
     myassert(mstop < MAXMOVESEQUENCELENGTH, this, 1, mstop);
-    updatePins();
+    updatePins<Pext>();
 
     return true;
 }
 
 
-void chessposition::unplayMove(chessmove *cm)
+bool chessposition::playMove(chessmove *cm)
+{
+#ifdef LEGALMOVEGEN
+    // the move comes from the legal generator or was tested with moveIsLegal
+    const bool testLegal = false;
+#else
+    const bool testLegal = true;
+#endif
+    if (usePext)
+        return (state & S2MMASK) ? playMove<BLACK, testLegal, true>(cm) : playMove<WHITE, testLegal, true>(cm);
+    return (state & S2MMASK) ? playMove<BLACK, testLegal, false>(cm) : playMove<WHITE, testLegal, false>(cm);
+}
+
+
+template <int Me> HOTFUNC void chessposition::unplayMove(chessmove *cm)
 {
     ply--;
     mstop--;
@@ -1694,67 +2028,19 @@ void chessposition::unplayMove(chessmove *cm)
 
     // Castle has special undo
     if (ISCASTLE(cm->code))
-    {
-        // Get castle squares and undo king and rook move
-        int kingfrom = GETFROM(cm->code);
-        int rookfrom = GETTO(cm->code);
-        int cstli = GETCASTLEINDEX(cm->code);
-        int kingto = castlekingto[cstli];
-        int rookto = castlerookto[cstli];
-        int s2m = cstli / 2;
-        PieceCode kingpc = (PieceCode)(WKING | s2m);
-        PieceCode rookpc = (PieceCode)(WROOK | s2m);
-
-        mailbox[kingto] = BLANK;
-        mailbox[rookto] = BLANK;
-        mailbox[kingfrom] = kingpc;
-        mailbox[rookfrom] = rookpc;
-
-        if (kingfrom != kingto)
-            BitboardMove(kingto, kingfrom, kingpc);
-
-        if (rookfrom != rookto)
-            BitboardMove(rookto, rookfrom, rookpc);
-    }
+        unplayCastle<Me>(cm->code);
     else
-    {
-        int from = GETFROM(cm->code);
-        int to = GETTO(cm->code);
-        PieceCode pfrom = GETPIECE(cm->code);
-
-        PieceCode promote = GETPROMOTION(cm->code);
-        PieceCode capture = GETCAPTURE(cm->code);
+        restorePieces<Me>(GETFROM(cm->code), GETTO(cm->code), GETPIECE(cm->code), GETPROMOTION(cm->code), GETCAPTURE(cm->code));
+}
 
-        mailbox[from] = pfrom;
-        if (promote != BLANK)
-        {
-            BitboardClear(to, promote);
-            BitboardSet(from, pfrom);
-        }
-        else {
-            BitboardMove(to, from, pfrom);
-        }
 
-        if (capture != BLANK)
-        {
-            if (ept && to == ept)
-            {
-                // special ep capture
-                int epfield = (from & 0x38) | (to & 0x07);
-                BitboardSet(epfield, capture);
-                mailbox[epfield] = capture;
-                mailbox[to] = BLANK;
-            }
-            else
-            {
-                BitboardSet(to, capture);
-                mailbox[to] = capture;
-            }
-        }
-        else {
-            mailbox[to] = BLANK;
-        }
-    }
+void chessposition::unplayMove(chessmove *cm)
+{
+    // the side that played the move is to move again after restoring the state
+    if (movestack[mstop - 1].state & S2MMASK)
+        unplayMove<BLACK>(cm);
+    else
+        unplayMove<WHITE>(cm);
 }
 
 
@@ -1772,27 +2058,51 @@ inline void appendPromotionMove(chessposition *pos, chessmove **m, int from, int
 }
 
 
-template <PieceType Pt> int CreateMovelistPiece(chessposition *pos, chessmove* mstart, U64 occ, U64 targets, int me)
+#ifdef LEGALMOVEGEN
+// Target squares of a piece on from that keep a pin intact
+template <int Me> inline U64 pinMask(chessposition *pos, int from)
 {
-    const PieceCode pc = (PieceCode)((Pt << 1) | me);
-    U64 frombits = pos->piece00[pc];
-    U64 tobits = 0ULL;
-    chessmove *m = mstart;
+    return (pos->kingPinned[Me] & BITSET(from)) ? lineMask[pos->kingpos[Me]][from] : ~0ULL;
+}
 
-    while (frombits)
+// En passant removes two pawns from the same rank so test for a slider now attacking the king
+template <int Me> inline bool epIsLegal(chessposition *pos, int from, int to)
+{
+    U64 occ = ((pos->occupied00[0] | pos->occupied00[1]) ^ BITSET(from) ^ BITSET(to - S2MSIGN(Me) * 8)) | BITSET(to);
+    return !pos->isAttackedByMySlider(pos->kingpos[Me], occ, Me ^ S2MMASK);
+}
+#endif
+
+
+template <PieceType Pt, int Me, bool Pext> inline int CreateMovelistPiece(chessposition *pos, chessmove* mstart, U64 occ, U64 targets)
+{
+    const PieceCode pc = (PieceCode)((Pt << 1) | Me);
+    U64 frombits = pos->piece00[pc];
+    U64 tobits = 0ULL;
+    chessmove *m = mstart;
+
+    while (frombits)
     {
         int from = pullLsb(&frombits);
         if (Pt == KNIGHT)
             tobits = (knight_attacks[from] & targets);
         if (Pt == BISHOP || Pt == QUEEN)
-            tobits |= (MAGICBISHOPATTACKS(occ, from) & targets);
+            tobits |= (MAGICBISHOPATTACKS(Pext, occ, from) & targets);
         if (Pt == ROOK || Pt == QUEEN)
-            tobits |= (MAGICROOKATTACKS(occ, from) & targets);
+            tobits |= (MAGICROOKATTACKS(Pext, occ, from) & targets);
         if (Pt == KING)
             tobits = (king_attacks[from] & targets);
+#ifdef LEGALMOVEGEN
+        if (Pt != KING)
+            tobits &= pinMask<Me>(pos, from);
+#endif
         while (tobits)
         {
             int to = pullLsb(&tobits);
+#ifdef LEGALMOVEGEN
+            if (Pt == KING && pos->isAttacked<Me, Pext>(to))
+                continue;
+#endif
             appendMoveToList(&m, from, to, pc, pos->mailbox[to]);
         }
     }
@@ -1801,38 +2111,35 @@ template <PieceType Pt> int CreateMovelistPiece(chessposition *pos, chessmove* m
 }
 
 
-inline int CreateMovelistCastle(chessposition *pos, chessmove* mstart, int me)
+template <int Me> COLDFUNC int CreateMovelistCastle(chessposition *pos, chessmove* mstart)
 {
-    if (pos->isCheckbb)
-        return 0;
-
     chessmove *m = mstart;
     U64 occupiedbits = (pos->occupied00[0] | pos->occupied00[1]);
 
-    for (int cstli = me * 2; cstli < 2 * me + 2; cstli++)
+    for (int cstli = Me * 2; cstli < 2 * Me + 2; cstli++)
     {
         if ((pos->state & (WQCMASK << cstli)) == 0)
             continue;
-        int kingfrom = pos->kingpos[me];
+        int kingfrom = pos->kingpos[Me];
         int rookfrom = castlerookfrom[cstli];
         if (castleblockers[cstli] & (occupiedbits ^ BITSET(rookfrom) ^ BITSET(kingfrom)))
             continue;
 
-        pos->BitboardClear(rookfrom, (PieceType)(WROOK | me));
+        pos->BitboardClear(rookfrom, (PieceType)(WROOK | Me));
         U64 kingwalkbb = castlekingwalk[cstli];
         bool attacked = false;
         while (!attacked && kingwalkbb)
         {
             int to = pullLsb(&kingwalkbb);
-            attacked = pos->isAttacked(to, me);
+            attacked = pos->isAttacked(to, Me);
         }
-        pos->BitboardSet(rookfrom, (PieceType)(WROOK | me));
+        pos->BitboardSet(rookfrom, (PieceType)(WROOK | Me));
 
         if (attacked)
             continue;
 
         // Create castle move 'king captures rook' and add castle flag manually
-        appendMoveToList(&m, kingfrom, rookfrom, WKING | me, BLANK);
+        appendMoveToList(&m, kingfrom, rookfrom, WKING | Me, BLANK);
         (m - 1)->code |= (CASTLEFLAG | cstli << 20);
     }
 
@@ -1840,31 +2147,87 @@ inline int CreateMovelistCastle(chessposition *pos, chessmove* mstart, int me)
 }
 
 
-template <MoveType Mt> inline int CreateMovelistPawn(chessposition *pos, chessmove* mstart, int me)
+template <int Me> COLDFUNC int CreateMovelistPromotion(chessposition *pos, chessmove* mstart, U64 frombits)
+{
+    const int You = Me ^ S2MMASK;
+    const U64 occ = pos->occupied00[0] | pos->occupied00[1];
+    chessmove *m = mstart;
+
+    while (frombits)
+    {
+        int from = pullLsb(&frombits);
+        U64 tobits = (pawn_attacks_to[from][Me] & pos->occupied00[You]) | (pawn_moves_to[from][Me] & ~occ);
+#ifdef LEGALMOVEGEN
+        tobits &= pinMask<Me>(pos, from);
+#endif
+        while (tobits)
+        {
+            int to = pullLsb(&tobits);
+            appendPromotionMove(pos, &m, from, to, Me, QUEEN);
+            appendPromotionMove(pos, &m, from, to, Me, ROOK);
+            appendPromotionMove(pos, &m, from, to, Me, BISHOP);
+            appendPromotionMove(pos, &m, from, to, Me, KNIGHT);
+        }
+    }
+
+    return (int)(m - mstart);
+}
+
+
+template <int Me> COLDFUNC int CreateMovelistEp(chessposition *pos, chessmove* mstart)
+{
+    const int You = Me ^ S2MMASK;
+    chessmove *m = mstart;
+    U64 frombits = pos->piece00[WPAWN | Me] & pawn_attacks_to[pos->ept][You];
+    while (frombits)
+    {
+        int from = pullLsb(&frombits);
+#ifdef LEGALMOVEGEN
+        if (!epIsLegal<Me>(pos, from, pos->ept))
+            continue;
+#endif
+        appendMoveToList(&m, from, pos->ept, WPAWN | Me, WPAWN | You);
+        (m - 1)->code |= EPCAPTUREFLAG;
+    }
+
+    return (int)(m - mstart);
+}
+
+
+template <MoveType Mt, int Me> inline int CreateMovelistPawn(chessposition *pos, chessmove* mstart)
 {
     chessmove *m = mstart;
-    int you = 1 - me;
-    const PieceCode pc = (PieceCode)(WPAWN | me);
+    const int You = Me ^ S2MMASK;
+    const PieceCode pc = (PieceCode)(WPAWN | Me);
     const U64 occ = pos->occupied00[0] | pos->occupied00[1];
     U64 frombits, tobits;
     int from, to;
 
     if (Mt & QUIET)
     {
-        U64 push = PAWNPUSH(you, ~occ & ~PROMOTERANKBB);
+        U64 push = PAWNPUSH(You, ~occ & ~PROMOTERANKBB);
         U64 pushers = push & pos->piece00[pc];
-        U64 doublepushers = PAWNPUSH(you, push) & (RANK2(me) & pushers);
+        U64 doublepushers = PAWNPUSH(You, push) & (RANK2(Me) & pushers);
         while (pushers)
         {
             from = pullLsb(&pushers);
-            appendMoveToList(&m, from, PAWNPUSHINDEX(me, from), pc, BLANK);
+            to = PAWNPUSHINDEX(Me, from);
+#ifdef LEGALMOVEGEN
+            if (!(pinMask<Me>(pos, from) & BITSET(to)))
+                continue;
+#endif
+            appendMoveToList(&m, from, to, pc, BLANK);
         }
         while (doublepushers)
         {
             from = pullLsb(&doublepushers);
-            to = PAWNPUSHDOUBLEINDEX(me, from);
+            to = PAWNPUSHDOUBLEINDEX(Me, from);
+#ifdef LEGALMOVEGEN
+            if (!(pinMask<Me>(pos, from) & BITSET(to)))
+                continue;
+#endif
             appendMoveToList(&m, from, to, pc, BLANK);
-            if (epthelper[to] & pos->piece00[WPAWN | you])
+            if (epthelper[to] & pos->piece00[WPAWN | You])
                 // EPT possible for opponent; set EPT field manually
                 (m - 1)->code |= (from + to) << 19;
         }
@@ -1872,11 +2235,14 @@ template <MoveType Mt> inline int CreateMovelistPawn(chessposition *pos, chessmo
 
     if (Mt & CAPTURE)
     {
-        frombits = pos->piece00[pc] & ~RANK7(me);
+        frombits = pos->piece00[pc] & ~RANK7(Me);
         while (frombits)
         {
             from = pullLsb(&frombits);
-            tobits = (pawn_attacks_to[from][me] & pos->occupied00[you]);
+            tobits = (pawn_attacks_to[from][Me] & pos->occupied00[You]);
+#ifdef LEGALMOVEGEN
+            tobits &= pinMask<Me>(pos, from);
+#endif
             while (tobits)
             {
                 to = pullLsb(&tobits);
@@ -1884,60 +2250,39 @@ template <MoveType Mt> inline int CreateMovelistPawn(chessposition *pos, chessmo
             }
         }
         if (pos->ept)
-        {
-            frombits = pos->piece00[pc] & pawn_attacks_to[pos->ept][you];
-            while (frombits)
-            {
-                from = pullLsb(&frombits);
-                appendMoveToList(&m, from, pos->ept, pc, WPAWN | you);
-                (m - 1)->code |= EPCAPTUREFLAG;
-            }
-
-        }
+            m += CreateMovelistEp<Me>(pos, m);
     }
 
     if (Mt & PROMOTE)
     {
-        frombits = pos->piece00[pc] & RANK7(me);
-        while (frombits)
-        {
-            from = pullLsb(&frombits);
-            tobits = (pawn_attacks_to[from][me] & pos->occupied00[you]) | (pawn_moves_to[from][me] & ~occ);
-            while (tobits)
-            {
-                to = pullLsb(&tobits);
-                appendPromotionMove(pos, &m, from, to, me, QUEEN);
-                appendPromotionMove(pos, &m, from, to, me, ROOK);
-                appendPromotionMove(pos, &m, from, to, me, BISHOP);
-                appendPromotionMove(pos, &m, from, to, me, KNIGHT);
-            }
-        }
+        frombits = pos->piece00[pc] & RANK7(Me);
+        if (frombits)
+            m += CreateMovelistPromotion<Me>(pos, m, frombits);
     }
 
     return (int)(m - mstart);
 }
 
 
-int CreateEvasionMovelist(chessposition *pos, chessmove* mstart)
+template <int Me, bool Pext> HOTFUNC int CreateEvasionMovelist(chessposition *pos, chessmove* mstart)
 {
     chessmove* m = mstart;
-    int me = pos->state & S2MMASK;
-    int you = me ^ S2MMASK;
+    const int You = Me ^ S2MMASK;
     U64 targetbits;
     U64 frombits;
     int from, to;
     PieceCode pc;
-    int king = pos->kingpos[me];
+    int king = pos->kingpos[Me];
     U64 occupiedbits = (pos->occupied00[0] | pos->occupied00[1]);
 
     // moving the king is alway a possibe evasion
-    targetbits = king_attacks[king] & ~pos->occupied00[me];
+    targetbits = king_attacks[king] & ~pos->occupied00[Me];
     while (targetbits)
     {
         to = pullLsb(&targetbits);
-        if (!pos->isAttackedBy<OCCUPIEDANDKING>(to, you) && !pos->isAttackedByMySlider(to, occupiedbits ^ BITSET(king), you))
+        if (!pos->isAttackedBy<OCCUPIEDANDKING, Pext>(to, You) && !pos->isAttackedByMySlider<Pext>(to, occupiedbits ^ BITSET(king), You))
         {
-            appendMoveToList(&m, king, to, WKING | me, pos->mailbox[to]);
+            appendMoveToList(&m, king, to, WKING | Me, pos->mailbox[to]);
         }
     }
 
@@ -1947,25 +2292,29 @@ int CreateEvasionMovelist(chessposition *pos, chessmove* mstart)
         int attacker;
         GETLSB(attacker, pos->isCheckbb);
         // special case: attacker is pawn and can be captured enpassant
-        if (pos->ept && pos->ept == attacker + S2MSIGN(me) * 8)
+        if (pos->ept && pos->ept == attacker + S2MSIGN(Me) * 8)
         {
-            frombits = pawn_attacks_from[pos->ept][me] & pos->piece00[WPAWN | me];
+            frombits = pawn_attacks_from[pos->ept][Me] & pos->piece00[WPAWN | Me];
             while (frombits)
             {
                 from = pullLsb(&frombits);
+#ifdef LEGALMOVEGEN
+                if (!epIsLegal<Me>(pos, from, pos->ept))
+                    continue;
+#endif
                 // treat ep capture as normal move and correct code manually
-                appendMoveToList(&m, from, attacker + S2MSIGN(me) * 8, WPAWN | me, WPAWN | you);
+                appendMoveToList(&m, from, attacker + S2MSIGN(Me) * 8, WPAWN | Me, WPAWN | You);
                 (m - 1)->code |= EPCAPTUREFLAG;
             }
         }
         // now normal captures of the attacker
         to = attacker;
-        frombits = pos->isAttackedBy<OCCUPIED>(to, me);
+        frombits = pos->isAttackedBy<OCCUPIED, Pext>(to, Me);
         // later: blockers; targetbits will contain empty squares between king and attacking slider
         targetbits = betweenMask[king][attacker];
         while (true)
         {
-            frombits = frombits & ~pos->kingPinned[me];
+            frombits = frombits & ~pos->kingPinned[Me];
             while (frombits)
             {
                 from = pullLsb(&frombits);
@@ -1974,10 +2323,10 @@ int CreateEvasionMovelist(chessposition *pos, chessmove* mstart)
                 {
                     if (PROMOTERANK(to))
                     {
-                        appendPromotionMove(pos, &m, from, to, me, QUEEN);
-                        appendPromotionMove(pos, &m, from, to, me, ROOK);
-                        appendPromotionMove(pos, &m, from, to, me, BISHOP);
-                        appendPromotionMove(pos, &m, from, to, me, KNIGHT);
+                        appendPromotionMove(pos, &m, from, to, Me, QUEEN);
+                        appendPromotionMove(pos, &m, from, to, Me, ROOK);
+                        appendPromotionMove(pos, &m, from, to, Me, BISHOP);
+                        appendPromotionMove(pos, &m, from, to, Me, KNIGHT);
                         continue;
                     }
                     else if (!((from ^ to) & 0x8) && (epthelper[to] & pos->piece00[pc ^ S2MMASK]))
@@ -1993,16 +2342,45 @@ int CreateEvasionMovelist(chessposition *pos, chessmove* mstart)
             if (!targetbits)
                 break;
             to = pullLsb(&targetbits);
-            frombits = pos->isAttackedBy<FREE>(to, me);  // <FREE> is needed here as the target fields are empty and pawns move normal
+            frombits = pos->isAttackedBy<FREE, Pext>(to, Me);  // <FREE> is needed here as the target fields are empty and pawns move normal
         }
     }
     return (int)(m - mstart);
 }
 
 
-template <MoveType Mt> int CreateMovelist(chessposition *pos, chessmove* mstart)
+int CreateEvasionMovelist(chessposition *pos, chessmove* mstart)
+{
+    if (usePext)
+        return (pos->state & S2MMASK) ? CreateEvasionMovelist<BLACK, true>(pos, mstart) : CreateEvasionMovelist<WHITE, true>(pos, mstart);
+    return (pos->state & S2MMASK) ? CreateEvasionMovelist<BLACK, false>(pos, mstart) : CreateEvasionMovelist<WHITE, false>(pos, mstart);
+}
+
+
+#ifdef LEGALMOVEGEN
+// In check the legal moves are the evasions of the requested type
+template <MoveType Mt, int Me, bool Pext> COLDFUNC int CreateMovelistInCheck(chessposition *pos, chessmove* mstart)
+{
+    int length = CreateEvasionMovelist<Me, Pext>(pos, mstart);
+    if (Mt == ALL)
+        return length;
+
+    int n = 0;
+    for (int i = 0; i < length; i++)
+        if (ISTACTICAL(mstart[i].code) ? (Mt & TACTICAL) != 0 : (Mt & QUIET) != 0)
+            mstart[n++] = mstart[i];
+
+    return n;
+}
+#endif
+
+
+template <MoveType Mt, int Me, bool Pext> HOTFUNC int CreateMovelist(chessposition *pos, chessmove* mstart)
 {
-    int me = pos->state & S2MMASK;
+#ifdef LEGALMOVEGEN
+    if (pos->isCheckbb)
+        return CreateMovelistInCheck<Mt, Me, Pext>(pos, mstart);
+#endif
     U64 occupiedbits = (pos->occupied00[0] | pos->occupied00[1]);
     U64 emptybits = ~occupiedbits;
     U64 targetbits = 0ULL;
@@ -2011,22 +2389,30 @@ template <MoveType Mt> int CreateMovelist(chessposition *pos, chessmove* mstart)
     if (Mt & QUIET)
         targetbits |= emptybits;
     if (Mt & CAPTURE)
-        targetbits |= pos->occupied00[me ^ S2MMASK];
-
-    m += CreateMovelistPawn<Mt>(pos, m, me);
-    m += CreateMovelistPiece<KNIGHT>(pos, m, occupiedbits, targetbits, me);
-    m += CreateMovelistPiece<BISHOP>(pos, m, occupiedbits, targetbits, me);
-    m += CreateMovelistPiece<ROOK>(pos, m, occupiedbits, targetbits, me);
-    m += CreateMovelistPiece<QUEEN>(pos, m, occupiedbits, targetbits, me);
-    m += CreateMovelistPiece<KING>(pos, m, occupiedbits, targetbits, me);
-    if (Mt & QUIET)
-        m += CreateMovelistCastle(pos, m, me);
+        targetbits |= pos->occupied00[Me ^ S2MMASK];
+
+    m += CreateMovelistPawn<Mt, Me>(pos, m);
+    m += CreateMovelistPiece<KNIGHT, Me, Pext>(pos, m, occupiedbits, targetbits);
+    m += CreateMovelistPiece<BISHOP, Me, Pext>(pos, m, occupiedbits, targetbits);
+    m += CreateMovelistPiece<ROOK, Me, Pext>(pos, m, occupiedbits, targetbits);
+    m += CreateMovelistPiece<QUEEN, Me, Pext>(pos, m, occupiedbits, targetbits);
+    m += CreateMovelistPiece<KING, Me, Pext>(pos, m, occupiedbits, targetbits);
+    if ((Mt & QUIET) && (pos->state & ((WQCMASK | WKCMASK) << (2 * Me))) && !pos->isCheckbb)
+        m += CreateMovelistCastle<Me>(pos, m);
 
     return (int)(m - mstart);
 }
 
 
-U64 chessposition::movesTo(PieceCode pc, int from)
+template <MoveType Mt> int CreateMovelist(chessposition *pos, chessmove* mstart)
+{
+    if (usePext)
+        return (pos->state & S2MMASK) ? CreateMovelist<Mt, BLACK, true>(pos, mstart) : CreateMovelist<Mt, WHITE, true>(pos, mstart);
+    return (pos->state & S2MMASK) ? CreateMovelist<Mt, BLACK, false>(pos, mstart) : CreateMovelist<Mt, WHITE, false>(pos, mstart);
+}
+
+
+template <bool Pext> U64 chessposition::movesTo(PieceCode pc, int from)
 {
     PieceType p = (pc >> 1) ;
     int s2m = pc & S2MMASK;
@@ -2039,11 +2425,11 @@ U64 chessposition::movesTo(PieceCode pc, int from)
     case KNIGHT:
         return knight_attacks[from];
     case BISHOP:
-        return MAGICBISHOPATTACKS(occ, from);
+        return MAGICBISHOPATTACKS(Pext, occ, from);
     case ROOK:
-        return MAGICROOKATTACKS(occ, from);
+        return MAGICROOKATTACKS(Pext, occ, from);
     case QUEEN:
-        return MAGICBISHOPATTACKS(occ, from) | MAGICROOKATTACKS(occ, from);
+        return MAGICBISHOPATTACKS(Pext, occ, from) | MAGICROOKATTACKS(Pext, occ, from);
     case KING:
         return king_attacks[from];
     default:
@@ -2052,7 +2438,13 @@ U64 chessposition::movesTo(PieceCode pc, int from)
 }
 
 
-template <PieceType Pt>
+U64 chessposition::movesTo(PieceCode pc, int from)
+{
+    return usePext ? movesTo<true>(pc, from) : movesTo<false>(pc, from);
+}
+
+
+template <PieceType Pt, bool Pext>
 U64 chessposition::pieceMovesTo(int from)
 {
     U64 occ = occupied00[0] | occupied00[1];
@@ -2061,11 +2453,11 @@ U64 chessposition::pieceMovesTo(int from)
     case KNIGHT:
         return knight_attacks[from];
     case BISHOP:
-        return MAGICBISHOPATTACKS(occ, from);
+        return MAGICBISHOPATTACKS(Pext, occ, from);
     case ROOK:
-        return MAGICROOKATTACKS(occ, from);
+        return MAGICROOKATTACKS(Pext, occ, from);
     case QUEEN:
-        return MAGICBISHOPATTACKS(occ, from) | MAGICROOKATTACKS(occ, from);
+        return MAGICBISHOPATTACKS(Pext, occ, from) | MAGICROOKATTACKS(Pext, occ, from);
     default:
         return 0ULL;
     }
@@ -2073,12 +2465,12 @@ U64 chessposition::pieceMovesTo(int from)
 
 
 // this is only used for king attacks, so opponent king attacks can be left out
-template <AttackType At> U64 chessposition::isAttackedBy(int index, int col)
+template <AttackType At, bool Pext> U64 chessposition::isAttackedBy(int index, int col)
 {
     U64 occ = occupied00[0] | occupied00[1];
     return (knight_attacks[index] & piece00[WKNIGHT | col])
-        | (MAGICROOKATTACKS(occ, index) & (piece00[WROOK | col] | piece00[WQUEEN | col]))
-        | (MAGICBISHOPATTACKS(occ, index) & (piece00[WBISHOP | col] | piece00[WQUEEN | col]))
+        | (MAGICROOKATTACKS(Pext, occ, index) & (piece00[WROOK | col] | piece00[WQUEEN | col]))
+        | (MAGICBISHOPATTACKS(Pext, occ, index) & (piece00[WBISHOP | col] | piece00[WQUEEN | col]))
         | (piece00[WPAWN | col] & (At != FREE ?
             pawn_attacks_from[index][col] :
             pawn_moves_from[index][col] | (pawn_moves_from_double[index][col] & PAWNPUSH(col ^ S2MMASK, ~occ))))
@@ -2086,47 +2478,93 @@ template <AttackType At> U64 chessposition::isAttackedBy(int index, int col)
 }
 
 
-bool chessposition::isAttacked(int index, int Me)
+template <AttackType At> U64 chessposition::isAttackedBy(int index, int col)
 {
-    int opponent = Me ^ S2MMASK;
+    return usePext ? isAttackedBy<At, true>(index, col) : isAttackedBy<At, false>(index, col);
+}
+
 
-    return knight_attacks[index] & piece00[WKNIGHT | opponent]
-        || king_attacks[index] & piece00[WKING | opponent]
-        || pawn_attacks_to[index][state & S2MMASK] & piece00[(PAWN << 1) | opponent]
-        || MAGICROOKATTACKS(occupied00[0] | occupied00[1], index) & (piece00[WROOK | opponent] | piece00[WQUEEN | opponent])
-        || MAGICBISHOPATTACKS(occupied00[0] | occupied00[1], index) & (piece00[WBISHOP | opponent] | piece00[WQUEEN | opponent]);
+HOTFUNC bool chessposition::isAttacked(int index, int me)
+{
+    if (usePext)
+        return me ? isAttacked<BLACK, true>(index) : isAttacked<WHITE, true>(index);
+    return me ? isAttacked<BLACK, false>(index) : isAttacked<WHITE, false>(index);
 }
 
 // used for checkevasion test, could be usefull for discovered check test
+template <bool Pext> U64 chessposition::isAttackedByMySlider(int index, U64 occ, int me)
+{
+    return (MAGICROOKATTACKS(Pext, occ, index) & (piece00[WROOK | me] | piece00[WQUEEN | me]))
+        | (MAGICBISHOPATTACKS(Pext, occ, index) & (piece00[WBISHOP | me] | piece00[WQUEEN | me]));
+}
+
+
 U64 chessposition::isAttackedByMySlider(int index, U64 occ, int me)
 {
-    return (MAGICROOKATTACKS(occ, index) & (piece00[WROOK | me] | piece00[WQUEEN | me]))
-        | (MAGICBISHOPATTACKS(occ, index) & (piece00[WBISHOP | me] | piece00[WQUEEN | me]));
+    return usePext ? isAttackedByMySlider<true>(index, occ, me) : isAttackedByMySlider<false>(index, occ, me);
 }
 
 
-U64 chessposition::attackedByBB(int index, U64 occ)
+template <bool Pext> U64 chessposition::attackedByBB(int index, U64 occ)
 {
     return (knight_attacks[index] & (piece00[WKNIGHT] | piece00[BKNIGHT]))
         | (king_attacks[index] & (piece00[WKING] | piece00[BKING]))
         | (pawn_attacks_to[index][1] & piece00[WPAWN])
         | (pawn_attacks_to[index][0] & piece00[BPAWN])
-        | (MAGICROOKATTACKS(occ, index) & (piece00[WROOK] | piece00[BROOK] | piece00[WQUEEN] | piece00[BQUEEN]))
-        | (MAGICBISHOPATTACKS(occ, index) & (piece00[WBISHOP] | piece00[BBISHOP] | piece00[WQUEEN] | piece00[BQUEEN]));
+        | (MAGICROOKATTACKS(Pext, occ, index) & (piece00[WROOK] | piece00[BROOK] | piece00[WQUEEN] | piece00[BQUEEN]))
+        | (MAGICBISHOPATTACKS(Pext, occ, index) & (piece00[WBISHOP] | piece00[BBISHOP] | piece00[WQUEEN] | piece00[BQUEEN]));
 }
 
 
-int chessposition::phase()
+HOTFUNC int chessposition::phaseHot()
 {
     // minor ~ 10-11    rook ~ 21-22    queen ~ 42-43
     int p = max(0, (24 - POPCOUNT(piece00[4]) - POPCOUNT(piece00[5]) - POPCOUNT(piece00[6]) - POPCOUNT(piece00[7]) - (POPCOUNT(piece00[8]) << 1) - (POPCOUNT(piece00[9]) << 1) - (POPCOUNT(piece00[10]) << 2) - (POPCOUNT(piece00[11]) << 2)));
     return (p * 255 + 12) / 24;
 }
 
+int chessposition::phase()
+{
+    return phaseHot();
+}
+
+
+// One capture of the see exchange on square to with the least valuable attacker of side Col
+// Returns false if Col has no attacker left
+template <int Col, bool Pext> inline bool seeCapture(chessposition *pos, int to, U64 *attacker, U64 *seeOccupied, U64 bishopAttackers, U64 rookAttackers, int *value)
+{
+    U64 nextAttacker = *attacker & pos->occupied00[Col];
+    if (!nextAttacker)
+        return false;
+
+    // Find attacker with least value
+    int nextPiece = PAWN;
+    while (!(nextAttacker & pos->piece00[(nextPiece << 1) | Col]))
+        nextPiece++;
+
+    // Simulate the move
+    int attackerIndex;
+    GETLSB(attackerIndex, nextAttacker & pos->piece00[(nextPiece << 1) | Col]);
+    *seeOccupied ^= BITSET(attackerIndex);
+
+    // Add new shifting attackers but exclude already moved attackers using current seeOccupied
+    if ((nextPiece & 0x1) || nextPiece == KING)  // pawn, bishop, queen, king
+        *attacker |= (MAGICBISHOPATTACKS(Pext, *seeOccupied, to) & bishopAttackers);
+    if (nextPiece == ROOK || nextPiece == QUEEN || nextPiece == KING)
+        *attacker |= (MAGICROOKATTACKS(Pext, *seeOccupied, to) & rookAttackers);
+
+    // Remove attacker
+    *attacker &= *seeOccupied;
+
+    *value = -*value - 1 - materialvalue[nextPiece];
+    return true;
+}
+
 
 // more advanced see respecting a variable threshold, quiet and promotion moves and faster xray attack handling
-bool chessposition::see(uint32_t move, int threshold)
+template <int Me, bool Pext> HOTFUNC bool chessposition::see(uint32_t move, int threshold)
 {
+    const int You = Me ^ S2MMASK;
     int from = GETFROM(move);
     int to = GETCORRECTTO(move);
 
@@ -2150,45 +2588,28 @@ bool chessposition::see(uint32_t move, int threshold)
     U64 potentialBishopAttackers = (piece00[WBISHOP] | piece00[BBISHOP] | piece00[WQUEEN] | piece00[BQUEEN]);
 
     // Get attackers excluding the already moved piece
-    U64 attacker = attackedByBB(to, seeOccupied) & seeOccupied;
-
-    int s2m = (state & S2MMASK) ^ S2MMASK;
+    U64 attacker = attackedByBB<Pext>(to, seeOccupied) & seeOccupied;
 
+    // The sides alternate; two captures per loop keep the colors constant
     while (true)
     {
-        U64 nextAttacker = attacker & occupied00[s2m];
-        // No attacker left => break
-        if (!nextAttacker)
-            break;
-
-        // Find attacker with least value
-        nextPiece = PAWN;
-        while (!(nextAttacker & piece00[(nextPiece << 1) | s2m]))
-            nextPiece++;
-
-        // Simulate the move
-        int attackerIndex;
-        GETLSB(attackerIndex, nextAttacker & piece00[(nextPiece << 1) | s2m]);
-        seeOccupied ^= BITSET(attackerIndex);
-
-        // Add new shifting attackers but exclude already moved attackers using current seeOccupied
-        if ((nextPiece & 0x1) || nextPiece == KING)  // pawn, bishop, queen, king
-            attacker |= (MAGICBISHOPATTACKS(seeOccupied, to) & potentialBishopAttackers);
-        if (nextPiece == ROOK || nextPiece == QUEEN || nextPiece == KING)
-            attacker |= (MAGICROOKATTACKS(seeOccupied, to) & potentialRookAttackers);
-
-        // Remove attacker
-        attacker &= seeOccupied;
-
-        s2m ^= S2MMASK;
-
-        value = -value - 1 - materialvalue[nextPiece];
-
+        if (!seeCapture<You, Pext>(this, to, &attacker, &seeOccupied, potentialBishopAttackers, potentialRookAttackers, &value))
+            return true;
         if (value >= 0)
-            break;
+            return false;
+        if (!seeCapture<Me, Pext>(this, to, &attacker, &seeOccupied, potentialBishopAttackers, potentialRookAttackers, &value))
+            return false;
+        if (value >= 0)
+            return true;
     }
+}
+
 
-    return (s2m ^ (state & S2MMASK));
+bool chessposition::see(uint32_t move, int threshold)
+{
+    if (usePext)
+        return (state & S2MMASK) ? see<BLACK, true>(move, threshold) : see<WHITE, true>(move, threshold);
+    return (state & S2MMASK) ? see<BLACK, false>(move, threshold) : see<WHITE, false>(move, threshold);
 }
 
 
@@ -2275,7 +2696,11 @@ chessmove* MoveSelector::next()
         // fall through
     case HASHMOVESTATE:
         state++;
+#ifdef LEGALMOVEGEN
+        if (hashmove.code && pos->moveIsLegal(hashmove.code))
+#else
         if (hashmove.code)
+#endif
         {
             return &hashmove;
         }
@@ -2304,21 +2729,33 @@ chessmove* MoveSelector::next()
         // fall through
     case KILLERMOVE1STATE:
         state++;
+#ifdef LEGALMOVEGEN
+        if (pos->moveIsPseudoLegal(killermove1.code) && pos->moveIsLegal(killermove1.code))
+#else
         if (pos->moveIsPseudoLegal(killermove1.code))
+#endif
         {
             return &killermove1;
         }
         // fall through
     case KILLERMOVE2STATE:
         state++;
+#ifdef LEGALMOVEGEN
+        if (pos->moveIsPseudoLegal(killermove2.code) && pos->moveIsLegal(killermove2.code))
+#else
         if (pos->moveIsPseudoLegal(killermove2.code))
+#endif
         {
             return &killermove2;
         }
         // fall through
     case COUNTERMOVESTATE:
         state++;
+#ifdef LEGALMOVEGEN
+        if (pos->moveIsPseudoLegal(countermove.code) && pos->moveIsLegal(countermove.code))
+#else
         if (pos->moveIsPseudoLegal(countermove.code))
+#endif
         {
             return &countermove;
         }
@@ -2346,7 +2783,8 @@ chessmove* MoveSelector::next()
             bool bBadTactical = (m->value & BADTACTICALFLAG);
             m->value = INT_MIN;
             if (bBadTactical) {
-                STATISTICSDO(if (m->code == hashmove.code) STATISTICSINC(moves_bad_hash));
+                if (m->code == hashmove.code)
+                    STATISTICSPOSINC(pos, moves_bad_hash);
                 return m;
             }
         }
@@ -2383,6 +2821,18 @@ static void uciSetThreads()
     en.allocThreads();
 }
 
+static void uciSetSharedPawnhash()
+{
+    // nothing to do when the option is registered or set to its current value
+    if (en.sharedPawnhash != (en.sharedpwnhsh != nullptr))
+        en.allocPawnhash();
+}
+
+static void uciSetEvalCache()
+{
+    en.allocEvalhash();
+}
+
 static void uciSetHash()
 {
     int newRestSizeTp = tp.setSize(en.Hash);
@@ -2393,9 +2843,79 @@ static void uciSetHash()
     }
 }
 
+static void uciSetNuma()
+{
+    if (!en.sthread)
+        // registration before Threads and Hash are set up
+        return;
+    if (en.useNuma && !numaInit())
+    {
+        en.send("info string NUMA mode is not supported on this platform.\n");
+        en.useNuma = false;
+    }
+    tp.setSize(en.Hash);
+    en.allocThreads();
+}
+
+static void uciSetHugePages()
+{
+    en.pageMode = (en.hugePages ? PAGES1G : PAGESNORMAL);
+    if (!en.sthread)
+        // registration before Threads and Hash are set up
+        return;
+    tp.setSize(en.Hash);
+    en.allocThreads();
+}
+
 static void uciClearHash()
 {
-    tp.clean();
+    tp.clean(en.lazyClearHash);
+}
+
+static void uciSetHashFormat()
+{
+    tp.replace = en.ttReplace;
+    if (en.ttFormat == tp.format)
+        return;
+    if (tp.hashfile != "")
+    {
+        // the hash file holds the table in the current format
+        en.ttFormat = tp.format;
+        en.send("info string Cannot change the Hash Format while Hash File is set.\n");
+        return;
+    }
+    tp.releaseTable();
+    tp.format = en.ttFormat;
+    tp.setSize(en.Hash);
+}
+
+static void uciSetHashFile()
+{
+    string f = (en.HashFile == "<empty>" ? "" : en.HashFile);
+    if (f == tp.hashfile)
+        return;
+    // releasing the table writes the entries to the old file before switching
+    tp.releaseTable();
+    tp.hashfile = f;
+    tp.setSize(en.Hash);
+}
+
+static void uciSetSharedHash()
+{
+    string name = (en.SharedHash == "<empty>" ? "" : en.SharedHash);
+    if (name == tp.shmname)
+        return;
+    tp.releaseTable();
+    tp.shmname = name;
+    tp.setSize(en.Hash);
+}
+
+static void uciSaveHash()
+{
+    if (tp.hashfile == "")
+        en.send("info string Cannot save the hash: Hash File is not set.\n");
+    else if (tp.saveFile(true))
+        en.send("info string Hash saved to %s.\n", tp.hashfile.c_str());
 }
 
 static void uciSetSyzygyPath()
@@ -2403,23 +2923,112 @@ static void uciSetSyzygyPath()
     init_tablebases((char*)en.SyzygyPath.c_str());
 }
 
+static void uciSetNnue()
+{
+    static string loadedNet = "";
+    NnueReady = false;
+    // cached evals may come from the other evaluation
+    for (int i = 0; i < en.Threads; i++)
+        if (en.sthread[i].evlhsh)
+            en.sthread[i].evlhsh->clean();
+    if (!en.useNnue)
+        return;
+
+    if (en.NnueNetpath == "" || en.NnueNetpath == "<empty>")
+    {
+        printf("info string NNUE: No network given in NNUENetpath; using the handcrafted evaluation.\n");
+        return;
+    }
+
+    if (en.NnueNetpath != loadedNet)
+    {
+        loadedNet = "";
+        if (!NnueReadNet(en.NnueNetpath))
+        {
+            printf("info string NNUE: Using the handcrafted evaluation.\n");
+            return;
+        }
+        loadedNet = en.NnueNetpath;
+        printf("info string NNUE: Network %s loaded, %s kernels.\n", loadedNet.c_str(), NnueSimdName());
+    }
+
+    // accumulators of the existing positions are outdated
+    en.rootposition.nnueksq[WHITE] = en.rootposition.nnueksq[BLACK] = -1;
+    for (int i = 0; i < en.Threads; i++)
+        en.sthread[i].pos.nnueksq[WHITE] = en.sthread[i].pos.nnueksq[BLACK] = -1;
+    NnueReady = true;
+}
+
 
 searchthread::searchthread()
 {
     pwnhsh = NULL;
+    evlhsh = NULL;
+    job = nullptr;
+    exitThread = false;
+    thr = thread(&searchthread::idleLoop, this);
 }
 
 searchthread::~searchthread()
 {
+    {
+        unique_lock<mutex> lk(mtx);
+        exitThread = true;
+    }
+    cv.notify_all();
+    if (thr.joinable())
+        thr.join();
     delete pwnhsh;
+    delete evlhsh;
+}
+
+// The threads stay alive between searches and just park here waiting for the next job
+void searchthread::idleLoop()
+{
+    while (true)
+    {
+        unique_lock<mutex> lk(mtx);
+        cv.wait(lk, [this] { return job || exitThread; });
+        if (exitThread)
+            return;
+        lk.unlock();
+        job(this);
+        lk.lock();
+        job = nullptr;
+        lk.unlock();
+        cv.notify_all();
+    }
+}
+
+void searchthread::startJob(void(*j)(searchthread*))
+{
+    {
+        unique_lock<mutex> lk(mtx);
+        cv.wait(lk, [this] { return !job; });
+        job = j;
+    }
+    cv.notify_all();
+}
+
+void searchthread::waitForJob()
+{
+    unique_lock<mutex> lk(mtx);
+    cv.wait(lk, [this] { return !job; });
 }
 
 
 engine::engine()
 {
     initBitmaphelper();
+#ifdef ISADISPATCH
+    snprintf(name, sizeof(name), ENGINEVER, cpuIsaLevel());
+#else
+    snprintf(name, sizeof(name), "%s", ENGINEVER);
+#endif
     rootposition.pwnhsh = new Pawnhash(1);  // some dummy pawnhash just to make the prefetch in playMove happy
     
+    ucioptions.Register(&useNuma, "NUMA", ucicheck, "false", 0, 0, uciSetNuma);
+    ucioptions.Register(&hugePages, "Huge Pages", ucicheck, "true", 0, 0, uciSetHugePages);
     ucioptions.Register(&Threads, "Threads", ucispin, "1", 1, MAXTHREADS, uciSetThreads);  // order is important as the pawnhash depends on Threads > 0
     ucioptions.Register(&Hash, "Hash", ucispin, to_string(DEFAULTHASH), 1, MAXHASH, uciSetHash);
     ucioptions.Register(&moveOverhead, "Move Overhead", ucispin, "50", 0, 5000, nullptr);
@@ -2428,8 +3037,21 @@ engine::engine()
     ucioptions.Register(&SyzygyPath, "SyzygyPath", ucistring, "<empty>", 0, 0, uciSetSyzygyPath);
     ucioptions.Register(&Syzygy50MoveRule, "Syzygy50MoveRule", ucicheck, "true");
     ucioptions.Register(&SyzygyProbeLimit, "SyzygyProbeLimit", ucispin, "7", 0, 7, nullptr);
+    ucioptions.Register(&NnueNetpath, "NNUENetpath", ucistring, "<empty>", 0, 0, uciSetNnue);
+    ucioptions.Register(&useNnue, "Use NNUE", ucicheck, "false", 0, 0, uciSetNnue);
+    ucioptions.Register(&lazyEvalMargin, "Lazy Eval Margin", ucispin, "0", 0, 1000, nullptr);
+    ucioptions.Register(&sizeOfEh, "Eval Cache", ucispin, "0", 0, 256, uciSetEvalCache);
+    ucioptions.Register(&sharedPawnhash, "Shared Pawnhash", ucicheck, "false", 0, 0, uciSetSharedPawnhash);
     ucioptions.Register(&chess960, "UCI_Chess960", ucicheck, "false");
     ucioptions.Register(nullptr, "Clear Hash", ucibutton, "", 0, 0, uciClearHash);
+    ucioptions.Register(&lazyClearHash, "Lazy Clear Hash", ucicheck, "true");
+    ucioptions.Register(&ttFormat, "Hash Format", ucicombo, "5x12/64", 0, 0, uciSetHashFormat, TTFORMATNAMES);
+    ucioptions.Register(&ttReplace, "Hash Replace", ucicombo, "depth-age", 0, 0, uciSetHashFormat, TTREPLACENAMES);
+    ucioptions.Register(&HashFile, "Hash File", ucistring, "<empty>", 0, 0, uciSetHashFile);
+    ucioptions.Register(nullptr, "Save Hash", ucibutton, "", 0, 0, uciSaveHash);
+    ucioptions.Register(&SharedHash, "Shared Hash", ucistring, "<empty>", 0, 0, uciSetSharedHash);
+    ucioptions.Register(&searchstatistics, "Statistics", ucicheck, "false");
+    ucioptions.Register(&statisticsinterval, "Statistics Interval", ucispin, "0", 0, 3600, nullptr);
 
 #ifdef _WIN32
     LARGE_INTEGER f;
@@ -2443,42 +3065,122 @@ engine::engine()
 engine::~engine()
 {
     ucioptions.Set("SyzygyPath", "<empty>");
-    delete[] sthread;
+    freeThreads();
+    delete sharedpwnhsh;
     delete rootposition.pwnhsh;
 }
 
+static void allocThreadPawnhash(searchthread *thr)
+{
+    delete thr->pwnhsh;
+    thr->pwnhsh = (en.sharedpwnhsh ? nullptr : new Pawnhash(en.sizeOfPh));
+    thr->pos.pwnhsh = (en.sharedpwnhsh ? en.sharedpwnhsh : thr->pwnhsh);
+}
+
 void engine::allocPawnhash()
 {
-    for (int i = 0; i < Threads; i++)
-    {
-        delete sthread[i].pwnhsh;
-        sthread[i].pos.pwnhsh = sthread[i].pwnhsh = new Pawnhash(sizeOfPh);
-    }
+    delete sharedpwnhsh;
+    sharedpwnhsh = (sharedPawnhash ? new Pawnhash(sizeOfPh * Threads) : nullptr);
+    // Let every thread allocate its own pawnhash so it gets first touched on the thread's node
+    startThreads(allocThreadPawnhash);
+    waitThreads();
+}
+
+static void allocThreadEvalhash(searchthread *thr)
+{
+    delete thr->evlhsh;
+    thr->pos.evlhsh = thr->evlhsh = (en.sizeOfEh ? new Evalhash(en.sizeOfEh) : nullptr);
+}
+
+void engine::allocEvalhash()
+{
+    startThreads(allocThreadEvalhash);
+    waitThreads();
 }
 
 
+static atomic<int> numaBindFailures;
+
+static void numaBindSearchthread(searchthread *thr)
+{
+    thr->numaNode = numaBindThread(thr->index);
+    if (!numaBindMemory(thr, sizeof(searchthread), thr->numaNode))
+        numaBindFailures++;
+}
+
+void engine::freeThreads()
+{
+    if (!sthread)
+        return;
+    int n = sthread[0].numofthreads;
+    for (int i = 0; i < n; i++)
+        sthread[i].~searchthread();
+    freeHuge(sthread, n * sizeof(searchthread), threadsPageMode);
+    sthread = nullptr;
+}
+
 void engine::allocThreads()
 {
-    delete[] sthread;
-    sthread = new searchthread[Threads];
+    freeThreads();
+    // the thread data holds the history tables which are hot in the search; with NUMA every thread
+    // binds its part to its node which doesn't work with threads sharing a huge page
+    sthread = (searchthread*)allocHuge(Threads * sizeof(searchthread), &threadsPageMode, useNuma ? PAGESNORMAL : pageMode);
+    for (int i = 0; i < Threads; i++)
+        new (&sthread[i]) searchthread();
     for (int i = 0; i < Threads; i++)
     {
+        // the thread positions are also used outside of search (generate, tuning) so they need their buffers right away
+        sthread[i].pos.allocPlyBuffers(1);
         sthread[i].index = i;
         sthread[i].searchthreads = sthread;
         sthread[i].numofthreads = Threads;
+        sthread[i].numaNode = -1;
+    }
+    if (useNuma)
+    {
+        numaBindFailures = 0;
+        startThreads(numaBindSearchthread);
+        waitThreads();
+        if (numaBindFailures)
+            send("info string NUMA: Cannot bind the data of %d thread(s) to their node.\n", (int)numaBindFailures);
+        string s = "info string NUMA: " + to_string(numanodes.size()) + " node(s);";
+        for (size_t n = 0; n < numanodes.size(); n++)
+        {
+            int threadsOnNode = 0;
+            for (int i = 0; i < Threads; i++)
+                threadsOnNode += (sthread[i].numaNode == numanodes[n].node);
+            s += " node" + to_string(numanodes[n].node) + ": " + to_string(numanodes[n].cpus.size()) + " cpus " + to_string(threadsOnNode) + " threads;";
+        }
+        send("%s%s\n", s.c_str(), numanodes.size() > 1 ? " TT interleaved" : "");
     }
     allocPawnhash();
+    allocEvalhash();
+    sendPageModes(false, true);
     prepareThreads();
     resetStats();
 }
 
 
+// Reports the page sizes the large tables got
+void engine::sendPageModes(bool hash, bool threads)
+{
+    if (!reportPageModes)
+        return;
+    // a mapped hash file or shared hash reports itself
+    if (hash && !tp.filemap)
+        send("info string Hash: %d MB on %s\n", (int)((tp.size << tp.clustershift) >> 20), pageModeName(tp.pagemode));
+    if (threads)
+        send("info string Thread data on %s, pawn hash on %s\n", pageModeName(threadsPageMode),
+            pageModeName(sharedpwnhsh ? sharedpwnhsh->pagemode : sthread[0].pwnhsh->pagemode));
+}
+
+
 void engine::prepareThreads()
 {
     for (int i = 0; i < Threads; i++)
     {
         // copy new position to the threads copy but keep old history data
-        memcpy((void*)&sthread[i].pos, &rootposition, offsetof(chessposition, history));
+        threadCopyBytes = sthread[i].pos.copyFrom(&rootposition);
         sthread[i].pos.threadindex = i;
         // early reset of variables that are important for bestmove selection
         sthread[i].pos.bestmovescore[0] = NOSCORE;
@@ -2499,6 +3201,41 @@ void engine::resetStats()
     }
 }
 
+void engine::getStatistics(statistic *st)
+{
+    // all counters are 64bit so the struct can be summed up as an array; the tail padding is summed harmlessly
+    const int n = sizeof(statistic) / sizeof(U64);
+    memset(st, 0, sizeof(statistic));
+    for (int i = 0; i < Threads; i++)
+    {
+        U64 *src = (U64*)&sthread[i].pos.statistics;
+        U64 *dst = (U64*)st;
+        for (int j = 0; j < n; j++)
+            dst[j] += src[j];
+    }
+}
+
+void engine::resetStatistics()
+{
+    for (int i = 0; i < Threads; i++)
+        memset(&sthread[i].pos.statistics, 0, sizeof(statistic));
+}
+
+
+
+void engine::startThreads(void(*job)(searchthread*))
+{
+    for (int i = 0; i < Threads; i++)
+        sthread[i].startJob(job);
+}
+
+
+void engine::waitThreads()
+{
+    for (int i = 0; i < Threads; i++)
+        sthread[i].waitForJob();
+}
+
 
 U64 engine::getTotalNodes()
 {
@@ -2604,11 +3341,14 @@ void engine::communicate(string inputstring)
                 send("id name %s\n", name);
                 send("id author %s\n", author);
                 ucioptions.Print();
+                reportPageModes = true;
+                sendPageModes(true, true);
                 send("uciok\n", author);
                 break;
             case UCINEWGAME:
-                // invalidate hash and history
-                tp.clean();
+                // invalidate hash and history; a shared hash keeps the work of the other processes
+                if (!tp.shm)
+                    tp.clean(en.lazyClearHash);
                 resetStats();
                 sthread[0].pos.lastbestmovescore = NOSCORE;
                 break;
@@ -2789,6 +3529,17 @@ void engine::communicate(string inputstring)
                     cout << perft(maxdepth, false) << "\n";
                 }
                 break;
+            case STATS:
+                if (ci < cs && commandargs[ci] == "reset")
+                {
+                    resetStatistics();
+                }
+                else
+                {
+                    statistic st;
+                    getStatistics(&st);
+                    search_statistics(&st);
+                }
                 break;
             default:
                 break;
@@ -2861,7 +3612,19 @@ void ucioptions_t::Set(string n, string v, bool force)
             *(bool*)op->enginevar = bVal;
         break;
     case ucicombo:
-        break;  // FIXME: to be implemented when Rubi gets first combo option
+    {
+        // the engine variable gets the index of the value in the blank separated list
+        istringstream vars(op->varlist);
+        string var;
+        for (int i = 0; vars >> var; i++)
+            if (var == v)
+            {
+                if ((bChanged = (force || i != *(int*)(op->enginevar))))
+                    *(int*)(op->enginevar) = i;
+                break;
+            }
+        break;
+    }
     case ucibutton:
         bChanged = true;
         break;
@@ -2915,7 +3678,15 @@ void ucioptions_t::Print()
             break;
 #endif
         case ucicombo:
-            break; // FIXME: to be implemented...
+        {
+            cout << "combo default " << op->def;
+            istringstream vars(op->varlist);
+            string var;
+            while (vars >> var)
+                cout << " var " << var;
+            cout << "\n";
+            break;
+        }
         default:
             break;
         }
@@ -2925,10 +3696,17 @@ void ucioptions_t::Print()
 
 // Explicit template instantiation
 // This avoids putting these definitions in header file
-template U64 chessposition::pieceMovesTo<KNIGHT>(int);
-template U64 chessposition::pieceMovesTo<BISHOP>(int);
-template U64 chessposition::pieceMovesTo<ROOK>(int);
-template U64 chessposition::pieceMovesTo<QUEEN>(int);
+template U64 chessposition::pieceMovesTo<KNIGHT, false>(int);
+template U64 chessposition::pieceMovesTo<BISHOP, false>(int);
+template U64 chessposition::pieceMovesTo<ROOK, false>(int);
+template U64 chessposition::pieceMovesTo<QUEEN, false>(int);
+template U64 chessposition::pieceMovesTo<KNIGHT, true>(int);
+template U64 chessposition::pieceMovesTo<BISHOP, true>(int);
+template U64 chessposition::pieceMovesTo<ROOK, true>(int);
+template U64 chessposition::pieceMovesTo<QUEEN, true>(int);
+template int CreateMovelist<ALL>(chessposition *pos, chessmove* mstart);
+template int CreateMovelist<QUIET>(chessposition *pos, chessmove* mstart);
+template int CreateMovelist<TACTICAL>(chessposition *pos, chessmove* mstart);
 
 
 // Some global objects
@@ -304,21 +304,6 @@ void traceEvalOut()
 
 }
 
-#if 0  // this could be useful if endgames are preregistered
-void register_endgame(string gamesignature, int(*endgame)(chessposition*))
-{
-    int pcs[16];
-    getPcsFromStr(gamesignature.c_str(), pcs);
-    for (int col = WHITE; col <= BLACK; col++)
-    {
-        U64 mathash = calc_key_from_pcs(pcs, col);
-        Materialhashentry* e;
-        mh.probeHash(mathash, &e);
-    }
-}
-#endif
-
-
 // some common endgames that need help of special evaluation
 static int KBNvK(chessposition *p)
 {
@@ -336,6 +321,10 @@ static int KBNvK(chessposition *p)
     return (SCOREWONENDGAME - kwcornerdistance * 10 + squareDistance[ks][kw] - p->testRepetiton() * 50 - p->halfmovescounter) * S2MSIGN(strongside);
 }
 
+// special endgame evaluations referenced by materialentry.endgame
+static int(*const materialendgames[])(chessposition*) = { nullptr, KBNvK };
+#define ENDGAMEKBNVK 1
+
 
 // get psqt for eval tracing and tuning
 int chessposition::getpsqval(bool showDetails)
@@ -367,7 +356,7 @@ int chessposition::getpsqval(bool showDetails)
 }
 
 template <EvalType Et, int Me>
-void chessposition::getPawnAndKingEval(pawnhashentry *entryptr)
+HOTFUNC void chessposition::getPawnAndKingEval(pawnhashentry *entryptr)
 {
     const bool bTrace = (Et == TRACE);
     const int You = Me ^ S2MMASK;
@@ -384,15 +373,12 @@ void chessposition::getPawnAndKingEval(pawnhashentry *entryptr)
     while (pb)
     {
         index = pullLsb(&pb);
-        entryptr->attackedBy2[Me] |= (entryptr->attacked[Me] & pawn_attacks_to[index][Me]);
-        entryptr->attacked[Me] |= pawn_attacks_to[index][Me];
-        entryptr->semiopen[Me] &= (int)(~BITSET(FILE(index)));
 
         U64 yourStoppers = passedPawnMask[index][Me] & yourPawns;
         if (!yourStoppers)
         {
             // passed pawn
-            entryptr->passedpawnbb[Me] |= BITSET(index);
+            entryptr->passedpawnbb |= BITSET(index);
             int mykingdistance = squareDistance[index][kingpos[Me]];
             int yourkingdistance = squareDistance[index][kingpos[You]];
             entryptr->value += EVAL(eps.eKingsupportspasserbonus[mykingdistance][RRANK(index, Me)], S2MSIGN(Me));
@@ -513,8 +499,8 @@ void chessposition::getPawnAndKingEval(pawnhashentry *entryptr)
 }
 
 
-template <EvalType Et, PieceType Pt, int Me>
-int chessposition::getPieceEval(positioneval *pe)
+template <EvalType Et, PieceType Pt, int Me, bool Pext>
+HOTFUNC int chessposition::getPieceEval(positioneval *pe)
 {
     const bool bTrace = (Et == TRACE);
     const int You = Me ^ S2MMASK;
@@ -532,12 +518,12 @@ int chessposition::getPieceEval(positioneval *pe)
         {
             U64 occupied = occupied00[0] | occupied00[1];
             U64 xrayrookoccupied = occupied ^ (piece00[WROOK + Me] | piece00[WQUEEN + Me]);
-            attack = MAGICROOKATTACKS(xrayrookoccupied, index);
+            attack = MAGICROOKATTACKS(Pext, xrayrookoccupied, index);
 
             // extrabonus for rook on (semi-)open file  
-            if (Pt == ROOK && (pe->phentry->semiopen[Me] & BITSET(FILE(index)))) {
-                result += EVAL(eps.eSlideronfreefilebonus[bool(pe->phentry->semiopen[You] & BITSET(FILE(index)))], S2MSIGN(Me));
-                if (bTrace) te.rooks[Me] += EVAL(eps.eSlideronfreefilebonus[bool(pe->phentry->semiopen[You] & BITSET(FILE(index)))], S2MSIGN(Me));
+            if (Pt == ROOK && (pe->semiopen[Me] & BITSET(FILE(index)))) {
+                result += EVAL(eps.eSlideronfreefilebonus[bool(pe->semiopen[You] & BITSET(FILE(index)))], S2MSIGN(Me));
+                if (bTrace) te.rooks[Me] += EVAL(eps.eSlideronfreefilebonus[bool(pe->semiopen[You] & BITSET(FILE(index)))], S2MSIGN(Me));
             }
         }
 
@@ -545,7 +531,7 @@ int chessposition::getPieceEval(positioneval *pe)
         {
             U64 occupied = occupied00[0] | occupied00[1];
             U64 xraybishopoccupied = occupied ^ (piece00[WBISHOP + Me] | piece00[WQUEEN + Me]);
-            attack |= MAGICBISHOPATTACKS(xraybishopoccupied, index);
+            attack |= MAGICBISHOPATTACKS(Pext, xraybishopoccupied, index);
 
             if (Pt == BISHOP)
             {
@@ -553,7 +539,7 @@ int chessposition::getPieceEval(positioneval *pe)
                 result += EVAL(eps.ePawnblocksbishoppenalty, S2MSIGN(Me) * POPCOUNT(blockingpawns));
                 if (bTrace) te.minors[Me] += EVAL(eps.ePawnblocksbishoppenalty, S2MSIGN(Me) * POPCOUNT(blockingpawns));
 
-                if (MORETHANONE(mBishopAttacks[index][MAGICBISHOPINDEX(piece00[WPAWN] | piece00[BPAWN], index)] & CENTER))
+                if (MORETHANONE(MAGICBISHOPATTACKS(Pext, piece00[WPAWN] | piece00[BPAWN], index) & CENTER))
                 {
                     result += EVAL(eps.eBishopcentercontrolbonus, S2MSIGN(Me));
                     if (bTrace) te.minors[Me] += EVAL(eps.eBishopcentercontrolbonus, S2MSIGN(Me));
@@ -613,8 +599,8 @@ int chessposition::getPieceEval(positioneval *pe)
 }
 
 
-template <EvalType Et, int Me>
-int chessposition::getLateEval(positioneval *pe)
+template <EvalType Et, int Me, bool Pext>
+HOTFUNC int chessposition::getLateEval(positioneval *pe)
 {
     const bool bTrace = (Et == TRACE);
     const int You = Me ^ S2MMASK;
@@ -624,7 +610,7 @@ int chessposition::getLateEval(positioneval *pe)
 
     // Passed pawns
     U64 ppb;
-    ppb = pe->phentry->passedpawnbb[Me];
+    ppb = pe->phentry->passedpawnbb & piece00[WPAWN | Me];
     while (ppb)
     {
         index = pullLsb(&ppb);
@@ -651,16 +637,16 @@ int chessposition::getLateEval(positioneval *pe)
 
     // Safe checks and attacks to king area
     kingdanger += SQEVAL(eps.eKingattackweight[KNIGHT], pe->kingattackpiececount[You][KNIGHT] * pe->kingattackers[You], You);
-    if (pieceMovesTo<KNIGHT>(kingpos[Me]) & attackedBy[You][KNIGHT] & yoursafetargets)
+    if (pieceMovesTo<KNIGHT, Pext>(kingpos[Me]) & attackedBy[You][KNIGHT] & yoursafetargets)
         kingdanger += SQEVAL(eps.eSafecheckbonus[KNIGHT], 1, You);
     kingdanger += SQEVAL(eps.eKingattackweight[BISHOP], pe->kingattackpiececount[You][BISHOP] * pe->kingattackers[You], You);
-    if (pieceMovesTo<BISHOP>(kingpos[Me]) & attackedBy[You][BISHOP] & yoursafetargets)
+    if (pieceMovesTo<BISHOP, Pext>(kingpos[Me]) & attackedBy[You][BISHOP] & yoursafetargets)
         kingdanger += SQEVAL(eps.eSafecheckbonus[BISHOP], 1, You);
     kingdanger += SQEVAL(eps.eKingattackweight[ROOK], pe->kingattackpiececount[You][ROOK] * pe->kingattackers[You], You);
-    if (pieceMovesTo<ROOK>(kingpos[Me]) & attackedBy[You][ROOK] & yoursafetargets)
+    if (pieceMovesTo<ROOK, Pext>(kingpos[Me]) & attackedBy[You][ROOK] & yoursafetargets)
         kingdanger += SQEVAL(eps.eSafecheckbonus[ROOK], 1, You);
     kingdanger += SQEVAL(eps.eKingattackweight[QUEEN], pe->kingattackpiececount[You][QUEEN] * pe->kingattackers[You], You);
-    if (pieceMovesTo<QUEEN>(kingpos[Me]) & attackedBy[You][QUEEN] & yoursafetargets)
+    if (pieceMovesTo<QUEEN, Pext>(kingpos[Me]) & attackedBy[You][QUEEN] & yoursafetargets)
         kingdanger += SQEVAL(eps.eSafecheckbonus[QUEEN], 1, You);
 
     kingdanger += SQEVAL(eps.eKingdangerbyqueen, !piece00[WQUEEN | You], You);
@@ -711,16 +697,16 @@ int chessposition::getLateEval(positioneval *pe)
 
 
 template <EvalType Et, int Me>
-int chessposition::getGeneralEval(positioneval *pe)
+HOTFUNC int chessposition::getGeneralEval(positioneval *pe)
 {
     const bool bTrace = (Et == TRACE);
     const int You = Me ^ S2MMASK;
 
     attackedBy[Me][KING] = king_attacks[kingpos[Me]];
-    attackedBy2[Me] = pe->phentry->attackedBy2[Me] | (attackedBy[Me][KING] & pe->phentry->attacked[Me]);
-    attackedBy[Me][0] = attackedBy[Me][KING] | pe->phentry->attacked[Me];
+    attackedBy2[Me] = pe->pawnattacksBy2[Me] | (attackedBy[Me][KING] & pe->pawnattacks[Me]);
+    attackedBy[Me][0] = attackedBy[Me][KING] | pe->pawnattacks[Me];
 
-    attackedBy[Me][PAWN] = pe->phentry->attacked[Me];
+    attackedBy[Me][PAWN] = pe->pawnattacks[Me];
 
     pe->kingattackers[Me] = POPCOUNT(attackedBy[Me][PAWN] & kingdangerMask[kingpos[You]][You]);
 
@@ -739,10 +725,11 @@ int chessposition::getGeneralEval(positioneval *pe)
 }
 
 
-template <EvalType Et>
-int chessposition::getEval()
+template <EvalType Et, bool Pext>
+HOTFUNC int chessposition::getEvalHot(int alpha, int beta)
 {
     const bool bTrace = (Et == TRACE);
+    lazyeval = false;
     if (bTrace) te = { { 0 }, { 0 },{ 0 },{ 0 },{ 0 },{ 0 },{ 0 },{ 0 },{ 0 },{ 0 }, 0, 0, 0, 0, 0 };
 #ifdef EVALTUNE
     resetTuner();
@@ -755,13 +742,13 @@ int chessposition::getEval()
     // reset the attackedBy information
     memset(attackedBy, 0, sizeof(attackedBy));
 
-    bool hashexist = mtrlhsh.probeHash(materialhash, &pe.mhentry);
-    if (!hashexist)
-        getScaling(pe.mhentry);
+    materialentry mentry;
+    getMaterialEntry(&mentry);
+    pe.mhentry = &mentry;
 
-    if (pe.mhentry->endgame)
+    if (mentry.endgame)
     {
-        score = pe.mhentry->endgame(this);
+        score = materialendgames[mentry.endgame](this);
         if (bTrace)
         {
             te.endgame = te.score = score;
@@ -770,23 +757,66 @@ int chessposition::getEval()
         return score;
     }
 
-    hashexist = pwnhsh->probeHash(pawnhash, &pe.phentry);
+    if (!bTrace && NnueReady)
+        return S2MSIGN(state & S2MMASK) * NnueGetEval();
+
+    pawnhashentry phentry;
+    pe.phentry = &phentry;
+    bool hashexist = pwnhsh->probeHash(pawnhash, &phentry);
+    STATISTICSINC(eval_pawn_n);
     if (bTrace || !hashexist)
     {
-        if (bTrace) pe.phentry->value = 0;
-        getPawnAndKingEval<Et, 0>(pe.phentry);
-        getPawnAndKingEval<Et, 1>(pe.phentry);
-        U64 pawns = piece00[WPAWN] | piece00[BPAWN];
-        pe.phentry->bothFlanks = ((pawns & FLANKLEFT) && (pawns & FLANKRIGHT));
+        phentry.value = 0;
+        phentry.passedpawnbb = 0ULL;
+        getPawnAndKingEval<Et, 0>(&phentry);
+        getPawnAndKingEval<Et, 1>(&phentry);
+        pwnhsh->addHash(pawnhash, &phentry);
+    }
+    else
+    {
+        STATISTICSINC(eval_pawn_hit);
+    }
+
+    int pawnEval = phentry.value;
+
+    // Lazy eval: skip mobility, king safety and the other piece terms if psq and pawns are far outside the window
+    if (!bTrace && en.lazyEvalMargin && alpha > NOSCORE)
+    {
+        int lazyEval = psqval + pawnEval;
+        sc = pe.mhentry->scale[lazyEval > SCOREDRAW ? WHITE : BLACK];
+        if (sc != SCALE_DRAW)
+        {
+            score = TAPEREDANDSCALEDEVAL(lazyEval, ph, sc) + CEVAL(eps.eTempo, S2MSIGN(state & S2MMASK));
+            int s2mscore = S2MSIGN(state & S2MMASK) * score;
+            if (s2mscore - en.lazyEvalMargin >= beta || s2mscore + en.lazyEvalMargin <= alpha)
+            {
+                lazyeval = true;
+                return score;
+            }
+        }
     }
 
-    int pawnEval = pe.phentry->value;
+    for (int me = WHITE; me <= BLACK; me++)
+    {
+        U64 pawns = piece00[WPAWN | me];
+        U64 attacksleft = (me ? (pawns & ~FILEABB) >> 9 : (pawns & ~FILEABB) << 7);
+        U64 attacksright = (me ? (pawns & ~FILEHBB) >> 7 : (pawns & ~FILEHBB) << 9);
+        pe.pawnattacks[me] = attacksleft | attacksright;
+        pe.pawnattacksBy2[me] = attacksleft & attacksright;
+        U64 files = pawns | (pawns >> 32);
+        files |= files >> 16;
+        files |= files >> 8;
+        pe.semiopen[me] = (unsigned char)~files;
+    }
+    U64 allpawns = piece00[WPAWN] | piece00[BPAWN];
+    pe.bothFlanks = ((allpawns & FLANKLEFT) && (allpawns & FLANKRIGHT));
+
     int generalEval = getGeneralEval<Et, 0>(&pe) + getGeneralEval<Et, 1>(&pe);
-    int piecesEval = getPieceEval<Et, KNIGHT, 0>(&pe)   + getPieceEval<Et, KNIGHT, 1>(&pe)
-                    + getPieceEval<Et, BISHOP, 0>(&pe) + getPieceEval<Et, BISHOP, 1>(&pe)
-                    + getPieceEval<Et, ROOK, 0>(&pe)   + getPieceEval<Et, ROOK, 1>(&pe)
-                    + getPieceEval<Et, QUEEN, 0>(&pe)  + getPieceEval<Et, QUEEN, 1>(&pe);
-    int lateEval = getLateEval<Et, 0>(&pe) + getLateEval<Et, 1>(&pe);
+    int piecesEval = getPieceEval<Et, KNIGHT, 0, Pext>(&pe)   + getPieceEval<Et, KNIGHT, 1, Pext>(&pe)
+                    + getPieceEval<Et, BISHOP, 0, Pext>(&pe) + getPieceEval<Et, BISHOP, 1, Pext>(&pe)
+                    + getPieceEval<Et, ROOK, 0, Pext>(&pe)   + getPieceEval<Et, ROOK, 1, Pext>(&pe)
+                    + getPieceEval<Et, QUEEN, 0, Pext>(&pe)  + getPieceEval<Et, QUEEN, 1, Pext>(&pe);
+    int lateEval = getLateEval<Et, 0, Pext>(&pe) + getLateEval<Et, 1, Pext>(&pe);
 
     int totalEval = psqval + pawnEval + generalEval + piecesEval + lateEval;
 
@@ -796,7 +826,7 @@ int chessposition::getEval()
     if (!bTrace && sc == SCALE_DRAW)
         return SCOREDRAW;
 
-    int complexity = getComplexity(totalEval, pe.phentry, pe.mhentry);
+    int complexity = getComplexity(totalEval, &pe);
     totalEval += complexity;
 
     if (bTrace)
@@ -820,28 +850,50 @@ int chessposition::getEval()
     return score;
 }
 
+template <EvalType Et>
+int chessposition::getEval(int alpha, int beta)
+{
+    return usePext ? getEvalHot<Et, true>(alpha, beta) : getEvalHot<Et, false>(alpha, beta);
+}
 
-int chessposition::getComplexity(int val, pawnhashentry *phentry, Materialhashentry *mhentry)
+
+// Static eval for the search with lookup in the per-thread eval cache; lazy scores are not cached
+int chessposition::getCachedEval(int alpha, int beta)
+{
+    int score;
+    STATISTICSINC(eval_n);
+#ifndef EVALTUNE
+    if (evlhsh && evlhsh->probeHash(hash, &score))
+    {
+        STATISTICSINC(eval_cache_hit);
+        ph = phase();   // the search uses the phase of the last evaluation
+        lazyeval = false;
+        return score;
+    }
+#endif
+    score = usePext ? getEvalHot<NOTRACE, true>(alpha, beta) : getEvalHot<NOTRACE, false>(alpha, beta);
+    if (evlhsh && !lazyeval)
+        evlhsh->addHash(hash, score);
+    return score;
+}
+
+
+int chessposition::getComplexity(int val, positioneval *pe)
 {
         int evaleg = GETEGVAL(val);
         int sign = (evaleg > 0) - (evaleg < 0);
-        int complexity = EEVAL(eps.eComplexpawnsbonus, mhentry->numOfPawns);
-        complexity += EEVAL(eps.eComplexpawnflanksbonus, phentry->bothFlanks);
-        complexity += EEVAL(eps.eComplexonlypawnsbonus, mhentry->onlyPawns);
+        int complexity = EEVAL(eps.eComplexpawnsbonus, pe->mhentry->numOfPawns);
+        complexity += EEVAL(eps.eComplexpawnflanksbonus, pe->bothFlanks);
+        complexity += EEVAL(eps.eComplexonlypawnsbonus, pe->mhentry->onlyPawns);
         complexity += EEVAL(eps.eComplexadjust, 1);
 
         return sign * max(complexity, -abs(evaleg));
 }
 
 
-void chessposition::getScaling(Materialhashentry* mhentry)
+static void calcMaterialEntry(materialentry *mentry, const int pawns[2], const int knights[2], const int bishops[2], const int rooks[2], const int queens[2])
 {
     // Calculate scaling for endgames with special material
-    const int pawns[2] = { POPCOUNT(piece00[WPAWN]), POPCOUNT(piece00[BPAWN]) };
-    const int knights[2] = { POPCOUNT(piece00[WKNIGHT]), POPCOUNT(piece00[BKNIGHT]) };
-    const int bishops[2] = { POPCOUNT(piece00[WBISHOP]), POPCOUNT(piece00[BBISHOP]) };
-    const int rooks[2] = { POPCOUNT(piece00[WROOK]), POPCOUNT(piece00[BROOK]) };
-    const int queens[2] = { POPCOUNT(piece00[WQUEEN]), POPCOUNT(piece00[BQUEEN]) };
     const int nonpawnvalue[2] = {
         knights[WHITE] * materialvalue[KNIGHT]
         + bishops[WHITE] * materialvalue[BISHOP]
@@ -853,21 +905,20 @@ void chessposition::getScaling(Materialhashentry* mhentry)
         + queens[BLACK] * materialvalue[QUEEN]
     };
 
+    memset(mentry, 0, sizeof(materialentry));
     int stronger = (nonpawnvalue[WHITE] > nonpawnvalue[BLACK] || (nonpawnvalue[WHITE] == nonpawnvalue[BLACK] && pawns[WHITE] >= pawns[BLACK])) ? WHITE : BLACK;
     int weaker = 1 - stronger;
 
     // special endgames
-    if (piece00[WKNIGHT | stronger] && piece00[WBISHOP | stronger]
-        && (occupied00[stronger] ^ piece00[WKNIGHT | stronger] ^ piece00[WBISHOP | stronger]) == piece00[WKING | stronger]
-        && piece00[WKING | weaker] == occupied00[weaker])
+    if (knights[stronger] && bishops[stronger] && !pawns[stronger] && !rooks[stronger] && !queens[stronger]
+        && !pawns[weaker] && !nonpawnvalue[weaker])
     {
-        mhentry->endgame = KBNvK;
+        mentry->endgame = ENDGAMEKBNVK;
         return;
     }
 
-
     // Default scaling
-    mhentry->scale[WHITE] = mhentry->scale[BLACK] = SCALE_NORMAL;
+    mentry->scale[WHITE] = mentry->scale[BLACK] = SCALE_NORMAL;
 
     // Check for insufficient material using simnple heuristic from chessprogramming site
     for (int me = WHITE; me <= BLACK; me++)
@@ -875,24 +926,86 @@ void chessposition::getScaling(Materialhashentry* mhentry)
         int you = me ^ S2MMASK;
 
         if (pawns[me] == 0 && nonpawnvalue[me] - nonpawnvalue[you] <= materialvalue[BISHOP])
-            mhentry->scale[me] = nonpawnvalue[me] < materialvalue[ROOK] ? SCALE_DRAW : SCALE_HARDTOWIN;
+            mentry->scale[me] = nonpawnvalue[me] < materialvalue[ROOK] ? SCALE_DRAW : SCALE_HARDTOWIN;
 
         if (pawns[me] == 1 && nonpawnvalue[me] - nonpawnvalue[you] <= materialvalue[BISHOP])
-            mhentry->scale[me] = SCALE_ONEPAWN;
+            mentry->scale[me] = SCALE_ONEPAWN;
     }
 
-    U64 bishopsbb = (piece00[WBISHOP] | piece00[BBISHOP]);
-    if (bishops[WHITE] == 1 && bishops[BLACK] == 1
-        && (bishopsbb & WHITEBB) && (bishopsbb & BLACKBB)
+    // the colors of the bishops are checked in getMaterialEntry
+    mentry->oppositeBishops = (bishops[WHITE] == 1 && bishops[BLACK] == 1
         && nonpawnvalue[WHITE] <= materialvalue[BISHOP]
-        && nonpawnvalue[BLACK] <= materialvalue[BISHOP])
-        mhentry->scale[WHITE] = mhentry->scale[BLACK] = SCALE_OCB;
-    
-    mhentry->onlyPawns = (nonpawnvalue[0] + nonpawnvalue[1] == 0);
-    mhentry->numOfPawns = pawns[0] + pawns[1];
+        && nonpawnvalue[BLACK] <= materialvalue[BISHOP]);
+
+    mentry->onlyPawns = (nonpawnvalue[0] + nonpawnvalue[1] == 0);
+    mentry->numOfPawns = pawns[0] + pawns[1];
+}
+
+
+static materialentry materialtable[MATERIALTABLESIZE];
+
+const int materialweight[14] = { 0, 0,
+    MATERIALSIDESIZE, 1,                // pawns
+    9 * MATERIALSIDESIZE, 9,            // knights
+    27 * MATERIALSIDESIZE, 27,          // bishops
+    81 * MATERIALSIDESIZE, 81,          // rooks
+    243 * MATERIALSIDESIZE, 243,        // queens
+    0, 0 };
+
+void initMaterialTable()
+{
+    int pawns[2], knights[2], bishops[2], rooks[2], queens[2];
+    for (int i = 0; i < MATERIALTABLESIZE; i++)
+    {
+        for (int me = WHITE; me <= BLACK; me++)
+        {
+            int n = (me == WHITE ? i / MATERIALSIDESIZE : i % MATERIALSIDESIZE);
+            pawns[me] = n % 9; n /= 9;
+            knights[me] = n % 3; n /= 3;
+            bishops[me] = n % 3; n /= 3;
+            rooks[me] = n % 3; n /= 3;
+            queens[me] = n;
+        }
+        calcMaterialEntry(&materialtable[i], pawns, knights, bishops, rooks, queens);
+    }
+}
+
+int getMaterialIndex(chessposition *pos)
+{
+    int index = 0;
+    for (PieceCode pc = WPAWN; pc <= BQUEEN; pc++)
+    {
+        int count = POPCOUNT(pos->piece00[pc]);
+        index += count * materialweight[pc];
+        if (count > ((pc >> 1) == PAWN ? 8 : ((pc >> 1) == QUEEN ? 1 : 2)))
+            index |= MATERIALOVERFLOW;
+    }
+    return index;
+}
+
+HOTFUNC void chessposition::getMaterialEntry(materialentry *mentry)
+{
+    if (materialindex < MATERIALTABLESIZE)
+    {
+        *mentry = materialtable[materialindex];
+    }
+    else
+    {
+        // material with promoted pieces
+        const int pawns[2] = { POPCOUNT(piece00[WPAWN]), POPCOUNT(piece00[BPAWN]) };
+        const int knights[2] = { POPCOUNT(piece00[WKNIGHT]), POPCOUNT(piece00[BKNIGHT]) };
+        const int bishops[2] = { POPCOUNT(piece00[WBISHOP]), POPCOUNT(piece00[BBISHOP]) };
+        const int rooks[2] = { POPCOUNT(piece00[WROOK]), POPCOUNT(piece00[BROOK]) };
+        const int queens[2] = { POPCOUNT(piece00[WQUEEN]), POPCOUNT(piece00[BQUEEN]) };
+        calcMaterialEntry(mentry, pawns, knights, bishops, rooks, queens);
+    }
+
+    U64 bishopsbb = (piece00[WBISHOP] | piece00[BBISHOP]);
+    if (mentry->oppositeBishops && (bishopsbb & WHITEBB) && (bishopsbb & BLACKBB))
+        mentry->scale[WHITE] = mentry->scale[BLACK] = SCALE_OCB;
 }
 
 // Explicit template instantiation
 // This avoids putting these definitions in header file
-template int chessposition::getEval<NOTRACE>();
-template int chessposition::getEval<TRACE>();
+template int chessposition::getEval<NOTRACE>(int alpha, int beta);
+template int chessposition::getEval<TRACE>(int alpha, int beta);
@@ -143,6 +143,7 @@ void generateEpd(string egn)
             pos->hash = zb.getHash(pos);
             pos->pawnhash = zb.getPawnHash(pos);
             pos->materialhash = zb.getMaterialHash(pos);
+            pos->materialindex = getMaterialIndex(pos);
             pos->mstop = 1;
             pos->movestack[0].movecode = -1;  // Avoid fast eval after null move
             pos->rootheight = 0;
@@ -160,46 +161,64 @@ void generateEpd(string egn)
 }
 
 
-long long engine::perft(int depth, bool dotests)
+// Recursive perft that tests hashes, incremental psq and eval symmetry in every node
+static long long perftWithTests(chessposition *rootpos, int depth)
 {
     long long retval = 0;
-    chessposition *rootpos = &en.sthread[0].pos;
 
-    if (dotests)
+    if (rootpos->hash != zb.getHash(rootpos))
     {
-        if (rootpos->hash != zb.getHash(rootpos))
-        {
-            printf("Alarm! Wrong Hash! %llu\n", zb.getHash(rootpos));
-            rootpos->print();
-        }
-        if (rootpos->pawnhash && rootpos->pawnhash != zb.getPawnHash(rootpos))
-        {
-            printf("Alarm! Wrong Pawn Hash! %llu\n", zb.getPawnHash(rootpos));
-            rootpos->print();
-        }
-        if (rootpos->materialhash != zb.getMaterialHash(rootpos))
-        {
-            printf("Alarm! Wrong Material Hash! %llu\n", zb.getMaterialHash(rootpos));
-            rootpos->print();
-        }
-        int val1 = rootpos->getEval<NOTRACE>();
-        int psq1 = rootpos->getpsqval();
-        if (rootpos->psqval != psq1)
-        {
-            printf("PSQ-Test  :error  incremental:%d  recalculated:%d\n", rootpos->psqval, psq1);
-            rootpos->print();
-        }
+        printf("Alarm! Wrong Hash! %llu\n", zb.getHash(rootpos));
+        rootpos->print();
+    }
+    if (rootpos->pawnhash && rootpos->pawnhash != zb.getPawnHash(rootpos))
+    {
+        printf("Alarm! Wrong Pawn Hash! %llu\n", zb.getPawnHash(rootpos));
+        rootpos->print();
+    }
+    if (rootpos->materialhash != zb.getMaterialHash(rootpos))
+    {
+        printf("Alarm! Wrong Material Hash! %llu\n", zb.getMaterialHash(rootpos));
+        rootpos->print();
+    }
+    int mi = getMaterialIndex(rootpos);
+    if ((rootpos->materialindex & ~MATERIALOVERFLOW) != (mi & ~MATERIALOVERFLOW) || (mi & ~rootpos->materialindex & MATERIALOVERFLOW))
+    {
+        printf("Alarm! Wrong Material Index! %d\n", mi);
+        rootpos->print();
+    }
+    int val1 = rootpos->getEval<NOTRACE>();
+    int psq1 = rootpos->getpsqval();
+    if (rootpos->psqval != psq1)
+    {
+        printf("PSQ-Test  :error  incremental:%d  recalculated:%d\n", rootpos->psqval, psq1);
+        rootpos->print();
+    }
+    rootpos->mirror();
+    int val2 = rootpos->getEval<NOTRACE>();
+    rootpos->mirror();
+    int val3 = rootpos->getEval<NOTRACE>();
+    // the board of the black NNUE accumulator is rotated, not mirrored, so only the handcrafted eval is symmetric
+    if (!(val1 == val3 && (val1 == -val2 || NnueReady)))
+    {
+        printf("Mirrortest  :error  (%d / %d / %d)\n", val1, val2, val3);
+        rootpos->print();
         rootpos->mirror();
-        int val2 = rootpos->getEval<NOTRACE>();
+        rootpos->print();
         rootpos->mirror();
-        int val3 = rootpos->getEval<NOTRACE>();
-        if (!(val1 == val3 && val1 == -val2))
+        rootpos->print();
+    }
+    if (NnueReady)
+    {
+        // compare the incrementally updated accumulators with a fresh calculation
+        int16_t acc[2][NNUEHIDDEN];
+        int nnue1 = rootpos->NnueGetEval();
+        memcpy(acc, rootpos->nnueaccumulator, sizeof(acc));
+        rootpos->nnueksq[WHITE] = rootpos->nnueksq[BLACK] = -1;
+        int nnue2 = rootpos->NnueGetEval();
+        if (nnue1 != nnue2 || memcmp(acc, rootpos->nnueaccumulator, sizeof(acc)))
         {
-            printf("Mirrortest  :error  (%d / %d / %d)\n", val1, val2, val3);
-            rootpos->print();
-            rootpos->mirror();
-            rootpos->print();
-            rootpos->mirror();
+            printf("NNUE-Test  :error  incremental:%d  recalculated:%d\n", nnue1, nnue2);
             rootpos->print();
         }
     }
@@ -219,13 +238,185 @@ long long engine::perft(int depth, bool dotests)
     {
         if (rootpos->playMove(&movelist.move[i]))
         {
-            retval += perft(depth - 1, dotests);
+            retval += perftWithTests(rootpos, depth - 1);
             rootpos->unplayMove(&movelist.move[i]);
         }
     }
     return retval;
 }
 
+
+// Perft hash shared by all threads; key and node count are stored xor'ed like in the TT to detect torn entries
+#define PERFTHASHSIZE (1 << 20)
+#define PERFTMAXSPLIT 3
+
+struct perfthashentry
+{
+    U64 hashcheck;
+    U64 nodes;
+};
+
+static perfthashentry *perfthash = nullptr;
+
+static U64 perftKey(chessposition *pos, int depth)
+{
+    return pos->hash ^ (depth * 0x9e3779b97f4a7c15ULL) ^ (en.chess960 ? 0xd1b54a32d192ed03ULL : 0ULL);
+}
+
+static bool perftProbe(U64 key, U64 *nodes)
+{
+    perfthashentry *e = &perfthash[key & (PERFTHASHSIZE - 1)];
+    U64 n = e->nodes;
+    if ((e->hashcheck ^ n) != key)
+        return false;
+    *nodes = n;
+    return true;
+}
+
+static void perftStore(U64 key, U64 nodes)
+{
+    perfthashentry *e = &perfthash[key & (PERFTHASHSIZE - 1)];
+    e->nodes = nodes;
+    e->hashcheck = key ^ nodes;
+}
+
+// Perft with bulk counting of the legal moves at depth 1; the last ply is never played
+static U64 perftHashed(chessposition *pos, int depth)
+{
+    if (depth == 0)
+        return 1;
+
+    chessmovelist movelist;
+    if (pos->isCheckbb)
+        movelist.length = CreateEvasionMovelist(pos, &movelist.move[0]);
+    else
+        movelist.length = CreateMovelist<ALL>(pos, &movelist.move[0]);
+
+    U64 nodes = 0;
+    if (depth == 1)
+    {
+#ifdef LEGALMOVEGEN
+        nodes = movelist.length;
+#else
+        for (int i = 0; i < movelist.length; i++)
+            nodes += pos->moveIsLegal(movelist.move[i].code);
+#endif
+        return nodes;
+    }
+
+    U64 key = perftKey(pos, depth);
+    if (perftProbe(key, &nodes))
+        return nodes;
+
+    pos->prepareStack();
+    for (int i = 0; i < movelist.length; i++)
+    {
+        if (pos->playMove(&movelist.move[i]))
+        {
+            nodes += perftHashed(pos, depth - 1);
+            pos->unplayMove(&movelist.move[i]);
+        }
+    }
+    perftStore(key, nodes);
+    return nodes;
+}
+
+// Subtrees below the root that are distributed to the threads
+struct perftitem
+{
+    chessmove move[PERFTMAXSPLIT];
+};
+
+static vector<perftitem> perftitems;
+static int perftsplitdepth;
+static int perftsubdepth;
+static atomic<int> perftnextitem;
+static atomic<U64> perftnodes;
+
+static void perftPlayItem(chessposition *pos, perftitem *item)
+{
+    for (int j = 0; j < perftsplitdepth; j++)
+    {
+        pos->prepareStack();
+        pos->playMove(&item->move[j]);
+    }
+}
+
+static void perftUnplayItem(chessposition *pos, perftitem *item)
+{
+    for (int j = perftsplitdepth - 1; j >= 0; j--)
+        pos->unplayMove(&item->move[j]);
+}
+
+static void perftThread(searchthread *thr)
+{
+    chessposition *pos = &thr->pos;
+    U64 nodes = 0;
+    int i;
+    while ((i = perftnextitem++) < (int)perftitems.size())
+    {
+        perftPlayItem(pos, &perftitems[i]);
+        nodes += perftHashed(pos, perftsubdepth);
+        perftUnplayItem(pos, &perftitems[i]);
+    }
+    perftnodes += nodes;
+}
+
+long long engine::perft(int depth, bool dotests)
+{
+    chessposition *rootpos = &sthread[0].pos;
+
+    if (dotests)
+        return perftWithTests(rootpos, depth);
+
+    // the perft hash only lives during this perft
+    perfthash = (perfthashentry*)allocalign64(PERFTHASHSIZE * sizeof(perfthashentry));
+    if (!perfthash)
+        return 0;
+    memset((void*)perfthash, 0, PERFTHASHSIZE * sizeof(perfthashentry));
+
+    // Split the tree near the root until there are enough subtrees for all threads
+    perftitems.assign(1, perftitem());
+    perftsplitdepth = 0;
+    while (Threads > 1 && (int)perftitems.size() < 16 * Threads && perftsplitdepth < min(PERFTMAXSPLIT, depth - 2))
+    {
+        vector<perftitem> children;
+        for (size_t i = 0; i < perftitems.size(); i++)
+        {
+            perftPlayItem(rootpos, &perftitems[i]);
+            chessmovelist movelist;
+            if (rootpos->isCheckbb)
+                movelist.length = CreateEvasionMovelist(rootpos, &movelist.move[0]);
+            else
+                movelist.length = CreateMovelist<ALL>(rootpos, &movelist.move[0]);
+            for (int j = 0; j < movelist.length; j++)
+            {
+                if (rootpos->moveIsLegal(movelist.move[j].code))
+                {
+                    children.push_back(perftitems[i]);
+                    children.back().move[perftsplitdepth] = movelist.move[j];
+                }
+            }
+            perftUnplayItem(rootpos, &perftitems[i]);
+        }
+        perftitems.swap(children);
+        perftsplitdepth++;
+    }
+    perftsubdepth = depth - perftsplitdepth;
+
+    for (int i = 1; i < Threads; i++)
+        sthread[i].pos.copyFrom(rootpos);
+    perftnextitem = 0;
+    perftnodes = 0;
+    startThreads(perftThread);
+    waitThreads();
+
+    freealigned64(perfthash);
+    perfthash = nullptr;
+
+    return perftnodes;
+}
+
 static void perftest(bool dotests, int maxdepth)
 {
     struct perftestresultstruct
@@ -354,6 +545,106 @@ struct benchmarkstruct
     int solved;
 };
 
+static benchmarkstruct benchpositions[] =
+{
+    {   
+        "Startposition",
+        "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+        14,
+        0,
+        0, 0, 0, 0, "", 0
+    },
+    {
+        "Lasker Test",
+        "8/k7/3p4/p2P1p2/P2P1P2/8/8/K7 w - - 0 1",
+        28,
+        0,
+        0, 0, 0, 0, "", 0
+    },
+    {
+        "IQ4 63",
+        "2R5/r3b1k1/p2p4/P1pPp2p/6q1/2P2N1r/4Q1P1/5RK1 w - - 0 1 ",
+        14,
+        300,
+        0, 0, 0, 0, "", 0
+    },
+    {
+        "Wacnew 167",
+        "7Q/ppp2q2/3p2k1/P2Ppr1N/1PP5/7R/5rP1/6K1 b - - 0 1",
+        14,
+        1000,
+        0, 0, 0, 0, "", 0
+    },
+    { 
+        "Wacnew 212",
+        "rn1qr2Q/pbppk1p1/1p2pb2/4N3/3P4/2N5/PPP3PP/R4RK1 w - - 0 1",
+        14,
+        500,
+        0, 0, 0, 0, "", 0
+    },
+    {
+        "Carlos 6",
+        "rn1q1r2/1bp1bpk1/p3p2p/1p2N1pn/3P4/1BN1P1B1/PPQ2PPP/2R2RK1 w - - 0 1",
+        13,
+        300,
+        0, 0, 0, 0, "", 0
+    },
+     
+    {
+        "Arasan19 83",
+        "6k1/p4qp1/1p3r1p/2pPp1p1/1PP1PnP1/2P1KR1P/1B6/7Q b - - 0 1 ",
+        14,
+        200,
+        0, 0, 0, 0, "", 0
+    },
+    {
+        "Arasan19 192",
+        "r2qk2r/1b1nbp1p/p1n1p1p1/1pp1P3/6Q1/2NPB1PN/PPP3BP/R4RK1 w kq - 0 1",
+        13,
+        150,
+        0, 0, 0, 0, "", 0
+    },
+    {
+        "BT2630 12",
+        "8/pp3k2/2p1qp2/2P5/5P2/1R2p1rp/PP2R3/4K2Q b - - 0 1",
+        15,
+        300,
+        0, 0, 0, 0, "", 0
+    },
+    {
+        "IQ4 116",
+        "4r1k1/1p2qrpb/p1p4p/2Pp1p2/1Q1Rn3/PNN1P1P1/1P3PP1/3R2K1 b - - 0 1",
+        14,
+        300,
+        0, 0, 0, 0, "", 0
+    },
+    {
+        "Arasan12 114",
+        "br4k1/1qrnbppp/pp1ppn2/8/NPPBP3/PN3P2/5QPP/2RR1B1K w - - 0 1",
+        15,
+        150,
+        0, 0, 0, 0, "", 0
+    },
+    {
+        "Arasan12 140",
+        "r1b1rk2/p1pq2p1/1p1b1p1p/n2P4/2P1NP2/P2B1R2/1BQ3PP/R6K w - - 0 1",
+        15,
+        300,
+        0, 0, 0, 0, "", 0
+    },
+    {
+        "Arasan12 137",
+        "r4k2/1b3ppp/p2n1P2/q1p3PQ/Np1rp3/1P1B4/P1P4P/2K1R2R w - - 0 1",
+        14,
+        200,
+        0, 0, 0, 0, "", 0
+    },
+    {
+        "", "", 0, 0,
+        0, 0, 0, 0, "", 0
+    }
+};
+
 const string solvedstr[] = { "-", "+", "o" };
 
 
@@ -378,360 +669,1470 @@ static void benchTableFooder(FILE *out, long long totaltime, long long totalnode
         totalsolved[1], totaltests, fSolved, ((float)totaltime / (float)en.frequency), totalnodes, 10, totalnodes * en.frequency / totaltime);
 }
 
-static void doBenchmark(int constdepth, string epdfilename, int consttime, int startnum, bool openbench)
+// Searches a single bench position and stores the search result
+static void benchSearch(benchmarkstruct *bm, int constdepth, int consttime)
+{
+    en.communicate("ucinewgame");
+    en.communicate("position fen " + bm->fen);
+    long long starttime = getTime();
+    int dp = 0;
+    int tm = consttime;
+    if (constdepth)
+        dp = constdepth;
+    else
+        dp = bm->depth;
+    if (bm->terminationscore)
+        en.terminationscore = bm->terminationscore;
+    else
+        en.terminationscore = SHRT_MAX;
+    if (tm)
+        en.communicate("go movetime " + to_string(tm * 1000));
+    else if (dp)
+        en.communicate("go depth " + to_string(dp));
+    else
+        en.communicate("go infinite");
+
+    bm->time = getTime() - starttime;
+    bm->nodes = en.getTotalNodes();
+    bm->score = en.rootposition.lastbestmovescore;
+    bm->depthAtExit = en.benchdepth;
+    bm->move = en.benchmove;
+}
+
+// Summary of several bench runs for a single position (index >= 0) or the total of all positions (index < 0)
+struct benchsummary
 {
-    benchmarkstruct benchmark[] =
+    long long signature;    // nodes of the first run; identical in all runs if the search is deterministic
+    bool stable;
+    double mean;            // nps
+    double stddev;
+    double ci;              // half width of the 95% confidence interval of the mean
+};
+
+static benchsummary benchSummarize(vector<vector<benchmarkstruct>> &results, int index)
+{
+    // two-sided 95% quantiles of Student's t-distribution for 1..30 degrees of freedom
+    const double tquantile[] = { 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+        2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+        2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042 };
+    benchsummary bs;
+    vector<double> nps;
+    int n = (int)results.size();
+    bs.stable = true;
+    for (int r = 0; r < n; r++)
     {
-        {   
-            "Startposition",
-            "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
-            14,
-            0,
-            0, 0, 0, 0, "", 0
-        },
+        long long nodes = 0;
+        long long time = 0;
+        for (int p = 0; p < (int)results[r].size(); p++)
         {
-            "Lasker Test",
-            "8/k7/3p4/p2P1p2/P2P1P2/8/8/K7 w - - 0 1",
-            28,
-            0,
-            0, 0, 0, 0, "", 0
-        },
+            if (index >= 0 && p != index)
+                continue;
+            nodes += results[r][p].nodes;
+            time += results[r][p].time;
+        }
+        if (r == 0)
+            bs.signature = nodes;
+        else if (nodes != bs.signature)
+            bs.stable = false;
+        nps.push_back(time ? (double)nodes * en.frequency / time : 0.0);
+    }
+
+    double sum = 0.0;
+    for (int r = 0; r < n; r++)
+        sum += nps[r];
+    bs.mean = sum / n;
+    double sqsum = 0.0;
+    for (int r = 0; r < n; r++)
+        sqsum += (nps[r] - bs.mean) * (nps[r] - bs.mean);
+    bs.stddev = (n > 1 ? sqrt(sqsum / (n - 1)) : 0.0);
+    bs.ci = (n > 1 ? (n <= 31 ? tquantile[n - 2] : 1.960) * bs.stddev / sqrt(n) : 0.0);
+
+    return bs;
+}
+
+static string jsonString(string s)
+{
+    string js = "\"";
+    for (size_t i = 0; i < s.size(); i++)
+    {
+        if (s[i] == '"' || s[i] == '\\')
+            js += '\\';
+        if ((unsigned char)s[i] >= ' ')
+            js += s[i];
+    }
+    return js + "\"";
+}
+
+// CSV field in quotes; quotes inside are doubled (RFC 4180)
+static string csvString(string s)
+{
+    string cs = "\"";
+    for (size_t i = 0; i < s.size(); i++)
+    {
+        if (s[i] == '"')
+            cs += '"';
+        if ((unsigned char)s[i] >= ' ')
+            cs += s[i];
+    }
+    return cs + "\"";
+}
+
+static string benchMove(benchmarkstruct *bm)
+{
+    size_t len = bm->move.find_last_not_of(' ');
+    return (len == string::npos ? "" : bm->move.substr(0, len + 1));
+}
+
+static void benchJson(FILE *out, vector<vector<benchmarkstruct>> &results, int startnum, int warmup)
+{
+    int runs = (int)results.size();
+    int positions = (int)results[0].size();
+    fprintf(out, "{\n");
+    fprintf(out, "  \"engine\": %s,\n  \"build\": %s,\n  \"system\": %s,\n", jsonString(en.name).c_str(), jsonString(BUILD).c_str(), jsonString(GetSystemInfo()).c_str());
+    fprintf(out, "  \"threads\": %d,\n  \"hash\": %d,\n  \"runs\": %d,\n  \"warmup\": %d,\n", en.Threads, en.Hash, runs, warmup);
+    fprintf(out, "  \"positions\": [\n");
+    for (int p = 0; p < positions; p++)
+    {
+        benchmarkstruct *bm = &results[0][p];
+        benchsummary bs = benchSummarize(results, p);
+        fprintf(out, "    {\n      \"index\": %d,\n      \"name\": %s,\n      \"fen\": %s,\n", startnum + p, jsonString(bm->name).c_str(), jsonString(bm->fen).c_str());
+        fprintf(out, "      \"signature\": %lld,\n      \"stable\": %s,\n", bs.signature, bs.stable ? "true" : "false");
+        fprintf(out, "      \"nps\": { \"mean\": %.0f, \"stddev\": %.0f, \"ci95\": [%.0f, %.0f] },\n", bs.mean, bs.stddev, bs.mean - bs.ci, bs.mean + bs.ci);
+        fprintf(out, "      \"results\": [\n");
+        for (int r = 0; r < runs; r++)
         {
-            "IQ4 63",
-            "2R5/r3b1k1/p2p4/P1pPp2p/6q1/2P2N1r/4Q1P1/5RK1 w - - 0 1 ",
-            14,
-            300,
-            0, 0, 0, 0, "", 0
-        },
+            bm = &results[r][p];
+            fprintf(out, "        { \"run\": %d, \"nodes\": %lld, \"time_ms\": %.3f, \"nps\": %lld, \"depth\": %d, \"bestmove\": %s, \"score\": %d }%s\n",
+                r + 1, bm->nodes, bm->time * 1000.0 / en.frequency, bm->time ? bm->nodes * en.frequency / bm->time : 0, bm->depthAtExit,
+                jsonString(benchMove(bm)).c_str(), bm->score, r < runs - 1 ? "," : "");
+        }
+        fprintf(out, "      ]\n    }%s\n", p < positions - 1 ? "," : "");
+    }
+    fprintf(out, "  ],\n");
+
+    benchsummary bs = benchSummarize(results, -1);
+    fprintf(out, "  \"total\": {\n");
+    fprintf(out, "    \"signature\": %lld,\n    \"stable\": %s,\n", bs.signature, bs.stable ? "true" : "false");
+    fprintf(out, "    \"nps\": { \"mean\": %.0f, \"stddev\": %.0f, \"ci95\": [%.0f, %.0f] },\n", bs.mean, bs.stddev, bs.mean - bs.ci, bs.mean + bs.ci);
+    fprintf(out, "    \"results\": [\n");
+    for (int r = 0; r < runs; r++)
+    {
+        long long nodes = 0, time = 0;
+        for (int p = 0; p < positions; p++)
         {
-            "Wacnew 167",
-            "7Q/ppp2q2/3p2k1/P2Ppr1N/1PP5/7R/5rP1/6K1 b - - 0 1",
-            14,
-            1000,
-            0, 0, 0, 0, "", 0
-        },
-        { 
-            "Wacnew 212",
-            "rn1qr2Q/pbppk1p1/1p2pb2/4N3/3P4/2N5/PPP3PP/R4RK1 w - - 0 1",
-            14,
-            500,
-            0, 0, 0, 0, "", 0
-        },
+            nodes += results[r][p].nodes;
+            time += results[r][p].time;
+        }
+        fprintf(out, "      { \"run\": %d, \"nodes\": %lld, \"time_ms\": %.3f, \"nps\": %lld }%s\n",
+            r + 1, nodes, time * 1000.0 / en.frequency, time ? nodes * en.frequency / time : 0, r < runs - 1 ? "," : "");
+    }
+    fprintf(out, "    ]\n  }\n}\n");
+}
+
+static void benchCsv(FILE *out, vector<vector<benchmarkstruct>> &results, int startnum)
+{
+    int runs = (int)results.size();
+    int positions = (int)results[0].size();
+    // one header for all records; 'run' records are single searches, 'position' and 'total' records summarize all runs
+    fprintf(out, "record,run,index,name,fen,nodes,time_ms,nps,depth,bestmove,score,signature,stable,nps_mean,nps_stddev,nps_ci95_low,nps_ci95_high\n");
+    for (int p = 0; p < positions; p++)
+    {
+        for (int r = 0; r < runs; r++)
         {
-            "Carlos 6",
-            "rn1q1r2/1bp1bpk1/p3p2p/1p2N1pn/3P4/1BN1P1B1/PPQ2PPP/2R2RK1 w - - 0 1",
-            13,
-            300,
-            0, 0, 0, 0, "", 0
-        },
-         
+            benchmarkstruct *bm = &results[r][p];
+            fprintf(out, "run,%d,%d,%s,%s,%lld,%.3f,%lld,%d,%s,%d,,,,,,\n", r + 1, startnum + p, csvString(bm->name).c_str(), csvString(bm->fen).c_str(), bm->nodes,
+                bm->time * 1000.0 / en.frequency, bm->time ? bm->nodes * en.frequency / bm->time : 0, bm->depthAtExit, benchMove(bm).c_str(), bm->score);
+        }
+        benchsummary bs = benchSummarize(results, p);
+        fprintf(out, "position,,%d,%s,%s,,,,,,,%lld,%d,%.0f,%.0f,%.0f,%.0f\n", startnum + p, csvString(results[0][p].name).c_str(), csvString(results[0][p].fen).c_str(),
+            bs.signature, bs.stable, bs.mean, bs.stddev, bs.mean - bs.ci, bs.mean + bs.ci);
+    }
+    for (int r = 0; r < runs; r++)
+    {
+        long long nodes = 0, time = 0;
+        for (int p = 0; p < positions; p++)
         {
-            "Arasan19 83",
-            "6k1/p4qp1/1p3r1p/2pPp1p1/1PP1PnP1/2P1KR1P/1B6/7Q b - - 0 1 ",
-            14,
-            200,
-            0, 0, 0, 0, "", 0
-        },
+            nodes += results[r][p].nodes;
+            time += results[r][p].time;
+        }
+        fprintf(out, "total,%d,,,,%lld,%.3f,%lld,,,,,,,,,\n", r + 1, nodes, time * 1000.0 / en.frequency, time ? nodes * en.frequency / time : 0);
+    }
+    benchsummary bs = benchSummarize(results, -1);
+    fprintf(out, "total,,,,,,,,,,,%lld,%d,%.0f,%.0f,%.0f,%.0f\n", bs.signature, bs.stable, bs.mean, bs.stddev, bs.mean - bs.ci, bs.mean + bs.ci);
+}
+
+static void doBenchmark(int constdepth, string epdfilename, int consttime, int startnum, bool openbench, int runs, int warmup, string format, string outfilename)
+{
+    if (format != "text" && format != "json" && format != "csv")
+    {
+        printf("Unknown benchmark format %s; use text, json or csv.\n", format.c_str());
+        return;
+    }
+
+    vector<vector<benchmarkstruct>> results(runs);
+
+    ifstream epdfile;
+    bool bGetFromEpd = false;
+    if (epdfilename != "")
+    {
+        epdfile.open(epdfilename, ifstream::in);
+        bGetFromEpd = epdfile.is_open();
+        if (!bGetFromEpd)
+            printf("Cannot open file %s for reading.\n", epdfilename.c_str());
+    }
+
+    int i;
+    benchmarkstruct epdbm;
+    FILE *tableout = openbench ? stdout : stderr;
+    size_t totalCopyBytes = 0;
+    int totalSearches = 0;
+    bool textformat = (format == "text");
+
+    // negative runs are warmup runs and not measured
+    for (int run = -warmup; run < runs; run++)
+    {
+        if (bGetFromEpd)
         {
-            "Arasan19 192",
-            "r2qk2r/1b1nbp1p/p1n1p1p1/1pp1P3/6Q1/2NPB1PN/PPP3BP/R4RK1 w kq - 0 1",
-            13,
-            150,
-            0, 0, 0, 0, "", 0
-        },
+            epdfile.clear();
+            epdfile.seekg(0);
+        }
+        i = 0;
+        while (true)
         {
-            "BT2630 12",
-            "8/pp3k2/2p1qp2/2P5/5P2/1R2p1rp/PP2R3/4K2Q b - - 0 1",
-            15,
-            300,
-            0, 0, 0, 0, "", 0
-        },
+            string avoidmoves = "";
+            string bestmoves = "";
+            benchmarkstruct *bm;
+            if (!bGetFromEpd)
+            {
+                // standard bench with included positions
+                bm = &benchpositions[i];
+            }
+            else
+            {
+                // read positions from epd file
+                bm = &epdbm;
+                string line;
+                getline(epdfile, line);
+                getFenAndBmFromEpd(line, &bm->fen, &bestmoves, &avoidmoves);
+
+                bm->depth = 10;  // default depth for epd bench
+                bm->terminationscore = 0;
+            }
+            if (bm->fen == "") break;
+
+            if (++i < startnum) continue;
+
+            benchSearch(bm, constdepth, consttime);
+            if (run < 0)
+                continue;
+
+            bm->solved = 2;
+            totalCopyBytes += en.threadCopyBytes;
+            totalSearches++;
+
+            if (bestmoves != "")
+                bm->solved = (bestmoves.find(bm->move) != string::npos) ? 1 : 0;
+            if (avoidmoves != "")
+                bm->solved = (bestmoves.find(bm->move) != string::npos) ? 0 : 1;
+
+            if (bGetFromEpd && textformat)
+                benchTableItem(tableout, i, bm);
+
+            results[run].push_back(*bm);
+        }
+    }
+
+    en.terminationscore = SHRT_MAX;
+    if (!totalSearches)
+        return;
+
+    if (!textformat)
+    {
+        FILE *out = stderr;
+        if (outfilename != "" && !(out = fopen(outfilename.c_str(), "w")))
         {
-            "IQ4 116",
-            "4r1k1/1p2qrpb/p1p4p/2Pp1p2/1Q1Rn3/PNN1P1P1/1P3PP1/3R2K1 b - - 0 1",
-            14,
-            300,
-            0, 0, 0, 0, "", 0
-        },
+            printf("Cannot open file %s for writing.\n", outfilename.c_str());
+            return;
+        }
+        if (format == "json")
+            benchJson(out, results, startnum, warmup);
+        else
+            benchCsv(out, results, startnum);
+        if (out != stderr)
+            fclose(out);
+        return;
+    }
+
+    long long totaltime = 0;
+    long long totalnodes = 0;
+    benchTableHeader(tableout);
+
+    for (int run = 0; run < runs; run++)
+    {
+        long long runtime = 0;
+        long long runnodes = 0;
+        int totalSolved[2] = { 0 };
+        i = startnum - 1;
+        for (vector<benchmarkstruct>::iterator bm = results[run].begin(); bm != results[run].end(); bm++)
         {
-            "Arasan12 114",
-            "br4k1/1qrnbppp/pp1ppn2/8/NPPBP3/PN3P2/5QPP/2RR1B1K w - - 0 1",
-            15,
-            150,
-            0, 0, 0, 0, "", 0
-        },
+            runtime += bm->time;
+            runnodes += bm->nodes;
+            if (bm->solved < 2)
+                totalSolved[bm->solved]++;
+            benchTableItem(tableout, ++i, &*bm);
+        }
+        if (runtime)
+            benchTableFooder(tableout, runtime, runnodes, totalSolved);
+        totaltime += runtime;
+        totalnodes += runnodes;
+    }
+    if (totaltime)
+    {
+        if (runs > 1)
         {
-            "Arasan12 140",
-            "r1b1rk2/p1pq2p1/1p1b1p1p/n2P4/2P1NP2/P2B1R2/1BQ3PP/R6K w - - 0 1",
-            15,
-            300,
-            0, 0, 0, 0, "", 0
-        },
+            benchsummary total = benchSummarize(results, -1);
+            fprintf(tableout, "NPS over %d runs: mean %.0f  stddev %.0f (%.2f%%)  95%% CI %.0f - %.0f (+-%.2f%%)  signature %lld%s\n",
+                runs, total.mean, total.stddev, 100.0 * total.stddev / total.mean, total.mean - total.ci, total.mean + total.ci, 100.0 * total.ci / total.mean,
+                total.signature, total.stable ? "" : " (unstable)");
+        }
+        fprintf(tableout, "Position copied to each thread: %llu bytes avg. (position %llu bytes, ply buffers %llu bytes)\n",
+            (unsigned long long)(totalCopyBytes / totalSearches), (unsigned long long)sizeof(chessposition), (unsigned long long)sizeof(plybuffers));
+        if (openbench)
+            printf("Time  : %lld\nNodes : %lld\nNPS   : %lld\n", totaltime * 1000 / en.frequency, totalnodes, totalnodes * en.frequency / totaltime);
+    }
+}
+
+
+
+// Lazy SMP scaling: searches the bench positions with 1, 2, 4, ... maxthreads threads and compares
+// nps, time to depth and best move with the single thread search
+static void doScalingTest(int maxthreads, int constdepth)
+{
+    struct scalingresult {
+        int threads;
+        long long time;
+        long long nodes;
+        double ttdspeedup;      // geometric mean of the per position time to depth speedup
+        int bmmatch;            // positions with same best move as the single thread search
+    };
+    list<scalingresult> results;
+    vector<benchmarkstruct> single;
+    int positions = 0;
+    while (benchpositions[positions].fen != "")
+        positions++;
+
+    for (int threads = 1; threads <= maxthreads; threads = (threads < maxthreads && threads * 2 > maxthreads ? maxthreads : threads * 2))
+    {
+        en.ucioptions.Set("Threads", to_string(threads));
+        scalingresult sr = { threads, 0, 0, 0.0, 0 };
+        double logspeedup = 0.0;
+        for (int i = 0; i < positions; i++)
         {
-            "Arasan12 137",
-            "r4k2/1b3ppp/p2n1P2/q1p3PQ/Np1rp3/1P1B4/P1P4P/2K1R2R w - - 0 1",
-            14,
-            200,
-            0, 0, 0, 0, "", 0
-        },
+            benchmarkstruct bm = benchpositions[i];
+            benchSearch(&bm, constdepth, 0);
+            if (threads == 1)
+                single.push_back(bm);
+            sr.time += bm.time;
+            sr.nodes += bm.nodes;
+            logspeedup += log((double)single[i].time / max(1LL, bm.time));
+            sr.bmmatch += (bm.move == single[i].move);
+        }
+        sr.ttdspeedup = exp(logspeedup / positions);
+        results.push_back(sr);
+    }
+    en.terminationscore = SHRT_MAX;
+
+    scalingresult *base = &results.front();
+    double basenps = (double)base->nodes * en.frequency / max(1LL, base->time);
+    printf("\n\nSMP scaling test for %s (Build %s):\n", en.name, BUILD);
+    printf("System: %s\n", GetSystemInfo().c_str());
+    printf("%d bench positions, %s\n", positions, constdepth ? ("depth " + to_string(constdepth)).c_str() : "default depth per position");
+    printf("=====================================================================================\n");
+    printf("Threads      time (s)        nodes          nps   nps speedup   ttd speedup   bm match\n");
+    for (list<scalingresult>::iterator sr = results.begin(); sr != results.end(); sr++)
+    {
+        double nps = (double)sr->nodes * en.frequency / max(1LL, sr->time);
+        printf("%7d   %11.3f   %10lld   %10.0f   %11.2f   %11.2f   %3d/%3d\n", sr->threads, (double)sr->time / en.frequency, sr->nodes, nps,
+            nps / basenps, sr->ttdspeedup, sr->bmmatch, positions);
+    }
+    printf("=====================================================================================\n");
+}
+
+
+// Compares the handcrafted evaluation with NNUE: cost of play/unplay and evaluation per node and nps of the bench search
+static void doEvalBenchmark(int constdepth)
+{
+    const int iterations = 200;
+    struct evalbenchresult {
+        const char *name;
+        double playns;
+        double evalns;
+        long long nodes;
+        long long time;
+    };
+    vector<evalbenchresult> results;
+    bool withNnue = NnueReady;
+    volatile int evalsum = 0;
+    chessposition *pos = &en.sthread[0].pos;
+    int positions = 0;
+    while (benchpositions[positions].fen != "")
+        positions++;
+
+    for (int mode = 0; mode < (withNnue ? 2 : 1); mode++)
+    {
+        en.ucioptions.Set("Use NNUE", mode ? "true" : "false");
+        evalbenchresult r = { mode ? "NNUE" : "handcrafted", 0.0, 0.0, 0, 0 };
+        long long playtime = 0, evaltime = 0, n = 0;
+        for (int i = 0; i < positions; i++)
+        {
+            // play every move of the bench position; once without and once with evaluation of the child
+            pos->getFromFen(benchpositions[i].fen.c_str());
+            chessmovelist movelist;
+            movelist.length = (pos->isCheckbb ? CreateEvasionMovelist(pos, &movelist.move[0]) : CreateMovelist<ALL>(pos, &movelist.move[0]));
+            pos->prepareStack();
+            evalsum += pos->getEval<NOTRACE>();  // initialize the accumulators
+            long long t0 = getTime();
+            for (int k = 0; k < iterations; k++)
+                for (int j = 0; j < movelist.length; j++)
+                    if (pos->playMove(&movelist.move[j]))
+                    {
+                        pos->unplayMove(&movelist.move[j]);
+                        n++;
+                    }
+            long long t1 = getTime();
+            for (int k = 0; k < iterations; k++)
+                for (int j = 0; j < movelist.length; j++)
+                    if (pos->playMove(&movelist.move[j]))
+                    {
+                        evalsum += pos->getEval<NOTRACE>();
+                        pos->unplayMove(&movelist.move[j]);
+                    }
+            long long t2 = getTime();
+            playtime += t1 - t0;
+            evaltime += t2 - t1 - (t1 - t0);
+        }
+        r.playns = 1e9 * playtime / en.frequency / n;
+        r.evalns = 1e9 * evaltime / en.frequency / n;
+
+        for (int i = 0; i < positions; i++)
+        {
+            benchmarkstruct bm = benchpositions[i];
+            benchSearch(&bm, constdepth, 0);
+            r.nodes += bm.nodes;
+            r.time += bm.time;
+        }
+        results.push_back(r);
+    }
+    en.terminationscore = SHRT_MAX;
+
+    printf("\n\nEvaluation benchmark for %s (Build %s):\n", en.name, BUILD);
+    printf("System: %s\n", GetSystemInfo().c_str());
+    if (!withNnue)
+        printf("No NNUE network loaded (use -option NNUENetpath <file> -option \"Use NNUE\" true)\n");
+    printf("=====================================================================\n");
+    printf("Evaluation     play/unplay (ns)   eval (ns)        nodes          nps\n");
+    for (size_t i = 0; i < results.size(); i++)
+        printf("%-12s   %16.1f   %9.1f   %10lld   %10lld\n", results[i].name, results[i].playns, results[i].evalns,
+            results[i].nodes, results[i].nodes * en.frequency / max(1LL, results[i].time));
+    printf("=====================================================================\n");
+}
+
+
+// Compares the lazy evaluation with the full evaluation for several margins
+// A lazy exit is wrong if the full evaluation lands on the other side of the window bound
+static void doLazyEvalTest(string margins, int constdepth)
+{
+    struct lazyevalresult {
+        int margin;
+        long long evals;
+        long long lazy;
+        long long wrong;
+        long long errorsum;
+        int errormax;
+        long long nodes;
+        long long time;
+    };
+    vector<lazyevalresult> results;
+    bool withNnue = NnueReady;
+    if (withNnue)
+        en.ucioptions.Set("Use NNUE", "false");
+    int oldmargin = en.lazyEvalMargin;
+    chessposition *pos = &en.sthread[0].pos;
+
+    // test positions are the bench positions and all their children
+    vector<string> fens;
+    for (int i = 0; benchpositions[i].fen != ""; i++)
+    {
+        pos->getFromFen(benchpositions[i].fen.c_str());
+        fens.push_back(benchpositions[i].fen);
+        chessmovelist movelist;
+        movelist.length = (pos->isCheckbb ? CreateEvasionMovelist(pos, &movelist.move[0]) : CreateMovelist<ALL>(pos, &movelist.move[0]));
+        pos->prepareStack();
+        for (int j = 0; j < movelist.length; j++)
+            if (pos->playMove(&movelist.move[j]))
+            {
+                if (!pos->isCheckbb)
+                    fens.push_back(pos->toFen());
+                pos->unplayMove(&movelist.move[j]);
+            }
+    }
+
+    for (char &c : margins)
+        if (c == '*') c = ' ';
+    vector<string> margintoken = SplitString(margins.c_str());
+    for (size_t m = 0; m < margintoken.size(); m++)
+    {
+        lazyevalresult r = { 0, 0, 0, 0, 0, 0, 0, 0 };
+        try { r.margin = stoi(margintoken[m]); }
+        catch (const invalid_argument&) { continue; }
+        en.ucioptions.Set("Lazy Eval Margin", to_string(r.margin));
+        for (size_t i = 0; i < fens.size(); i++)
+        {
+            pos->getFromFen(fens[i].c_str());
+            int s2m = S2MSIGN(pos->state & S2MMASK);
+            int fulleval = s2m * pos->getEval<NOTRACE>();
+            // null windows around the full evaluation as they appear in the qsearch
+            for (int d = -800; d <= 800; d += 25)
+            {
+                int alpha = fulleval + d;
+                int beta = alpha + 1;
+                int lazyeval = s2m * pos->getEval<NOTRACE>(alpha, beta);
+                r.evals++;
+                if (!pos->lazyeval)
+                    continue;
+                r.lazy++;
+                if ((lazyeval >= beta) != (fulleval >= beta) || (lazyeval <= alpha) != (fulleval <= alpha))
+                    r.wrong++;
+                int error = abs(lazyeval - fulleval);
+                r.errorsum += error;
+                r.errormax = max(r.errormax, error);
+            }
+        }
+        for (int i = 0; benchpositions[i].fen != ""; i++)
+        {
+            benchmarkstruct bm = benchpositions[i];
+            benchSearch(&bm, constdepth, 0);
+            r.nodes += bm.nodes;
+            r.time += bm.time;
+        }
+        results.push_back(r);
+    }
+    en.ucioptions.Set("Lazy Eval Margin", to_string(oldmargin));
+    if (withNnue)
+        en.ucioptions.Set("Use NNUE", "true");
+    en.terminationscore = SHRT_MAX;
+
+    printf("\n\nLazy evaluation test for %s (Build %s):\n", en.name, BUILD);
+    printf("%d positions, null windows from -800 to +800 around the full evaluation\n", (int)fens.size());
+    printf("==============================================================================\n");
+    printf("Margin   %%lazy exits   %%wrong side   avg. error   max. error       nodes          nps\n");
+    for (size_t i = 0; i < results.size(); i++)
+        printf("%6d   %11.2f   %11.4f   %10.1f   %10d   %9lld   %10lld\n", results[i].margin,
+            100.0 * results[i].lazy / max(1LL, results[i].evals),
+            100.0 * results[i].wrong / max(1LL, results[i].lazy),
+            results[i].errorsum / (double)max(1LL, results[i].lazy), results[i].errormax,
+            results[i].nodes, results[i].nodes * en.frequency / max(1LL, results[i].time));
+    printf("==============================================================================\n");
+}
+
+
+// Compares the backends of the slider attack lookup by random lookups and perft of the start position
+// Lookup loop with the index scheme as compile time constant like in the hot code
+template <bool Pext> static U64 sliderLookups(vector<int> &squares, vector<U64> &occs, int iterations)
+{
+    U64 sum = 0;
+    for (int k = 0; k < iterations; k++)
+        for (size_t i = 0; i < squares.size(); i++)
+            sum ^= MAGICBISHOPATTACKS(Pext, occs[i], squares[i]) ^ MAGICROOKATTACKS(Pext, occs[i], squares[i]);
+    return sum;
+}
+
+static void doSliderBenchmark(int depth)
+{
+    const int lookups = 1 << 16;
+    const int iterations = 100;
+    struct sliderbenchresult {
+        const char *name;
+        double inittime;
+        double lookupns;
+        U64 perftnodes;
+        double perfttime;
+    };
+    vector<sliderbenchresult> results;
+    bool withPext = usePext;
+    depth = (depth ? depth : 5);
+
+    // random squares with sparse random occupancy
+    vector<int> squares(lookups);
+    vector<U64> occs(lookups);
+    for (int i = 0; i < lookups; i++)
+    {
+        squares[i] = (int)(zb.getRnd() & 63);
+        occs[i] = zb.getRnd() & zb.getRnd();
+    }
+
+    for (int backend = 0; backend < (cpuHasFastPext() ? 2 : 1); backend++)
+    {
+        sliderbenchresult r = { backend ? "PEXT" : "fancy magic", 0.0, 0.0, 0, 0.0 };
+        long long t0 = getTime();
+        initSliderAttacks(backend == 1);
+        long long t1 = getTime();
+        r.inittime = (t1 - t0) * 1000.0 / en.frequency;
+
+        volatile U64 attacksum = 0;
+        t0 = getTime();
+        U64 sum = (backend ? sliderLookups<true>(squares, occs, iterations) : sliderLookups<false>(squares, occs, iterations));
+        t1 = getTime();
+        attacksum = sum;
+        (void)attacksum;
+        r.lookupns = 1e9 * (t1 - t0) / en.frequency / iterations / lookups / 2;
+
+        en.sthread[0].pos.getFromFen(STARTFEN);
+        t0 = getTime();
+        r.perftnodes = en.perft(depth, false);
+        t1 = getTime();
+        r.perfttime = (double)(t1 - t0) / en.frequency;
+        results.push_back(r);
+    }
+    initSliderAttacks(withPext);
+
+    printf("\n\nSlider attack benchmark for %s (Build %s):\n", en.name, BUILD);
+    printf("System: %s\n", GetSystemInfo().c_str());
+    printf("Attack table: %d KB shared by both backends; %s is used by default\n",
+        (int)(sizeof(mSliderAttacks) / 1024), withPext ? "PEXT" : "fancy magic");
+    printf("===========================================================================\n");
+    printf("Backend        init (ms)   lookup (ns)   perft %d nodes     perft nps\n", depth);
+    for (size_t i = 0; i < results.size(); i++)
+        printf("%-12s   %9.1f   %11.2f   %13lld   %11lld\n", results[i].name, results[i].inittime, results[i].lookupns,
+            (long long)results[i].perftnodes, (long long)(results[i].perfttime > 0.0 ? results[i].perftnodes / results[i].perfttime : 0));
+    printf("===========================================================================\n");
+}
+
+
+// Measures the latency from 'go' to the first info output and to bestmove for increasing number of threads
+static void doLatencyTest(int maxthreads)
+{
+    const int iterations = 50;
+    struct latencyresult {
+        int threads;
+        long long firstinfo;
+        long long firstinfomax;
+        long long bestmove;
+    };
+    list<latencyresult> results;
+
+    for (int threads = 1; threads <= maxthreads; threads = (threads < maxthreads && threads * 2 > maxthreads ? maxthreads : threads * 2))
+    {
+        en.ucioptions.Set("Threads", to_string(threads));
+        en.communicate("ucinewgame");
+        latencyresult lr = { threads, 0, 0, 0 };
+        for (int i = 0; i < iterations; i++)
+        {
+            en.communicate("position startpos");
+            long long starttime = getTime();
+            en.communicate("go depth 1");
+            long long endtime = getTime();
+            long long firstinfo = (en.firstinfotime ? (long long)en.firstinfotime : endtime) - starttime;
+            lr.firstinfo += firstinfo;
+            lr.firstinfomax = max(lr.firstinfomax, firstinfo);
+            lr.bestmove += endtime - starttime;
+        }
+        results.push_back(lr);
+    }
+
+    printf("\n\nLatency test for %s (Build %s):\n", en.name, BUILD);
+    printf("System: %s\n", GetSystemInfo().c_str());
+    printf("Average over %d searches of 'go depth 1' from startposition\n", iterations);
+    printf("===========================================================\n");
+    printf("Threads   go->info (avg)   go->info (max)   go->bestmove (avg)\n");
+    for (list<latencyresult>::iterator lr = results.begin(); lr != results.end(); lr++)
+        printf("%7d   %11.1f us   %11.1f us   %15.1f us\n", lr->threads,
+            lr->firstinfo * 1e6 / iterations / en.frequency,
+            lr->firstinfomax * 1e6 / en.frequency,
+            lr->bestmove * 1e6 / iterations / en.frequency);
+    printf("===========================================================\n");
+}
+
+
+// Compares the cost of the linear repetition scan with the cuckoo based cycle detection
+// for positions with increasing number of reversible moves on the stack
+static void doCycleBenchmark()
+{
+    const int calls = 1000000;
+    const int halfmoves[] = { 4, 10, 20, 40, 60, 80, 99 };
+    chessposition *pos = &en.rootposition;
+
+    printf("\n\nRepetition detection benchmark for %s (Build %s)\n", en.name, BUILD);
+    printf("System: %s\n", GetSystemInfo().c_str());
+    printf("===========================================================\n");
+    printf("Halfmoves   testRepetiton (result)   hasGameCycle (result)\n");
+    for (int h = 0; h < 7; h++)
+    {
+        en.communicate("position startpos");
+        U64 rnd = 0x9e3779b97f4a7c15ULL;
+        while (pos->halfmovescounter < halfmoves[h])
+        {
+            // play some random reversible move
+            chessmovelist ml;
+            ml.length = CreateMovelist<QUIET>(pos, &ml.move[0]);
+            int start = (int)((rnd = rnd * 6364136223846793005ULL + 1442695040888963407ULL) >> 33) % ml.length;
+            int i;
+            for (i = 0; i < ml.length; i++)
+            {
+                chessmove *m = &ml.move[(start + i) % ml.length];
+                if ((GETPIECE(m->code) >> 1) == PAWN || ISCASTLE(m->code) || pos->moveGivesCheck(m->code))
+                    continue;
+                if (pos->applyMove(m->toString()))
+                    break;
+            }
+            if (i == ml.length)
+                break;
+        }
+        pos->rootheight = 0;
+        U64 t0 = getTime();
+        for (int n = 0; n < calls; n++)
+            pos->testRepetiton();
+        U64 t1 = getTime();
+        for (int n = 0; n < calls; n++)
+            pos->hasGameCycle();
+        U64 t2 = getTime();
+        printf("%9d   %10.2f ns (%d)   %9.2f ns (%d)\n", pos->halfmovescounter,
+            (t1 - t0) * 1e9 / en.frequency / calls, pos->testRepetiton(),
+            (t2 - t1) * 1e9 / en.frequency / calls, (int)pos->hasGameCycle());
+    }
+    printf("===========================================================\n");
+}
+
+
+// Stress test for the lockless transposition table
+// Many threads write and probe a small table with keys from a common pool. The data of every entry
+// is derived from its key, so a verified entry with foreign data is an undetected torn entry or a
+// key collision. Entries with a matching check part but data of another key are counted as detected.
+struct ttstressresult {
+    U64 probes;
+    U64 hits;
+    U64 detected;
+    U64 undetected;
+};
+
+// Returns the value with the given index of the blank separated value list of a combo option
+static string comboValue(string varlist, int index)
+{
+    istringstream vars(varlist);
+    string var;
+    for (int i = 0; vars >> var && i < index; i++);
+    return var;
+}
+
+static const int ttStressPoolsize = 1 << 17;
+static U64 ttStressKeys[ttStressPoolsize];
+
+static U64 ttStressData(U64 key)
+{
+    // scramble the key so the data is not correlated with the hash check
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 31;
+    transpositionentry e;
+    e.movecode = (uint16_t)key;
+    e.value = (int16_t)((key >> 16) & 0x3fff);
+    e.staticeval = (int16_t)((key >> 30) & 0x3fff);
+    e.depth = (uint8_t)((key >> 44) & 0x3f);
+    e.boundAndAge = HASHEXACT | tp.numOfSearchShiftTwo;
+    U64 d;
+    memcpy(&d, &e, sizeof(d));
+    return d;
+}
+
+static void ttStressThread(int threadnum, U64 probes, ttstressresult *result)
+{
+    U64 rnd = 0x9e3779b97f4a7c15ULL * (threadnum + 1);
+    for (U64 n = 0; n < probes; n++)
+    {
+        rnd ^= rnd << 13; rnd ^= rnd >> 7; rnd ^= rnd << 17;
+        U64 key = ttStressKeys[rnd % ttStressPoolsize];
+        transpositionentry e;
+        U64 d = ttStressData(key);
+        memcpy(&e, &d, sizeof(e));
+        if (rnd & 0x100000)
+            tp.addHash(key, e.value, e.staticeval, HASHEXACT, e.depth, e.movecode);
+
+        int val, staticeval;
+        uint16_t movecode;
+        result->probes++;
+        if (tp.probeHash(key, &val, &staticeval, &movecode, 0, SCOREBLACKWINS, SCOREWHITEWINS, 0))
+        {
+            result->hits++;
+            if (val != e.value || staticeval != e.staticeval || movecode != e.movecode)
+                result->undetected++;
+        }
+        transpositioncluster *cluster = (transpositioncluster*)tp.getCluster(key);
+        for (int i = 0; i < transpositioncluster::buckets; i++)
         {
-            "", "", 0, 0,
-            0, 0, 0, 0, "", 0
+            U64 cd = cluster->data[i];
+            if (cluster->hashcheck[i] == (transpositioncluster::key(key) ^ transpositioncluster::fold(d)) && cd != d)
+                result->detected++;
         }
+    }
+}
+
+// Bench of some endgame positions with many transpositions; the TT, pawn hashes and thread data are allocated
+// starting with each page mode so modes that are not available fall back to the next one
+static void doPageBenchmark(int constdepth)
+{
+    const int ttheavy[] = { 1, 6, 8 };  // Lasker Test, Arasan19 83, BT2630 12
+    struct pageresult {
+        int mode;
+        int ttmode;
+        int threadmode;
+        long long time;
+        long long nodes;
     };
+    vector<pageresult> results;
 
-    long long starttime, endtime;
-    list<benchmarkstruct> bmlist;
+    for (int mode = PAGES1G; mode <= PAGESNORMAL; mode++)
+    {
+        en.pageMode = mode;
+        tp.setSize(en.Hash);
+        en.allocThreads();
+        pageresult pr = { mode, tp.pagemode, en.threadsPageMode, 0, 0 };
+        for (int i = 0; i < 3; i++)
+        {
+            benchmarkstruct bm = benchpositions[ttheavy[i]];
+            benchSearch(&bm, constdepth, 0);
+            pr.time += bm.time;
+            pr.nodes += bm.nodes;
+        }
+        results.push_back(pr);
+    }
+    en.terminationscore = SHRT_MAX;
+    en.ucioptions.Set("Huge Pages", en.hugePages ? "true" : "false", true);
+
+    printf("\n\nPage mode benchmark for %s (Build %s)\n", en.name, BUILD);
+    printf("System: %s\n", GetSystemInfo().c_str());
+    printf("Hash %d MB, %d threads, %s\n", en.Hash, en.Threads, constdepth ? ("depth " + to_string(constdepth)).c_str() : "default depth per position");
+    printf("=============================================================================================================\n");
+    printf("First tried page mode       TT got                      threads got                 time (s)        nps\n");
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        pageresult *pr = &results[i];
+        printf("%-26s  %-26s  %-26s  %8.3f  %9lld\n", pageModeName(pr->mode), pageModeName(pr->ttmode), pageModeName(pr->threadmode),
+            (double)pr->time / en.frequency, pr->time ? pr->nodes * en.frequency / pr->time : 0);
+    }
+    printf("=============================================================================================================\n");
+}
+
+
+static void doTTStressTest()
+{
+    const int threadnums[] = { 1, 8, 64 };
+    const U64 totalprobes = 8000000;
+    for (int i = 0; i < ttStressPoolsize; i++)
+        ttStressKeys[i] = zb.getRnd();
+
+    printf("\n\nTransposition table stress test for %s (Build %s)\n", en.name, BUILD);
+    printf("System: %s\n", GetSystemInfo().c_str());
+    printf("Table: 1 MB, %d keys, %llu probes per run\n", ttStressPoolsize, totalprobes);
+    printf("========================================================================\n");
+    printf("Threads      hits/M   detected torn/M   undetected torn or collision/M\n");
+    // the check for torn entries knows the default format only
+    int format = en.ttFormat;
+    en.ucioptions.Set("Hash Format", "5x12/64");
+    tp.setSize(1);
+    for (int t = 0; t < 3; t++)
+    {
+        int threads = threadnums[t];
+        vector<ttstressresult> results(threads);
+        vector<thread> stressthreads;
+        tp.clean();
+        for (int j = 0; j < threads; j++)
+        {
+            results[j] = { 0, 0, 0, 0 };
+            stressthreads.push_back(thread(ttStressThread, j, totalprobes / threads, &results[j]));
+        }
+        ttstressresult total = { 0, 0, 0, 0 };
+        for (int j = 0; j < threads; j++)
+        {
+            stressthreads[j].join();
+            total.probes += results[j].probes;
+            total.hits += results[j].hits;
+            total.detected += results[j].detected;
+            total.undetected += results[j].undetected;
+        }
+        printf("%7d  %10.1f  %16.3f  %31.3f\n", threads,
+            total.hits * 1e6 / total.probes, total.detected * 1e6 / total.probes, total.undetected * 1e6 / total.probes);
+    }
+    printf("========================================================================\n");
+
+    // an empty bucket must never match; hashes with the upper 16 bits zero are the critical ones for the 16bit keys
+    printf("Probes of a cleared table with the upper 16 bits of the hash zero\n");
+    for (int f = TTFORMAT5X12; f <= TTFORMAT4X8; f++)
+    {
+        en.ucioptions.Set("Hash Format", comboValue(TTFORMATNAMES, f));
+        tp.clean();
+        int falsehits = 0;
+        for (U64 n = 0; n < 100000; n++)
+        {
+            U64 hash = (n * 0x9e3779b97f4a7c15ULL) >> 16;
+            int val, staticeval;
+            uint16_t movecode;
+            bool found = false;
+            tp.probeHash(hash, &val, &staticeval, &movecode, 0, SCOREBLACKWINS, SCOREWHITEWINS, 0, &found);
+            if (found || tp.getMoveCode(hash))
+                falsehits++;
+        }
+        printf("%-8s  %s (%d false hits)\n", comboValue(TTFORMATNAMES, f).c_str(), falsehits ? "failed" : "ok", falsehits);
+    }
+    printf("========================================================================\n");
+    en.ucioptions.Set("Hash Format", comboValue(TTFORMATNAMES, format));
+    tp.setSize(en.Hash);
+}
+
+
+// Runs the bench with every format and replacement policy of the transposition table
+// Each position starts with ucinewgame, so the policies only differ where a search overwrites its own older iterations
+static void doTTBenchmark(int constdepth, int hashsize)
+{
+    struct ttbenchresult {
+        int format;
+        int replace;
+        statistic st;
+        long long nodes;
+        long long time;
+    };
+    vector<ttbenchresult> results;
+    int format = en.ttFormat;
+    int replace = en.ttReplace;
+    int hash = en.Hash;
+    bool statistics = en.searchstatistics;
+    int positions = 0;
+    while (benchpositions[positions].fen != "")
+        positions++;
+
+    // the formats and policies only differ when the bench overfills the table
+    en.ucioptions.Set("Hash", to_string(hashsize));
+    en.searchstatistics = true;
+    for (int f = TTFORMAT5X12; f <= TTFORMAT4X8; f++)
+        for (int r = TTREPLACEDEPTHAGE; r <= TTREPLACEAGEDEPTH; r++)
+        {
+            en.ucioptions.Set("Hash Format", comboValue(TTFORMATNAMES, f));
+            en.ucioptions.Set("Hash Replace", comboValue(TTREPLACENAMES, r));
+            ttbenchresult tr = { f, r, {}, 0, 0 };
+            en.resetStatistics();
+            for (int i = 0; i < positions; i++)
+            {
+                benchmarkstruct bm = benchpositions[i];
+                benchSearch(&bm, constdepth, 0);
+                tr.nodes += bm.nodes;
+                tr.time += bm.time;
+            }
+            en.getStatistics(&tr.st);
+            results.push_back(tr);
+        }
+    en.searchstatistics = statistics;
+    en.terminationscore = SHRT_MAX;
+    en.ucioptions.Set("Hash Format", comboValue(TTFORMATNAMES, format));
+    en.ucioptions.Set("Hash Replace", comboValue(TTREPLACENAMES, replace));
+    en.ucioptions.Set("Hash", to_string(hash));
+
+    printf("\n\nTransposition table benchmark for %s (Build %s)\n", en.name, BUILD);
+    printf("System: %s\n", GetSystemInfo().c_str());
+    printf("Hash %d MB, %d threads, %s\n", hashsize, en.Threads, constdepth ? ("depth " + to_string(constdepth)).c_str() : "default depth per position");
+    printf("=========================================================================\n");
+    printf("Format    Replace        probes    %%hits  %%cutoffs        nodes        nps\n");
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        ttbenchresult *tr = &results[i];
+        double probes = (double)max(1ULL, tr->st.tt_probe);
+        printf("%-8s  %-9s  %10lld  %7.2f  %8.2f  %11lld  %9lld\n", comboValue(TTFORMATNAMES, tr->format).c_str(), comboValue(TTREPLACENAMES, tr->replace).c_str(),
+            tr->st.tt_probe, 100.0 * tr->st.tt_hit / probes, 100.0 * (tr->st.qs_tt + tr->st.ab_tt) / probes,
+            tr->nodes, tr->nodes * en.frequency / max(1LL, tr->time));
+    }
+    printf("=========================================================================\n");
+}
+
+
+// Measures the ucinewgame to readyok latency with full and lazy clearing of the transposition table
+static void doClearHashTest()
+{
+    const int iterations = 3;
+    int maxhash = en.Hash;
+    bool lazy = en.lazyClearHash;
+    struct clearresult {
+        int hash;
+        long long time[2];
+    };
+    vector<clearresult> results;
+
+    for (int hash = 16; hash <= maxhash; hash = (hash < maxhash && hash * 4 > maxhash ? maxhash : hash * 4))
+    {
+        en.ucioptions.Set("Hash", to_string(hash));
+        clearresult cr = { hash, { 0, 0 } };
+        for (int mode = 0; mode < 2; mode++)
+        {
+            en.ucioptions.Set("Lazy Clear Hash", mode ? "true" : "false");
+            for (int i = 0; i < iterations; i++)
+            {
+                long long starttime = getTime();
+                en.communicate("ucinewgame");
+                en.communicate("isready");
+                cr.time[mode] += getTime() - starttime;
+            }
+        }
+        results.push_back(cr);
+    }
+    en.ucioptions.Set("Lazy Clear Hash", lazy ? "true" : "false");
+    if (en.Hash != maxhash)
+        en.ucioptions.Set("Hash", to_string(maxhash));
+
+    printf("\n\nClear hash latency for %s (Build %s)\n", en.name, BUILD);
+    printf("System: %s\n", GetSystemInfo().c_str());
+    printf("%d threads, average of %d ucinewgame/isready\n", en.Threads, iterations);
+    printf("==============================================\n");
+    printf("Hash (MB)     full clear (ms)   lazy clear (ms)\n");
+    for (size_t i = 0; i < results.size(); i++)
+        printf("%9d  %18.3f  %16.3f\n", results[i].hash,
+            results[i].time[0] * 1000.0 / en.frequency / iterations, results[i].time[1] * 1000.0 / en.frequency / iterations);
+    printf("==============================================\n");
+}
+
+
+#ifdef _WIN32
+typedef HANDLE enginepipe;
+#else
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+typedef int enginepipe;
+#endif
+
+// An external engine process of the enginetest with its pipes and the state of the current test
+struct engineprocess
+{
+    enginepipe in;      // write end of the engine's stdin
+    enginepipe out;     // read end of the engine's stdout and stderr
+#ifndef _WIN32
+    pid_t pid;
+#endif
+    thread *reader;
+    atomic<bool> closed;    // the engine closed its output, most likely it exited
+    enginestate es;
+};
+
+static int readfrompipe(enginepipe pipe, char *buf, int size)
+{
+#ifdef _WIN32
+    DWORD dwRead;
+    if (!ReadFile(pipe, buf, size, &dwRead, NULL))
+        return -1;
+    return (int)dwRead;
+#else
+    ssize_t n;
+    while ((n = read(pipe, buf, size)) < 0 && errno == EINTR);
+    return (int)n;
+#endif
+}
 
-    ifstream epdfile;
-    bool bGetFromEpd = false;
-    if (epdfilename != "")
+static bool writetoengine(enginepipe pipe, const char *s)
+{
+#ifdef _WIN32
+    DWORD written;
+    return WriteFile(pipe, s, (DWORD)strlen(s), &written, NULL);
+#else
+    size_t len = strlen(s);
+    while (len)
     {
-        epdfile.open(epdfilename, ifstream::in);
-        bGetFromEpd = epdfile.is_open();
-        if (!bGetFromEpd)
-            printf("Cannot open file %s for reading.\n", epdfilename.c_str());
+        ssize_t n = write(pipe, s, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        s += n;
+        len -= n;
     }
+    return true;
+#endif
+}
 
-    int i = 0;
-    int totalSolved[2] = { 0 };
-    benchmarkstruct epdbm;
-    FILE *tableout = openbench ? stdout : stderr;
+static void parseengineline(const char *s, enginestate *es)
+{
+    vector<string> token;
+    if (strstr(s, "uciok") != NULL && es->phase == 0)
+    {
+        es->uciokTime = getTime();
+        es->phase = 1;
+    }
+    if (strstr(s, "readyok") != NULL && es->phase == 1)
+        es->phase = 2;
+    if (es->phase != 2)
+        return;
 
-    while (true)
+    if (es->doEval)
     {
-        string avoidmoves = "";
-        string bestmoves = "";
-        benchmarkstruct *bm;
-        if (!bGetFromEpd)
+        const char *strEval;
+        if ((strEval = strstr(s, "evaluation: ")) || (strEval = strstr(s, "score: ")))
         {
-            // standard bench with included positions
-            bm = &benchmark[i];
+            vector<string> scoretoken = SplitString(strEval);
+            if (scoretoken.size() > 1)
+            {
+                try
+                {
+                    es->score = int(stof(scoretoken[1]) * 100);
+                }
+                catch (const invalid_argument&) {}
+            }
+            es->phase = 3;
         }
-        else
+        return;
+    }
+
+    const char *bestmovestr = strstr(s, "bestmove ");
+    const char *pv = strstr(s, " pv ");
+    const char *score = strstr(s, " cp ");
+    const char *mate = strstr(s, " mate ");
+    const char *bmptr = NULL;
+    if (bestmovestr != NULL)
+    {
+        bmptr = bestmovestr;
+    }
+    if (pv != NULL)
+    {
+        bmptr = pv;
+    }
+    if (bmptr)
+    {
+        token = SplitString(bmptr);
+        if (token.size() > 1)
         {
-            // read positions from epd file
-            bm = &epdbm;
-            string line;
-            getline(epdfile, line);
-            getFenAndBmFromEpd(line, &bm->fen, &bestmoves, &avoidmoves);
-
-            bm->depth = 10;  // default depth for epd bench
-            bm->terminationscore = 0;
-        }
-        if (bm->fen == "") break;
+            es->enginesbestmove = token[1];
+            string myPv = token[1];
+            bool bestmovefound = (strstr(es->bestmoves.c_str(), myPv.c_str()) != NULL
+                || (es->bestmoves == "" && strstr(es->avoidmoves.c_str(), myPv.c_str()) == NULL));
 
-        if (++i < startnum) continue;
+            if (score)
+            {
+                vector<string> scoretoken = SplitString(score);
+                if (scoretoken.size() > 1)
+                {
+                    try
+                    {
+                        if (bestmovefound)
+                            es->score = stoi(scoretoken[1]);
+                        else
+                            es->allscore = stoi(scoretoken[1]);
+                    }
+                    catch (const invalid_argument&) {}
+                }
+            }
+            if (mate)
+            {
+                vector<string> matetoken = SplitString(mate);
+                if (matetoken.size() > 1)
+                {
+                    try
+                    {
+                        if (bestmovefound)
+                            es->score = SCOREWHITEWINS - stoi(matetoken[1]);
+                        else
+                            es->allscore = SCOREWHITEWINS - stoi(matetoken[1]);
+                    }
+                    catch (const invalid_argument&) {}
+                }
+            }
+            if (bestmovefound)
+            {
+                if (es->firstbesttimesec < 0)
+                    es->firstbesttimesec = (int)((getTime() - es->starttime) / en.frequency);
+            }
+            else {
+                es->firstbesttimesec = -1;
+            }
+        }
+    }
+    if (bestmovestr)
+        es->phase = 3;
+}
 
-        en.communicate("ucinewgame");
-        en.communicate("position fen " + bm->fen);
-        starttime = getTime();
-        int dp = 0;
-        int tm = consttime;
-        if (constdepth)
-            dp = constdepth;
-        else
-            dp = bm->depth;
-        if (bm->terminationscore)
-            en.terminationscore = bm->terminationscore;
-        else
-            en.terminationscore = SHRT_MAX;
-        if (tm)
-            en.communicate("go movetime " + to_string(tm * 1000));
-        else if (dp)
-            en.communicate("go depth " + to_string(dp));
-        else
-            en.communicate("go infinite");
-
-        endtime = getTime();
-        bm->time = endtime - starttime;
-        bm->nodes = en.getTotalNodes();
-        bm->score = en.rootposition.lastbestmovescore;
-        bm->depthAtExit = en.benchdepth;
-        bm->move = en.benchmove;
-        bm->solved = 2;
-
-        if (bestmoves != "")
-            bm->solved = (bestmoves.find(bm->move) != string::npos) ? 1 : 0;
-        if (avoidmoves != "")
-            bm->solved = (bestmoves.find(bm->move) != string::npos) ? 0 : 1;
-        if (bm->solved < 2)
-            totalSolved[bm->solved]++;
+static void readfromengine(engineprocess *ep)
+{
+    char chBuf[BUFSIZE];
+    string pending;
+    int n;
 
-        if (bGetFromEpd)
-            benchTableItem(tableout, i, bm);
+    // lines may be split over several reads so keep the incomplete rest
+    while ((n = readfrompipe(ep->out, chBuf, BUFSIZE)) > 0)
+    {
+        pending.append(chBuf, n);
+        size_t eol;
+        while ((eol = pending.find('\n')) != string::npos)
+        {
+            parseengineline(pending.substr(0, eol).c_str(), &ep->es);
+            pending.erase(0, eol + 1);
+        }
+    }
+    ep->closed = true;
+}
 
-        bmlist.push_back(*bm);
+// Waits until the engine reached the given phase; returns false when the engine ended before
+static bool waitforengine(engineprocess *ep, int phase, int sleepDelay)
+{
+    while (ep->es.phase < phase)
+    {
+        if (ep->closed)
+            return (ep->es.phase >= phase);
+        Sleep(sleepDelay);
     }
+    return true;
+}
 
-    en.terminationscore = SHRT_MAX;
-    i = 0;
-    long long totaltime = 0;
-    long long totalnodes = 0;
-    benchTableHeader(tableout);
+static bool startengine(string engineprg, engineprocess *ep)
+{
+#ifdef _WIN32
+    HANDLE g_hChildStd_IN_Rd = NULL;
+    HANDLE g_hChildStd_OUT_Wr = NULL;
+    SECURITY_ATTRIBUTES sa;
+    sa.nLength = sizeof(SECURITY_ATTRIBUTES);
+    sa.bInheritHandle = TRUE;
+    sa.lpSecurityDescriptor = NULL;
+
+    if (!CreatePipe(&ep->out, &g_hChildStd_OUT_Wr, &sa, 0)
+        || !SetHandleInformation(ep->out, HANDLE_FLAG_INHERIT, 0)
+        || !CreatePipe(&g_hChildStd_IN_Rd, &ep->in, &sa, 0)
+        || !SetHandleInformation(ep->in, HANDLE_FLAG_INHERIT, 0))
+    {
+        printf("Cannot pipe connection to engine process.\n");
+        return false;
+    }
 
-    for (list<benchmarkstruct>::iterator bm = bmlist.begin(); bm != bmlist.end(); bm++)
+    PROCESS_INFORMATION piProcInfo;
+    STARTUPINFO siStartInfo;
+    ZeroMemory(&piProcInfo, sizeof(PROCESS_INFORMATION));
+    ZeroMemory(&siStartInfo, sizeof(STARTUPINFO));
+    siStartInfo.cb = sizeof(STARTUPINFO);
+    siStartInfo.hStdError = g_hChildStd_OUT_Wr;
+    siStartInfo.hStdOutput = g_hChildStd_OUT_Wr;
+    siStartInfo.hStdInput = g_hChildStd_IN_Rd;
+    siStartInfo.dwFlags |= STARTF_USESTDHANDLES;
+
+    if (!CreateProcess(NULL, (LPSTR)engineprg.c_str(), NULL, NULL, TRUE, 0, NULL, NULL, &siStartInfo, &piProcInfo))
     {
-        totaltime += bm->time;
-        totalnodes += bm->nodes;
-        benchTableItem(tableout, ++i, &*bm);
+        printf("Cannot create process for engine %s.\n", engineprg.c_str());
+        return false;
     }
-    if (totaltime)
+    CloseHandle(piProcInfo.hProcess);
+    CloseHandle(piProcInfo.hThread);
+#else
+    int inpipe[2], outpipe[2];
+    if (pipe(inpipe) < 0 || pipe(outpipe) < 0)
     {
-        benchTableFooder(tableout, totaltime, totalnodes, totalSolved);
-        if (openbench)
-            printf("Time  : %lld\nNodes : %lld\nNPS   : %lld\n", totaltime * 1000 / en.frequency, totalnodes, totalnodes * en.frequency / totaltime);
+        printf("Cannot pipe connection to engine process.\n");
+        return false;
+    }
+    // engines started later must not inherit the pipes of this one; dup2 clears the flag for stdin/stdout
+    for (int fd : { inpipe[0], inpipe[1], outpipe[0], outpipe[1] })
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    // no allocation in the child; the reader threads of other engines may hold the malloc lock while forking
+    string command = "exec " + engineprg;
+    ep->pid = fork();
+    if (ep->pid < 0)
+    {
+        printf("Cannot create process for engine %s.\n", engineprg.c_str());
+        return false;
     }
+    if (ep->pid == 0)
+    {
+        // child: connect the pipes to stdin/stdout/stderr and let the shell handle arguments of the engine command
+        dup2(inpipe[0], STDIN_FILENO);
+        dup2(outpipe[1], STDOUT_FILENO);
+        dup2(outpipe[1], STDERR_FILENO);
+        execl("/bin/sh", "sh", "-c", command.c_str(), (char*)NULL);
+        _exit(127);
+    }
+    close(inpipe[0]);
+    close(outpipe[1]);
+    ep->in = inpipe[1];
+    ep->out = outpipe[0];
+#endif
+    ep->closed = false;
+    ep->reader = new thread(&readfromengine, ep);
+    return true;
+}
+
+static void stopengine(engineprocess *ep)
+{
+    writetoengine(ep->in, "quit\n");
+#ifdef _WIN32
+    ep->reader->detach();
+#else
+    close(ep->in);
+    ep->reader->join();
+    close(ep->out);
+    waitpid(ep->pid, NULL, 0);
+#endif
+    delete ep->reader;
 }
 
+// A single position of the enginetest with the results of the compare file
+struct enginetestitem
+{
+    int linenum;
+    string fen;
+    string bestmoves;
+    string avoidmoves;
+    bool doCompare;
+    bool comparesuccess;
+    int comparetime;
+    int comparescore;
+};
 
+struct enginetestqueue
+{
+    vector<enginetestitem> items;
+    atomic<int> next;
+    mutex outputmutex;
+    ofstream *logfile;
+    int maxtime;
+    int flags;
+    atomic<bool> aborted;
+};
 
-#ifdef _WIN32
+static void stopenginetest(enginetestqueue *queue, int engine)
+{
+    lock_guard<mutex> lk(queue->outputmutex);
+    if (!queue->aborted)
+        printf("Engine e#%d ended unexpectedly. Stopping the test.\n", engine);
+    queue->aborted = true;
+}
 
-static void readfromengine(HANDLE pipe, enginestate *es)
+// Tests the positions of the queue with one instance of every engine
+static void testengineworker(enginetestqueue *queue, engineprocess *ep, int numEngines)
 {
-    DWORD dwRead;
-    CHAR chBuf[BUFSIZE];
-    vector<string> lines, token;
-
-    do
-    {
-        memset(chBuf, 0, BUFSIZE);
-        ReadFile(pipe, chBuf, BUFSIZE, &dwRead, NULL);
-        stringstream ss(chBuf);
-        string line;
-
-        while (getline(ss, line)) {
-            const char *s = line.c_str();
-            if (strstr(s, "uciok") != NULL && es->phase == 0)
-                es->phase = 1;
-            if (strstr(s, "readyok") != NULL && es->phase == 1)
-                es->phase = 2;
-            if (es->phase == 2)
+    const int sleepDelay = 10;
+    bool doEval = (queue->flags & 0x08);
+    int flags = queue->flags;
+    int maxtime = queue->maxtime;
+    char buf[1024];
+    int n;
+    while (!queue->aborted && (n = queue->next++) < (int)queue->items.size())
+    {
+        enginetestitem *item = &queue->items[n];
+        for (int i = 0; i < numEngines; i++)
+        {
+            // Initialize the engine
+            enginestate *es = &ep[i].es;
+            es->bestmoves = item->bestmoves;
+            es->avoidmoves = item->avoidmoves;
+            es->doCompare = item->doCompare;
+            es->comparescore = item->comparescore;
+            es->comparesuccess = item->comparesuccess;
+            es->comparetime = item->comparetime;
+            es->phase = 0;
+            es->score = SCOREBLACKWINS;
+
+            writetoengine(ep[i].in, "uci\n");
+            if (!waitforengine(&ep[i], 1, sleepDelay))
+                return stopenginetest(queue, i);
+            writetoengine(ep[i].in, "ucinewgame\n");
+            writetoengine(ep[i].in, "isready\n");
+            if (!waitforengine(&ep[i], 2, sleepDelay))
+                return stopenginetest(queue, i);
+
+            es->starttime = getTime();
+            es->firstbesttimesec = -1;
+
+            sprintf_s(buf, "position fen %s 0 1\n%s\n", item->fen.c_str(), doEval ? "eval" : "go infinite");
+
+            writetoengine(ep[i].in, buf);
+        }
+
+        stringstream out, log;
+        for (int i = 0; i < numEngines; i++)
+        {
+            enginestate *es = &ep[i].es;
+            bool engineStopped = false;
+            while (es->phase < 3)
             {
-                if (es->doEval)
+                if (ep[i].closed && es->phase < 3)
+                    return stopenginetest(queue, i);
+                Sleep(sleepDelay);
+                long long sec = (long long)((getTime() - es->starttime) / en.frequency);
+                if (!engineStopped
+                    && (sec > maxtime
+                        || es->score > SCOREWHITEWINS - MAXDEPTH
+                        || ((flags & 0x2) && es->doCompare && es->comparesuccess && sec > es->comparetime)
+                        || ((flags & 0x2) && es->firstbesttimesec >= 0 && sec > es->firstbesttimesec + 5)))
                 {
-                    const char *strEval;
-                    if ((strEval = strstr(s, "evaluation: ")) || (strEval = strstr(s, "score: ")))
-                    {
-                        vector<string> scoretoken = SplitString(strEval);
-                        if (scoretoken.size() > 1)
-                        {
-                            try
-                            {
-                                es->score = int(stof(scoretoken[1]) * 100);
-                                //printf("%d\n", es->score);
-                            }
-                            catch (const invalid_argument&) {}
-                        }
-                        es->phase = 3;
-                    }
+                    writetoengine(ep[i].in, "stop\n");
+                    engineStopped = true;
+                }
+            }
+            if (!doEval)
+            {
+                string moves = (es->bestmoves != "" ? es->bestmoves : es->avoidmoves);
+                if (es->firstbesttimesec >= 0)
+                {
+                    out << "e#" << i << "  " << item->linenum << "  " << (es->bestmoves != "" ? "bm" : "am") << ": " << moves << "  found: " << es->enginesbestmove << "  score: " << es->score << "  time: " << es->firstbesttimesec << "\n";
+                    log << "e#" << i << " " << item->linenum << " + \"" << (es->bestmoves != "" ? es->bestmoves : es->avoidmoves + "(a)") << "\" " << es->enginesbestmove << " " << es->score << " " << es->firstbesttimesec << "\n";
                 }
                 else
                 {
-
-                    const char *bestmovestr = strstr(s, "bestmove ");
-                    const char *pv = strstr(s, " pv ");
-                    const char *score = strstr(s, " cp ");
-                    const char *mate = strstr(s, " mate ");
-                    const char *bmptr = NULL;
-                    if (bestmovestr != NULL)
-                    {
-                        bmptr = bestmovestr;
-                    }
-                    if (pv != NULL)
-                    {
-                        bmptr = pv;
-                    }
-                    if (bmptr)
-                    {
-                        token = SplitString(bmptr);
-                        if (token.size() > 1)
-                        {
-                            es->enginesbestmove = token[1];
-                            string myPv = token[1];
-                            bool bestmovefound = (strstr(es->bestmoves.c_str(), myPv.c_str()) != NULL
-                                || (es->bestmoves == "" && strstr(es->avoidmoves.c_str(), myPv.c_str()) == NULL));
-
-                            if (score)
-                            {
-                                vector<string> scoretoken = SplitString(score);
-                                if (scoretoken.size() > 1)
-                                {
-                                    try
-                                    {
-                                        if (bestmovefound)
-                                            es->score = stoi(scoretoken[1]);
-                                        else
-                                            es->allscore = stoi(scoretoken[1]);
-                                    }
-                                    catch (const invalid_argument&) {}
-                                }
-                            }
-                            if (mate)
-                            {
-                                vector<string> matetoken = SplitString(mate);
-                                if (matetoken.size() > 1)
-                                {
-                                    try
-                                    {
-                                        if (bestmovefound)
-                                            es->score = SCOREWHITEWINS - stoi(matetoken[1]);
-                                        else
-                                            es->allscore = SCOREWHITEWINS - stoi(matetoken[1]);
-                                    }
-                                    catch (const invalid_argument&) {}
-                                }
-                            }
-                            if (bestmovefound)
-                            {
-                                if (es->firstbesttimesec < 0)
-                                {
-                                    es->firstbesttimesec = (clock() - es->starttime) / CLOCKS_PER_SEC;
-                                    //printf("%d %d  %d\n", es->firstbesttimesec, es->starttime, clock());
-                                }
-                            }
-                            else {
-                                es->firstbesttimesec = -1;
-                                //printf("%d %d  %d\n", es->firstbesttimesec, es->starttime, clock());
-                            }
-                        }
-                    }
-                    if (bestmovestr)
-                        es->phase = 3;
+                    out << "e#" << i << "  " << item->linenum << "  " << (es->bestmoves != "" ? "bm" : "am") << ": " << moves << "  found: " << es->enginesbestmove << " ... failed  score: " << es->allscore << "\n";
+                    log << "e#" << i << " " << item->linenum << " - \"" << (es->bestmoves != "" ? es->bestmoves : es->avoidmoves + "(a)") << "\" " << es->enginesbestmove << " " << es->allscore << "\n";
                 }
             }
         }
-    } while (true);
+
+        if (doEval)
+        {
+            out << "\"" << item->fen << "\" ";
+            log << "\"" << item->fen << "\" ";
+            for (int i = 0; i < numEngines; i++)
+            {
+                out << setw(5) << ep[i].es.score << " ";
+                log << ep[i].es.score << " ";
+            }
+            out << "\n";
+            log << "\n";
+        }
+
+        lock_guard<mutex> lk(queue->outputmutex);
+        cout << out.str();
+        *queue->logfile << log.str();
+    }
 }
 
-static BOOL writetoengine(HANDLE pipe, const char *s)
+// Integer field of the compare file; malformed and out of range values are ignored
+static bool compareint(string s, int *val)
 {
-    DWORD written;
-    return WriteFile(pipe, s, (DWORD)strlen(s), &written, NULL);
+    try
+    {
+        *val = stoi(s);
+        return true;
+    }
+    catch (const logic_error&)
+    {
+        return false;
+    }
 }
 
-static void testengine(string epdfilename, int startnum, string engineprgs, string logfilename, string comparefilename, int maxtime, int flags)
+static void testengine(string epdfilename, int startnum, string engineprgs, string logfilename, string comparefilename, int maxtime, int flags, int jobs)
 {
-    enginestate es[4];
-    enginestate ges;
     string engineprg[4];
     int numEngines = 0;
     string line;
-    thread *readThread[4];
     ifstream comparefile;
-    bool compare = false;
-    char buf[1024];
     bool doEval = (flags & 0x08);
     while (engineprgs != "" && numEngines < 4)
     {
         size_t i = engineprgs.find('*');
-        engineprg[numEngines] = (i == string::npos) ? engineprgs : engineprgs.substr(0, i);
+        engineprg[numEngines++] = (i == string::npos) ? engineprgs : engineprgs.substr(0, i);
         engineprgs = (i == string::npos) ? "" : engineprgs.substr(i + 1, string::npos);
-        es[numEngines++].doEval = (flags & 0x08);
     }
-
-    int sleepDelay = 10;
+    if (!numEngines)
+    {
+        printf("No engine given (use -engineprg).\n");
+        return;
+    }
 
     // Default time for enginetest: 30s
     if (!maxtime) maxtime = 30;
@@ -743,7 +2144,8 @@ static void testengine(string epdfilename, int startnum, string engineprgs, stri
         return;
     }
 
-    // Open the compare file for reading
+    // Read the compare file
+    map<int, vector<string>> compareresults;
     if (comparefilename != "")
     {
         comparefile.open(comparefilename);
@@ -752,7 +2154,21 @@ static void testengine(string epdfilename, int startnum, string engineprgs, stri
             printf("Cannot open %s.\n", comparefilename.c_str());
             return;
         }
-        compare = true;
+        string compareline;
+        while (getline(comparefile, compareline, '\n'))
+        {
+            vector<string> cv = SplitString(compareline.c_str());
+            // the log of an earlier test has the results of the first engine in the e#0 lines
+            if (cv.size() && cv[0].compare(0, 2, "e#") == 0)
+            {
+                if (cv[0] != "e#0")
+                    continue;
+                cv.erase(cv.begin());
+            }
+            int comparenum;
+            if (cv.size() > 1 && compareint(cv[0], &comparenum))
+                compareresults[comparenum] = cv;
+        }
     }
 
     // Open the log file for writing
@@ -770,195 +2186,229 @@ static void testengine(string epdfilename, int startnum, string engineprgs, stri
     else
         logfile << "fen eval\n";
 
-    // Start the engine with linked pipes
-    HANDLE g_hChildStd_IN_Rd[4] = { NULL };
-    HANDLE g_hChildStd_IN_Wr[4] = { NULL };
-    HANDLE g_hChildStd_OUT_Rd[4] = { NULL };
-    HANDLE g_hChildStd_OUT_Wr[4] = { NULL };
-    BOOL bSuccess;
-    for (int i = 0; i < numEngines; i++)
-    {
-        SECURITY_ATTRIBUTES sa;
-        sa.nLength = sizeof(SECURITY_ATTRIBUTES);
-        sa.bInheritHandle = TRUE;
-        sa.lpSecurityDescriptor = NULL;
-
-        if (!CreatePipe(&g_hChildStd_OUT_Rd[i], &g_hChildStd_OUT_Wr[i], &sa, 0)
-            || !SetHandleInformation(g_hChildStd_OUT_Rd[i], HANDLE_FLAG_INHERIT, 0)
-            || !CreatePipe(&g_hChildStd_IN_Rd[i], &g_hChildStd_IN_Wr[i], &sa, 0)
-            || !SetHandleInformation(g_hChildStd_IN_Wr[i], HANDLE_FLAG_INHERIT, 0))
-        {
-            printf("Cannot pipe connection to engine process.\n");
-            return;
-        }
-
-        PROCESS_INFORMATION piProcInfo;
-        STARTUPINFO siStartInfo;
-        bSuccess = FALSE;
-        ZeroMemory(&piProcInfo, sizeof(PROCESS_INFORMATION));
-        ZeroMemory(&siStartInfo, sizeof(STARTUPINFO));
-        siStartInfo.cb = sizeof(STARTUPINFO);
-        siStartInfo.hStdError = g_hChildStd_OUT_Wr[i];
-        siStartInfo.hStdOutput = g_hChildStd_OUT_Wr[i];
-        siStartInfo.hStdInput = g_hChildStd_IN_Rd[i];
-        siStartInfo.dwFlags |= STARTF_USESTDHANDLES;
-
-        bSuccess = CreateProcess(NULL, (LPSTR)engineprg[i].c_str(), NULL, NULL, TRUE, 0, NULL, NULL, &siStartInfo, &piProcInfo);
-        if (!bSuccess)
-        {
-            printf("Cannot create process for engine %s.\n", engineprg[i].c_str());
-            return;
-        }
-        CloseHandle(piProcInfo.hProcess);
-        CloseHandle(piProcInfo.hThread);
-        readThread[i] = new thread(&readfromengine, g_hChildStd_OUT_Rd[i], &es[i]);
-    }
-    // Read epd line by line
+    // Read the epd file; this needs the root position so it is done before the workers start
+    enginetestqueue queue;
+    queue.next = 0;
+    queue.aborted = false;
+    queue.logfile = &logfile;
+    queue.maxtime = maxtime;
+    queue.flags = flags;
     int linenum = 0;
     while (getline(epdfile, line))
     {
-        string fenstr;
-        getFenAndBmFromEpd(line, &fenstr, &(ges.bestmoves), &(ges.avoidmoves));
+        enginetestitem item;
+        getFenAndBmFromEpd(line, &item.fen, &item.bestmoves, &item.avoidmoves);
+
+        if (item.fen == "" || ++linenum < startnum)
+            continue;
 
-        if (fenstr != "" && ++linenum >= startnum)
+        item.linenum = linenum;
+        if (doEval)
         {
-            if (doEval)
+            // Skip positions with check
+            en.sthread[0].pos.getFromFen(item.fen.c_str());
+            if (en.sthread[0].pos.isCheckbb)
+                continue;
+            item.fen = en.sthread[0].pos.toFen();
+        }
+
+        // Get data from compare file
+        item.doCompare = false;
+        item.comparesuccess = false;
+        item.comparescore = SCOREBLACKWINS;
+        item.comparetime = -1;
+        map<int, vector<string>>::iterator cr = compareresults.find(linenum);
+        if (cr != compareresults.end())
+        {
+            vector<string> &cv = cr->second;
+            item.doCompare = true;
+            item.comparesuccess = (cv[1] == "+");
+            if (cv.size() > 4)
+                compareint(cv[4], &item.comparescore);
+            if (cv.size() > 5)
             {
-                // Skip positions with check
-                en.sthread[0].pos.getFromFen(fenstr.c_str());
-                if (en.sthread[0].pos.isCheckbb)
+                compareint(cv[5], &item.comparetime);
+                if (item.comparetime == 0 && (flags & 0x1))
+                    // nothing to improve; skip this test
                     continue;
-                fenstr = en.sthread[0].pos.toFen();
             }
+        }
+        queue.items.push_back(item);
+    }
 
-            // Get data from compare file
-            ges.doCompare = false;
-            if (compare)
-            {
-                vector<string> cv;
-                string compareline;
-                int compareindex = 0;
-                while (compareindex != linenum && getline(comparefile, compareline, '\n'))
-                {
-                    cv = SplitString(compareline.c_str());
-                    try
-                    {
-                        compareindex = stoi(cv[0]);
-                    }
-                    catch (const invalid_argument&) {}
+#ifndef _WIN32
+    // a crashing engine should not kill the test
+    signal(SIGPIPE, SIG_IGN);
+#endif
 
-                }
-                if (compareindex == linenum)
-                {
-                    ges.doCompare = true;
-                    ges.comparesuccess = (cv[1] == "+");
-                    ges.comparescore = SCOREBLACKWINS;
-                    ges.comparetime = -1;
-                    if (cv.size() > 4)
-                    {
-                        try
-                        {
-                            ges.comparescore = stoi(cv[4]);
-                        }
-                        catch (const invalid_argument&) {}
-                    }
-                    if (cv.size() > 5)
-                    {
-                        try
-                        {
-                            ges.comparetime = stoi(cv[5]);
-                        }
-                        catch (const invalid_argument&) {}
-                        if (ges.comparetime == 0 && (flags & 0x1))
-                            // nothing to improve; skip this test
-                            continue;
-                    }
-                }
-            }
-            for (int i = 0; i < numEngines; i++)
+    // Start jobs instances of every engine; each set of engines works on its own positions
+    jobs = max(1, jobs);
+    vector<engineprocess> ep(jobs * numEngines);
+    vector<bool> started(jobs * numEngines);
+    bool allStarted = true;
+    for (int j = 0; j < jobs; j++)
+        for (int i = 0; i < numEngines; i++)
+        {
+            ep[j * numEngines + i].es.doEval = doEval;
+            started[j * numEngines + i] = startengine(engineprg[i], &ep[j * numEngines + i]);
+            if (!started[j * numEngines + i])
             {
-                // Initialize the engine
-                es[i].bestmoves = ges.bestmoves;
-                es[i].avoidmoves = ges.avoidmoves;
-                es[i].doCompare = ges.doCompare;
-                es[i].comparescore = ges.comparescore;
-                es[i].comparesuccess = ges.comparesuccess;
-                es[i].comparetime = ges.comparetime;
-                es[i].phase = 0;
-                es[i].score = SCOREBLACKWINS;
-
-                bSuccess = writetoengine(g_hChildStd_IN_Wr[i], "uci\n");
-                while (es[i].phase == 0)
-                    Sleep(sleepDelay);
-                bSuccess = writetoengine(g_hChildStd_IN_Wr[i], "ucinewgame\n");
-                bSuccess = writetoengine(g_hChildStd_IN_Wr[i], "isready\n");
-                while (es[i].phase == 1)
-                    Sleep(sleepDelay);
-
-                es[i].starttime = clock();
-                es[i].firstbesttimesec = -1;
-
-                sprintf_s(buf, "position fen %s 0 1\n%s\n", fenstr.c_str(), doEval ? "eval" : "go infinite");
-
-                bSuccess = writetoengine(g_hChildStd_IN_Wr[i], buf);
+                printf("Cannot start instance %d of engine %d (%s).\n", j + 1, i + 1, engineprg[i].c_str());
+                allStarted = false;
             }
+        }
+    if (!allStarted)
+    {
+        // don't leave the instances that did start running without us
+        for (int i = 0; i < jobs * numEngines; i++)
+            if (started[i])
+                stopengine(&ep[i]);
+        return;
+    }
 
-            for (int i = 0; i < numEngines; i++)
-            {
-                bool engineStopped = false;
-                while (es[i].phase < 3)
-                {
-                    Sleep(sleepDelay);
-                    clock_t now = clock();
-                    if (!engineStopped
-                        && ((now - es[i].starttime) / CLOCKS_PER_SEC > maxtime
-                            || es[i].score > SCOREWHITEWINS - MAXDEPTH
-                            || ((flags & 0x2) && es[i].doCompare && es[i].comparesuccess && (now - es[i].starttime) / CLOCKS_PER_SEC > es[i].comparetime)
-                            || ((flags & 0x2) && es[i].firstbesttimesec >= 0 && ((now - es[i].starttime) / CLOCKS_PER_SEC) > es[i].firstbesttimesec + 5)))
-                    {
-                        bSuccess = writetoengine(g_hChildStd_IN_Wr[i], "stop\n");
-                        engineStopped = true;
-                    }
-                }
-                if (!doEval)
-                {
-                    if (es[i].firstbesttimesec >= 0)
-                    {
-                        printf("e#%d  %d  %s: %s  found: %s  score: %d  time: %d\n", i, linenum, (es[i].bestmoves != "" ? "bm" : "am"), (es[i].bestmoves != "" ? es[i].bestmoves.c_str() : es[i].avoidmoves.c_str()), es[i].enginesbestmove.c_str(), es[i].score, es[i].firstbesttimesec);
-                        logfile << "e#" << i << " " << linenum << " + \"" << (es[i].bestmoves != "" ? es[i].bestmoves.c_str() : (es[i].avoidmoves + "(a)").c_str()) << "\" " << es[i].enginesbestmove.c_str() << " " << es[i].score << " " << es[i].firstbesttimesec << "\n";
+    vector<thread> workers;
+    for (int j = 0; j < jobs; j++)
+        workers.push_back(thread(&testengineworker, &queue, &ep[j * numEngines], numEngines));
+    for (int j = 0; j < jobs; j++)
+        workers[j].join();
 
-                    }
-                    else
-                    {
-                        printf("e#%d  %d  %s: %s  found: %s ... failed  score: %d\n", i, linenum, (es[i].bestmoves != "" ? "bm" : "am"), (es[i].bestmoves != "" ? es[i].bestmoves.c_str() : es[i].avoidmoves.c_str()), es[i].enginesbestmove.c_str(), es[i].allscore);
-                        logfile << "e#" << i << " " << linenum << " - \"" << (es[i].bestmoves != "" ? es[i].bestmoves.c_str() : (es[i].avoidmoves + "(a)").c_str()) << "\" " << es[i].enginesbestmove.c_str() << " " << es[i].allscore << "\n";
-                    }
-                }
-            }
+    for (int i = 0; i < jobs * numEngines; i++)
+        stopengine(&ep[i]);
+}
 
-            if (doEval)
-            {
-                printf("\"%s\" ", fenstr.c_str());
-                logfile << "\"" << fenstr << "\" ";
-                for (int i = 0; i < numEngines; i++)
-                {
-                    printf("%5d ", es[i].score);
-                    logfile << es[i].score << " ";
-                }
-                printf("\n");
-                logfile << "\n";
-            }
+
+// Measures the time from starting a new engine process to its 'uciok'; default is this executable
+static void doStartupTest(int iterations, string engineprg)
+{
+    if (engineprg == "")
+    {
+        char path[4096];
+#ifdef _WIN32
+        DWORD len = GetModuleFileName(NULL, path, sizeof(path));
+#else
+        ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+#endif
+        if (len <= 0 || len >= (int)sizeof(path))
+        {
+            printf("Cannot determine path of the executable; use -engineprg.\n");
+            return;
+        }
+        path[len] = 0;
+        engineprg = path;
+    }
+
+    long long total = 0, minimum = LLONG_MAX, maximum = 0;
+    for (int i = 0; i < iterations; i++)
+    {
+        engineprocess ep;
+        ep.es.phase = 0;
+        U64 starttime = getTime();
+        if (!startengine(engineprg, &ep))
+            return;
+        writetoengine(ep.in, "uci\n");
+        // Give up when the engine exits or doesn't send uciok within 10 seconds
+        U64 timeout = starttime + 10 * en.frequency;
+        while (ep.es.phase == 0 && !ep.closed && getTime() < timeout)
+            Sleep(1);
+        if (ep.es.phase == 0)
+        {
+            printf("%s %s before sending uciok. Stopping the test.\n", engineprg.c_str(), ep.closed ? "exited" : "needed more than 10 seconds");
+#ifndef _WIN32
+            kill(ep.pid, SIGKILL);   // don't wait for a hanging engine to read quit
+#endif
+            stopengine(&ep);
+            return;
+        }
+        long long t = (long long)(ep.es.uciokTime - starttime);
+        total += t;
+        minimum = min(minimum, t);
+        maximum = max(maximum, t);
+        stopengine(&ep);
+    }
+
+    printf("\n\nStartup latency test for %s (Build %s):\n", en.name, BUILD);
+    printf("System: %s\n", GetSystemInfo().c_str());
+    printf("Engine: %s\n", engineprg.c_str());
+    printf("Time from process start to 'uciok' over %d starts\n", iterations);
+    printf("===========================================================\n");
+    printf("avg %10.2f ms   min %10.2f ms   max %10.2f ms\n",
+        total * 1e3 / iterations / en.frequency, minimum * 1e3 / en.frequency, maximum * 1e3 / en.frequency);
+    printf("===========================================================\n");
+}
+
+
+// Writes the constant tables that would otherwise be calculated at startup as source file
+static void genTables(string filename)
+{
+    static int reduction[2][MAXDEPTH][64];
+    int lmp[2][MAXLMPDEPTH];
+    calcSearchTables(reduction, lmp);
+    initSliderAttacks(false, true);
+
+    ofstream os(filename);
+    if (!os)
+    {
+        printf("Cannot open %s for writing.\n", filename.c_str());
+        return;
+    }
+    char buf[64];
+    os << "/*\n  RubiChess is a UCI chess playing engine by Andreas Matthies.\n\n"
+        "  RubiChess is free software: you can redistribute it and/or modify\n"
+        "  it under the terms of the GNU General Public License as published by\n"
+        "  the Free Software Foundation, either version 3 of the License, or\n"
+        "  (at your option) any later version.\n\n"
+        "  RubiChess is distributed in the hope that it will be useful,\n"
+        "  but WITHOUT ANY WARRANTY; without even the implied warranty of\n"
+        "  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the\n"
+        "  GNU General Public License for more details.\n\n"
+        "  You should have received a copy of the GNU General Public License\n"
+        "  along with this program.  If not, see <http://www.gnu.org/licenses/>.\n*/\n\n";
+    os << "// Generated by 'RubiChess -gentables'; do not edit.\n"
+        "// Run 'make tables' after changing the slider masks or the formulas in calcSearchTables.\n\n"
+        "#include \"RubiChess.h\"\n\n";
+    os << "static_assert(MAXDEPTH == " << MAXDEPTH << " && MAXLMPDEPTH == " << MAXLMPDEPTH << ", \"tables.cpp is outdated; run make tables\");\n";
+
+    for (int p = 0; p < 2; p++)
+    {
+        os << "\nconst U64 " << (p ? "rookMagics" : "bishopMagics") << "[64] = {";
+        for (int i = 0; i < 64; i++)
+        {
+            snprintf(buf, sizeof(buf), "0x%016llxULL", (p ? mRookTbl[i].magic : mBishopTbl[i].magic));
+            os << (i % 4 ? " " : "\n    ") << buf << (i < 63 ? "," : "\n");
+        }
+        os << "};\n";
+    }
+
+    os << "\nconst int reductiontable[2][MAXDEPTH][64] = {\n";
+    for (int i = 0; i < 2; i++)
+    {
+        os << "  {\n";
+        for (int d = 0; d < MAXDEPTH; d++)
+        {
+            os << "    {";
+            for (int m = 0; m < 64; m++)
+                os << " " << reduction[i][d][m] << (m < 63 ? "," : "");
+            os << " }" << (d < MAXDEPTH - 1 ? ",\n" : "\n");
         }
+        os << "  }" << (i < 1 ? ",\n" : "\n");
     }
-    for (int i = 0; i < numEngines; i++)
+    os << "};\n";
+
+    os << "\nconst int lmptable[2][MAXLMPDEPTH] = {\n";
+    for (int i = 0; i < 2; i++)
     {
-        bSuccess = writetoengine(g_hChildStd_IN_Wr[i], "quit\n");
-        readThread[i]->detach();
-        delete readThread[i];
+        os << "    {";
+        for (int d = 0; d < MAXLMPDEPTH; d++)
+            os << " " << lmp[i][d] << (d < MAXLMPDEPTH - 1 ? "," : "");
+        os << " }" << (i < 1 ? ",\n" : "\n");
     }
+    os << "};\n";
+    os.close();
+
+    initSliderAttacks(cpuHasFastPext());
+    printf("Tables written to %s.\n", filename.c_str());
 }
 
-#endif // _WIN32
 
 
 int main(int argc, char* argv[])
@@ -968,6 +2418,10 @@ int main(int argc, char* argv[])
     bool verbose;
     bool benchmark;
     bool openbench;
+    int benchruns;
+    int benchwarmup;
+    string benchformat;
+    string benchoutfile;
     int depth;
     bool dotests;
     bool enginetest;
@@ -986,6 +2440,21 @@ int main(int argc, char* argv[])
 #endif
     int maxtime;
     int flags;
+    int jobs;
+    int latencythreads;
+    int scalingthreads;
+    bool evalbench;
+    bool lazyevaltest;
+    bool sliderbench;
+    string lazymargins;
+    bool ttstress;
+    bool pagebench;
+    bool cleartest;
+    bool ttbench;
+    int tthash;
+    bool cyclebench;
+    int startupruns;
+    string gentables;
 
     struct arguments {
         const char *cmd;
@@ -998,17 +2467,36 @@ int main(int argc, char* argv[])
         { "-bench", "Do benchmark test for some positions.", &benchmark, 0, NULL },
         { "bench", "Do benchmark with OpenBench compatible output.", &openbench, 0, NULL },
         { "-depth", "Depth for benchmark (0 for per-position-default)", &depth, 1, "0" },
+        { "-runs", "Number of measured benchmark runs (use with -bench)", &benchruns, 1, "1" },
+        { "-warmup", "Number of unmeasured warmup runs before the benchmark (use with -bench)", &benchwarmup, 1, "0" },
+        { "-format", "Benchmark output format text, json or csv (use with -bench)", &benchformat, 2, "text" },
+        { "-outfile", "File for json/csv benchmark output; default is stderr (use with -bench)", &benchoutfile, 2, "" },
         { "-perft", "Do performance and move generator testing.", &perfmaxdepth, 1, "0" },
         { "-dotests","test the hash function and value for positions and mirror (use with -perft)", &dotests, 0, NULL },
         { "-enginetest", "bulk testing of epd files", &enginetest, 0, NULL },
         { "-epdfile", "the epd file to test (use with -enginetest or -bench)", &epdfile, 2, "" },
         { "-logfile", "output file (use with -enginetest)", &logfile, 2, "enginetest.log" },
-        { "-engineprg", "the uci engine to test (use with -enginetest)", &engineprg, 2, "" },
+        { "-engineprg", "the uci engine to test (use with -enginetest or -startuptest)", &engineprg, 2, "" },
         { "-maxtime", "time for each test in seconds (use with -enginetest or -bench)", &maxtime, 1, "0" },
         { "-startnum", "number of the test in epd to start with (use with -enginetest or -bench)", &startnum, 1, "1" },
         { "-compare", "for fast comparision against logfile from other engine (use with -enginetest)", &comparefile, 2, "" },
         { "-flags", "1=skip easy (0 sec.) compares; 2=break 5 seconds after first find; 4=break after compare time is over; 8=eval only (use with -enginetest)", &flags, 1, "0" },
+        { "-jobs", "number of instances of each engine testing different positions concurrently (use with -enginetest)", &jobs, 1, "1" },
         { "-option", "Set UCI option by commandline", NULL, 3, NULL },
+        { "-scaling", "Measure nps and time to depth speedup of the bench for 1..n threads (use with -depth)", &scalingthreads, 1, "0" },
+        { "-evalbench", "Compare speed of handcrafted and NNUE evaluation (use with -depth and NNUE options)", &evalbench, 0, NULL },
+        { "-lazyevaltest", "Measure how often lazy and full evaluation disagree for some margins (use with -margins and -depth)", &lazyevaltest, 0, NULL },
+        { "-margins", "Lazy eval margins separated by *, 0 disables lazy eval (use with -lazyevaltest)", &lazymargins, 2, "0*50*100*150*200*300*400*600" },
+        { "-sliderbench", "Compare speed of the fancy magic and the PEXT slider attacks (use with -depth for perft)", &sliderbench, 0, NULL },
+        { "-latencytest", "Measure latency of 'go' to first info for 1..n threads", &latencythreads, 1, "0" },
+        { "-ttstress", "Stress test the transposition table with concurrent writers", &ttstress, 0, NULL },
+        { "-pagebench", "Compare nps of endgame positions with the hash tables on each page size (use with -depth and Hash option)", &pagebench, 0, NULL },
+        { "-ttbench", "Compare hit rate, cutoff rate and nps of the bench for each hash format and replacement policy (use with -depth and -tthash)", &ttbench, 0, NULL },
+        { "-tthash", "Hash size in MB for -ttbench; must be small compared to the nodes of the bench (1 MB fits the default depth, -depth 8 is too shallow even for that) or every format just hits", &tthash, 1, "1" },
+        { "-cleartest", "Measure ucinewgame to readyok latency with full and lazy hash clearing up to the Hash option", &cleartest, 0, NULL },
+        { "-cyclebench", "Compare speed of linear repetition scan and cuckoo cycle detection", &cyclebench, 0, NULL },
+        { "-startuptest", "Measure time from process start to 'uciok' over n starts (use with -engineprg for other engines)", &startupruns, 1, "0" },
+        { "-gentables", "Write the constant tables to the given source file (normally tables.cpp)", &gentables, 2, "" },
         { "-generate", "Generates epd file with n (default 1000) random endgame positions of the given type; format: egstr/n ", &genepd, 2, "" },
 #ifdef STACKDEBUG
         { "-assertfile", "output assert info to file", &en.assertfile, 2, "" },
@@ -1044,8 +2532,6 @@ int main(int argc, char* argv[])
     registerallevals();
 #endif
 
-    searchinit();
-
     cout.setf(ios_base::unitbuf);
 
     int paramindex = 0;
@@ -1105,13 +2591,47 @@ int main(int argc, char* argv[])
     } else if (benchmark || openbench)
     {
         // benchmark mode
-        doBenchmark(depth, epdfile, maxtime, startnum, openbench);
+        doBenchmark(depth, epdfile, maxtime, startnum, openbench, max(1, benchruns), max(0, benchwarmup), benchformat, benchoutfile);
+    } else if (scalingthreads)
+    {
+        doScalingTest(scalingthreads, depth);
+    } else if (evalbench)
+    {
+        doEvalBenchmark(depth);
+    } else if (lazyevaltest)
+    {
+        doLazyEvalTest(lazymargins, depth);
+    } else if (sliderbench)
+    {
+        doSliderBenchmark(depth);
+    } else if (latencythreads)
+    {
+        doLatencyTest(latencythreads);
+    } else if (ttstress)
+    {
+        doTTStressTest();
+    } else if (pagebench)
+    {
+        doPageBenchmark(depth);
+    } else if (ttbench)
+    {
+        doTTBenchmark(depth, max(1, tthash));
+    } else if (cleartest)
+    {
+        doClearHashTest();
+    } else if (cyclebench)
+    {
+        doCycleBenchmark();
+    } else if (startupruns)
+    {
+        doStartupTest(startupruns, engineprg);
+    } else if (gentables != "")
+    {
+        genTables(gentables);
     } else if (enginetest)
     {
-#ifdef _WIN32
         //engine test mode
-        testengine(epdfile, startnum, engineprg, logfile, comparefile, maxtime, flags);
-#endif
+        testengine(epdfile, startnum, engineprg, logfile, comparefile, maxtime, flags, jobs);
     }
     else if (genepd != "")
     {
@@ -0,0 +1,327 @@
+/*
+  RubiChess is a UCI chess playing engine by Andreas Matthies.
+
+  RubiChess is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  RubiChess is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "RubiChess.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define NNUE_AVX2
+#define NNUEUSEAVX2 true
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define NNUE_SSE2
+#if defined(__GNUC__) && defined(__x86_64__)
+// Builds without -mavx2 get the AVX2 kernels with a target attribute and use them when the cpu supports it
+#include <immintrin.h>
+#define NNUE_AVX2
+#define NNUEAVX2FUNC __attribute__((target("avx2")))
+#define NNUEUSEAVX2 NnueUseAvx2
+static bool NnueUseAvx2 = false;
+#endif
+#endif
+#ifndef NNUEAVX2FUNC
+#define NNUEAVX2FUNC
+#endif
+
+//
+// NNUE evaluation using HalfKP networks in the file format of Stockfish 12
+// Layout: 41024 inputs -> 2 x 256 (accumulator of each side) -> 32 -> 32 -> 1
+//
+#define NNUEVERSION 0x7AF32F16
+#define NNUEINPUTS (64 * 641)
+#define NNUEL1 32
+#define NNUEL2 32
+#define NNUEWEIGHTSCALEBITS 6
+#define NNUEFVSCALE 16
+#define NNUEPAWNVALUE 208   // value of a pawn in the output of the network
+
+bool NnueReady = false;
+
+// Feature transformer; weights of a feature are stored consecutively
+static int16_t *nnueFtBiases = nullptr;
+static int16_t *nnueFtWeights = nullptr;
+
+// The small layers are stored as 16bit weights to use pmaddwd on the 16bit inputs
+static int32_t nnueL1Biases[NNUEL1];
+static int16_t nnueL1Weights[NNUEL1][2 * NNUEHIDDEN];
+static int32_t nnueL2Biases[NNUEL2];
+static int16_t nnueL2Weights[NNUEL2][NNUEL1];
+static int32_t nnueOutBias;
+static int16_t nnueOutWeights[NNUEL2];
+
+
+static bool readInt8Weights(ifstream &is, int16_t *w, int n)
+{
+    vector<int8_t> buf(n);
+    if (!is.read((char*)&buf[0], n))
+        return false;
+    for (int i = 0; i < n; i++)
+        w[i] = buf[i];
+    return true;
+}
+
+bool NnueReadNet(string path)
+{
+    ifstream is(path, ios::binary);
+    if (!is.is_open())
+    {
+        printf("info string NNUE: Cannot open %s.\n", path.c_str());
+        return false;
+    }
+
+    uint32_t version, hash, size;
+    is.read((char*)&version, sizeof(uint32_t));
+    is.read((char*)&hash, sizeof(uint32_t));
+    is.read((char*)&size, sizeof(uint32_t));
+    if (!is || version != NNUEVERSION)
+    {
+        printf("info string NNUE: %s is no HalfKP network.\n", path.c_str());
+        return false;
+    }
+    is.ignore(size);
+
+#if defined(NNUEUSEAVX2) && !defined(__AVX2__)
+    __builtin_cpu_init();
+    NnueUseAvx2 = __builtin_cpu_supports("avx2");
+#endif
+
+    if (!nnueFtWeights)
+    {
+        nnueFtBiases = (int16_t*)allocalign64(NNUEHIDDEN * sizeof(int16_t));
+        nnueFtWeights = (int16_t*)allocalign64((size_t)NNUEINPUTS * NNUEHIDDEN * sizeof(int16_t));
+    }
+
+    // feature transformer
+    is.read((char*)&hash, sizeof(uint32_t));
+    is.read((char*)nnueFtBiases, NNUEHIDDEN * sizeof(int16_t));
+    is.read((char*)nnueFtWeights, (size_t)NNUEINPUTS * NNUEHIDDEN * sizeof(int16_t));
+
+    // hidden and output layers
+    is.read((char*)&hash, sizeof(uint32_t));
+    is.read((char*)nnueL1Biases, sizeof(nnueL1Biases));
+    bool ok = readInt8Weights(is, &nnueL1Weights[0][0], NNUEL1 * 2 * NNUEHIDDEN);
+    is.read((char*)nnueL2Biases, sizeof(nnueL2Biases));
+    ok = ok && readInt8Weights(is, &nnueL2Weights[0][0], NNUEL2 * NNUEL1);
+    is.read((char*)&nnueOutBias, sizeof(int32_t));
+    ok = ok && readInt8Weights(is, nnueOutWeights, NNUEL2);
+
+    if (!ok || !is || is.peek() != EOF)
+    {
+        printf("info string NNUE: %s has wrong size.\n", path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+
+// HalfKP feature: square and type of a non-king piece relative to the king of perspective c; black sees the board rotated
+inline int NnueFeature(int c, int ksq, int sq, PieceCode p)
+{
+    int o = c * 63;
+    int pieceindex = ((p >> 1) - 1) * 2 + ((int)(p & S2MMASK) != c);
+    return 641 * (ksq ^ o) + 1 + pieceindex * 64 + (sq ^ o);
+}
+
+const char *NnueSimdName()
+{
+#ifdef NNUEUSEAVX2
+    if (NNUEUSEAVX2)
+        return "AVX2";
+#endif
+#ifdef NNUE_SSE2
+    return "SSE2";
+#else
+    return "scalar";
+#endif
+}
+
+#ifdef NNUE_AVX2
+NNUEAVX2FUNC inline void NnueAddWeightsAvx2(int16_t *acc, const int16_t *w)
+{
+    for (int j = 0; j < NNUEHIDDEN; j += 16)
+        _mm256_storeu_si256((__m256i*)(acc + j), _mm256_add_epi16(_mm256_loadu_si256((__m256i*)(acc + j)), _mm256_loadu_si256((__m256i*)(w + j))));
+}
+
+NNUEAVX2FUNC inline void NnueSubWeightsAvx2(int16_t *acc, const int16_t *w)
+{
+    for (int j = 0; j < NNUEHIDDEN; j += 16)
+        _mm256_storeu_si256((__m256i*)(acc + j), _mm256_sub_epi16(_mm256_loadu_si256((__m256i*)(acc + j)), _mm256_loadu_si256((__m256i*)(w + j))));
+}
+
+NNUEAVX2FUNC inline void NnueClampAvx2(int16_t *in, const int16_t *acc)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i maxval = _mm256_set1_epi16(127);
+    for (int j = 0; j < NNUEHIDDEN; j += 16)
+        _mm256_storeu_si256((__m256i*)(in + j), _mm256_max_epi16(zero, _mm256_min_epi16(maxval, _mm256_loadu_si256((__m256i*)(acc + j)))));
+}
+
+NNUEAVX2FUNC inline int32_t NnueDotAvx2(const int16_t *a, const int16_t *b, int n)
+{
+    __m256i sum = _mm256_setzero_si256();
+    for (int j = 0; j < n; j += 16)
+        sum = _mm256_add_epi32(sum, _mm256_madd_epi16(_mm256_loadu_si256((__m256i*)(a + j)), _mm256_loadu_si256((__m256i*)(b + j))));
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4e));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xb1));
+    return _mm_cvtsi128_si32(s);
+}
+#endif
+
+inline void NnueAddWeights(int16_t *acc, int feature)
+{
+    const int16_t *w = nnueFtWeights + (size_t)feature * NNUEHIDDEN;
+#ifdef NNUEUSEAVX2
+    if (NNUEUSEAVX2)
+        return NnueAddWeightsAvx2(acc, w);
+#endif
+#if defined(NNUE_SSE2)
+    for (int j = 0; j < NNUEHIDDEN; j += 8)
+        _mm_storeu_si128((__m128i*)(acc + j), _mm_add_epi16(_mm_loadu_si128((__m128i*)(acc + j)), _mm_loadu_si128((__m128i*)(w + j))));
+#else
+    for (int j = 0; j < NNUEHIDDEN; j++)
+        acc[j] += w[j];
+#endif
+}
+
+inline void NnueSubWeights(int16_t *acc, int feature)
+{
+    const int16_t *w = nnueFtWeights + (size_t)feature * NNUEHIDDEN;
+#ifdef NNUEUSEAVX2
+    if (NNUEUSEAVX2)
+        return NnueSubWeightsAvx2(acc, w);
+#endif
+#if defined(NNUE_SSE2)
+    for (int j = 0; j < NNUEHIDDEN; j += 8)
+        _mm_storeu_si128((__m128i*)(acc + j), _mm_sub_epi16(_mm_loadu_si128((__m128i*)(acc + j)), _mm_loadu_si128((__m128i*)(w + j))));
+#else
+    for (int j = 0; j < NNUEHIDDEN; j++)
+        acc[j] -= w[j];
+#endif
+}
+
+// dot product of n (multiple of 16) 16bit values
+inline int32_t NnueDot(const int16_t *a, const int16_t *b, int n)
+{
+#ifdef NNUEUSEAVX2
+    if (NNUEUSEAVX2)
+        return NnueDotAvx2(a, b, n);
+#endif
+#if defined(NNUE_SSE2)
+    __m128i sum = _mm_setzero_si128();
+    for (int j = 0; j < n; j += 8)
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(_mm_loadu_si128((__m128i*)(a + j)), _mm_loadu_si128((__m128i*)(b + j))));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4e));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb1));
+    return _mm_cvtsi128_si32(sum);
+#else
+    int32_t sum = 0;
+    for (int j = 0; j < n; j++)
+        sum += a[j] * b[j];
+    return sum;
+#endif
+}
+
+
+HOTFUNC void chessposition::NnueRefresh(int c)
+{
+    int ksq = kingpos[c];
+    int16_t *acc = nnueaccumulator[c];
+    memcpy(acc, nnueFtBiases, NNUEHIDDEN * sizeof(int16_t));
+    for (PieceCode p = WPAWN; p <= BQUEEN; p++)
+    {
+        U64 bb = piece00[p];
+        while (bb)
+        {
+            int sq = pullLsb(&bb);
+            NnueAddWeights(acc, NnueFeature(c, ksq, sq, p));
+        }
+    }
+    nnueksq[c] = ksq;
+}
+
+// Incremental update of both accumulators; called from the Bitboard functions next to the psqval update
+HOTFUNC void chessposition::NnueUpdateHot(int from, int to, PieceCode p)
+{
+    if ((p >> 1) == KING)
+        return;
+    for (int c = WHITE; c <= BLACK; c++)
+    {
+        int ksq = nnueksq[c];
+        if (ksq < 0)
+            continue;
+        if (from >= 0)
+            NnueSubWeights(nnueaccumulator[c], NnueFeature(c, ksq, from, p));
+        if (to >= 0)
+            NnueAddWeights(nnueaccumulator[c], NnueFeature(c, ksq, to, p));
+    }
+}
+
+void chessposition::NnueUpdate(int from, int to, PieceCode p)
+{
+    NnueUpdateHot(from, to, p);
+}
+
+// Returns the score from the view of the side to move
+HOTFUNC int chessposition::NnueGetEvalHot()
+{
+    // The accumulator of a side has to be rebuilt after its king moved
+    for (int c = WHITE; c <= BLACK; c++)
+        if (nnueksq[c] != kingpos[c])
+            NnueRefresh(c);
+
+    int16_t input[2 * NNUEHIDDEN];
+    int16_t hidden1[NNUEL1];
+    int16_t hidden2[NNUEL2];
+    int stm = state & S2MMASK;
+
+    for (int p = 0; p < 2; p++)
+    {
+        const int16_t *acc = nnueaccumulator[stm ^ p];
+        int16_t *in = input + p * NNUEHIDDEN;
+#ifdef NNUEUSEAVX2
+        if (NNUEUSEAVX2)
+        {
+            NnueClampAvx2(in, acc);
+            continue;
+        }
+#endif
+#if defined(NNUE_SSE2)
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i maxval = _mm_set1_epi16(127);
+        for (int j = 0; j < NNUEHIDDEN; j += 8)
+            _mm_storeu_si128((__m128i*)(in + j), _mm_max_epi16(zero, _mm_min_epi16(maxval, _mm_loadu_si128((__m128i*)(acc + j)))));
+#else
+        for (int j = 0; j < NNUEHIDDEN; j++)
+            in[j] = max<int16_t>(0, min<int16_t>(127, acc[j]));
+#endif
+    }
+    for (int i = 0; i < NNUEL1; i++)
+        hidden1[i] = (int16_t)max(0, min(127, (nnueL1Biases[i] + NnueDot(input, nnueL1Weights[i], 2 * NNUEHIDDEN)) >> NNUEWEIGHTSCALEBITS));
+    for (int i = 0; i < NNUEL2; i++)
+        hidden2[i] = (int16_t)max(0, min(127, (nnueL2Biases[i] + NnueDot(hidden1, nnueL2Weights[i], NNUEL1)) >> NNUEWEIGHTSCALEBITS));
+    int32_t out = nnueOutBias + NnueDot(hidden2, nnueOutWeights, NNUEL2);
+
+    return out / NNUEFVSCALE * 100 / NNUEPAWNVALUE;
+}
+
+int chessposition::NnueGetEval()
+{
+    return NnueGetEvalHot();
+}
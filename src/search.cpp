@@ -18,37 +18,35 @@
 
 #include "RubiChess.h"
 
-#ifdef STATISTICS
-statistic statistics;
-#endif
-
 const int deltapruningmargin = 100;
 
-int reductiontable[2][MAXDEPTH][64];
-
-#define MAXLMPDEPTH 9
-int lmptable[2][MAXLMPDEPTH];
-
 // Shameless copy of Ethereal/Laser for now; may be improved/changed in the future
 static const int SkipSize[16] = { 1, 1, 1, 2, 2, 2, 1, 3, 2, 2, 1, 3, 3, 2, 2, 1 };
 static const int SkipDepths[16] = { 1, 2, 2, 4, 4, 3, 2, 5, 4, 3, 2, 6, 5, 4, 3, 2 };
 
-void searchinit()
+// Formulas of the reduction and lmp tables; only used by the generator of tables.cpp
+void calcSearchTables(int reduction[2][MAXDEPTH][64], int lmp[2][MAXLMPDEPTH])
 {
     for (int d = 0; d < MAXDEPTH; d++)
         for (int m = 0; m < 64; m++)
         {
+            // depth 0 and move 0 are never looked up and would need log(0)
+            if (!d || !m)
+            {
+                reduction[0][d][m] = reduction[1][d][m] = 0;
+                continue;
+            }
             // reduction for not improving positions
-            reductiontable[0][d][m] = 1 + (int)round(log(d * 1.5) * log(m) * 0.60);
+            reduction[0][d][m] = 1 + (int)round(log(d * 1.5) * log(m) * 0.60);
             // reduction for improving positions
-            reductiontable[1][d][m] = (int)round(log(d * 1.5) * log(m * 2) * 0.43);
+            reduction[1][d][m] = (int)round(log(d * 1.5) * log(m * 2) * 0.43);
         }
     for (int d = 0; d < MAXLMPDEPTH; d++)
     {
         // lmp for not improving positions
-        lmptable[0][d] = (int)(2.5 + 0.7 * round(pow(d, 1.85)));
+        lmp[0][d] = (int)(2.5 + 0.7 * round(pow(d, 1.85)));
         // lmp for improving positions
-        lmptable[1][d] = (int)(4.0 + 1.3 * round(pow(d, 1.85)));
+        lmp[1][d] = (int)(4.0 + 1.3 * round(pow(d, 1.85)));
     }
 }
 
@@ -96,7 +94,7 @@ inline void chessposition::updateHistory(uint32_t code, int16_t **cmptr, int val
 }
 
 
-int chessposition::getQuiescence(int alpha, int beta, int depth)
+HOTFUNC int chessposition::getQuiescenceHot(int alpha, int beta, int depth)
 {
     int score;
     int bestscore = SHRT_MIN;
@@ -134,33 +132,45 @@ int chessposition::getQuiescence(int alpha, int beta, int depth)
     int hashscore = NOSCORE;
     uint16_t hashmovecode = 0;
     int staticeval = NOSCORE;
-    bool tpHit = tp.probeHash(hash, &hashscore, &staticeval, &hashmovecode, depth, alpha, beta, ply);
+    bool tpFound = false;
+    bool tpHit = tp.probeHash(hash, &hashscore, &staticeval, &hashmovecode, depth, alpha, beta, ply, &tpFound);
+    STATISTICSINC(tt_probe);
+    STATISTICSADD(tt_hit, tpFound);
     if (tpHit)
     {
         STATISTICSINC(qs_tt);
         return hashscore;
     }
 
+    int ttstaticeval = staticeval;
     if (!myIsCheck)
     {
 #ifdef EVALTUNE
-        staticeval = S2MSIGN(state & S2MMASK) * getEval<NOTRACE>();
+        staticeval = ttstaticeval = S2MSIGN(state & S2MMASK) * getEval<NOTRACE>();
 #else
         // get static evaluation of the position
+        bool lazystaticeval = false;
         if (staticeval == NOSCORE)
         {
             if (movestack[mstop - 1].movecode == 0)
                 staticeval = -staticevalstack[mstop - 1] + CEVAL(eps.eTempo, 2);
             else
-                staticeval = S2MSIGN(state & S2MMASK) * getEval<NOTRACE>();
+            {
+                staticeval = S2MSIGN(state & S2MMASK) * getCachedEval(alpha, beta);
+                lazystaticeval = lazyeval;
+                if (lazystaticeval)
+                    STATISTICSINC(qs_lazy);
+            }
         }
+        // a lazy eval is only good for this window and is not stored in the TT
+        ttstaticeval = (lazystaticeval ? NOSCORE : staticeval);
 #endif
 
         bestscore = staticeval;
         if (staticeval >= beta)
         {
             STATISTICSINC(qs_pat);
-            tp.addHash(hash, staticeval, staticeval, HASHBETA, 0, 0);
+            tp.addHash(hash, staticeval, ttstaticeval, HASHBETA, 0, 0);
 
             return staticeval;
         }
@@ -178,7 +188,7 @@ int chessposition::getQuiescence(int alpha, int beta, int depth)
         if (bestExpectableScore < alpha)
         {
             STATISTICSINC(qs_delta);
-            tp.addHash(hash, bestExpectableScore, staticeval, HASHALPHA, 0, 0);
+            tp.addHash(hash, bestExpectableScore, ttstaticeval, HASHALPHA, 0, 0);
             return staticeval;
         }
     }
@@ -207,7 +217,7 @@ int chessposition::getQuiescence(int alpha, int beta, int depth)
 
         STATISTICSINC(qs_moves);
         ms.legalmovenum++;
-        score = -getQuiescence(-beta, -alpha, depth - 1);
+        score = -getQuiescenceHot(-beta, -alpha, depth - 1);
         unplayMove(m);
         if (score > bestscore)
         {
@@ -216,7 +226,7 @@ int chessposition::getQuiescence(int alpha, int beta, int depth)
             if (score >= beta)
             {
                 STATISTICSINC(qs_moves_fh);
-                tp.addHash(hash, score, staticeval, HASHBETA, 0, (uint16_t)bestcode);
+                tp.addHash(hash, score, ttstaticeval, HASHBETA, 0, (uint16_t)bestcode);
                 return score;
             }
             if (score > alpha)
@@ -240,13 +250,18 @@ int chessposition::getQuiescence(int alpha, int beta, int depth)
         // It's a mate
         return SCOREBLACKWINS + ply;
 
-    tp.addHash(hash, alpha, staticeval, eval_type, 0, (uint16_t)bestcode);
+    tp.addHash(hash, alpha, ttstaticeval, eval_type, 0, (uint16_t)bestcode);
     return bestscore;
 }
 
+int chessposition::getQuiescence(int alpha, int beta, int depth)
+{
+    return getQuiescenceHot(alpha, beta, depth);
+}
+
 
 
-int chessposition::alphabeta(int alpha, int beta, int depth)
+HOTFUNC int chessposition::alphabeta(int alpha, int beta, int depth)
 {
     int score;
     int hashscore = NOSCORE;
@@ -300,6 +315,17 @@ int chessposition::alphabeta(int alpha, int beta, int depth)
         return beta;
     }
 
+    // test for upcoming repetition; we can force the draw so raise alpha
+    if (alpha < SCOREDRAW && hasGameCycle())
+    {
+        alpha = SCOREDRAW;
+        if (alpha >= beta)
+        {
+            STATISTICSINC(ab_draw_or_win);
+            return alpha;
+        }
+    }
+
     // Reached depth? Do a qsearch
     if (depth <= 0)
     {
@@ -308,7 +334,7 @@ int chessposition::alphabeta(int alpha, int beta, int depth)
             seldepth = ply + 1;
 
         STATISTICSINC(ab_qs);
-        return getQuiescence(alpha, beta, depth);
+        return getQuiescenceHot(alpha, beta, depth);
     }
 
 
@@ -324,7 +350,10 @@ int chessposition::alphabeta(int alpha, int beta, int depth)
     SDEBUGDO(isDebugPv, pvaborttype[ply + 1] = PVA_UNKNOWN; pvdepth[ply] = depth; pvmovenum[ply] = 0;);
 #endif
 
-    bool tpHit = tp.probeHash(newhash, &hashscore, &staticeval, &hashmovecode, depth, alpha, beta, ply);
+    bool tpFound = false;
+    bool tpHit = tp.probeHash(newhash, &hashscore, &staticeval, &hashmovecode, depth, alpha, beta, ply, &tpFound);
+    STATISTICSINC(tt_probe);
+    STATISTICSADD(tt_hit, tpFound);
     if (tpHit)
     {
         if (!rep)
@@ -390,7 +419,7 @@ int chessposition::alphabeta(int alpha, int beta, int depth)
             // just reverse the staticeval before the null move respecting the tempo
             staticeval = -staticevalstack[mstop - 1] + CEVAL(eps.eTempo, 2);
         else
-            staticeval = S2MSIGN(state & S2MMASK) * getEval<NOTRACE>();
+            staticeval = S2MSIGN(state & S2MMASK) * getCachedEval();
     }
     staticevalstack[mstop] = staticeval;
 
@@ -406,11 +435,11 @@ int chessposition::alphabeta(int alpha, int beta, int depth)
             int qscore;
             if (depth == 1 && ralpha < alpha)
             {
-                qscore = getQuiescence(alpha, beta, depth);
+                qscore = getQuiescenceHot(alpha, beta, depth);
                 SDEBUGDO(isDebugPv, pvabortval[ply] = qscore; pvaborttype[ply] = PVA_RAZORPRUNED;);
                 return qscore;
             }
-            qscore = getQuiescence(ralpha, ralpha + 1, depth);
+            qscore = getQuiescenceHot(ralpha, ralpha + 1, depth);
             if (qscore <= ralpha)
             {
                 SDEBUGDO(isDebugPv, pvabortval[ply] = qscore; pvaborttype[ply] = PVA_RAZORPRUNED;);
@@ -625,12 +654,10 @@ int chessposition::alphabeta(int alpha, int beta, int depth)
             STATISTICSADD(red_lmr[positionImproved], reductiontable[positionImproved][depth][min(63, legalMoves + 1)]);
             STATISTICSADD(red_history, -stats / 4096);
             STATISTICSADD(red_pv, -(int)PVNode);
-            STATISTICSDO(int red0 = reduction);
+            STATISTICSADD(red_correction, min(depth, max(0, reduction)) - reduction);
 
             reduction = min(depth, max(0, reduction));
 
-            STATISTICSDO(int red1 = reduction);
-            STATISTICSADD(red_correction, red1 - red0);
             STATISTICSADD(red_total, reduction);
         }
 
@@ -672,6 +699,7 @@ int chessposition::alphabeta(int alpha, int beta, int depth)
             if (score > alpha)
             {
                 // research without reduction
+                STATISTICSINC(red_research);
                 effectiveDepth += reduction;
                 score = -alphabeta(-alpha - 1, -alpha, effectiveDepth - 1);
             }
@@ -1063,6 +1091,8 @@ static void uciScore(searchthread *thr, int inWindow, U64 nowtime, int score, in
             en.tbhits, tp.getUsedinPermill(), pvstring.c_str());
     }
     cout << s;
+    if (!en.firstinfotime)
+        en.firstinfotime = nowtime;
 #ifdef SDEBUG
     pos->pvdebugout();
 #endif
@@ -1089,6 +1119,7 @@ static void search_gen1(searchthread *thr)
     const bool isMainThread = (thr->index == 0);
 
     chessposition *pos = &thr->pos;
+    pos->allocPlyBuffers(en.MultiPV);
 
     if (en.mate > 0)  // FIXME: Not tested for a long time.
     {
@@ -1380,9 +1411,12 @@ static void search_gen1(searchthread *thr)
         // Remember depth for benchmark output
         en.benchdepth = thr->depth - 1;
 
-#ifdef STATISTICS
-        search_statistics();
-#endif
+        if (en.searchstatistics)
+        {
+            statistic st;
+            en.getStatistics(&st);
+            search_statistics(&st);
+        }
     }
 }
 
@@ -1457,18 +1491,21 @@ void searchStart()
     en.moveoutput = false;
     en.tbhits = en.sthread[0].pos.tbPosition;  // Rootpos in TB => report at least one tbhit
 
+    // the background zeroing of a lazy clean only runs while the engine is idle
+    tp.stopBackgroundClean();
+
     // increment generation counter for tt aging
     tp.nextSearch();
 
+    en.firstinfotime = 0;
+    en.statisticstime = en.starttime;
+
     if (en.MultiPV == 1 && !en.ponder)
-        for (int tnum = 0; tnum < en.Threads; tnum++)
-            en.sthread[tnum].thr = thread(&search_gen1<SinglePVSearch>, &en.sthread[tnum]);
+        en.startThreads(&search_gen1<SinglePVSearch>);
     else if (en.ponder)
-        for (int tnum = 0; tnum < en.Threads; tnum++)
-            en.sthread[tnum].thr = thread(&search_gen1<PonderSearch>, &en.sthread[tnum]);
+        en.startThreads(&search_gen1<PonderSearch>);
     else
-        for (int tnum = 0; tnum < en.Threads; tnum++)
-            en.sthread[tnum].thr = thread(&search_gen1<MultiPVSearch>, &en.sthread[tnum]);
+        en.startThreads(&search_gen1<MultiPVSearch>);
 }
 
 
@@ -1480,9 +1517,7 @@ void searchWaitStop(bool forceStop)
     // Make the other threads stop now
     if (forceStop)
         en.stopLevel = ENGINESTOPIMMEDIATELY;
-    for (int tnum = 0; tnum < en.Threads; tnum++)
-        if (en.sthread[tnum].thr.joinable())
-            en.sthread[tnum].thr.join();
+    en.waitThreads();
     en.stopLevel = ENGINETERMINATEDSEARCH;
 }
 
@@ -1492,6 +1527,19 @@ inline void chessposition::CheckForImmediateStop()
     if (threadindex || (nodes & NODESPERCHECK))
         return;
 
+    // Periodic statistics output; checked here as a deep iteration takes much longer than the interval
+    if (en.searchstatistics && en.statisticsinterval)
+    {
+        U64 now = getTime();
+        if (now - en.statisticstime >= en.statisticsinterval * en.frequency)
+        {
+            statistic st;
+            en.getStatistics(&st);
+            search_statistics(&st);
+            en.statisticstime = now;
+        }
+    }
+
     if (en.isPondering())
         // pondering... just continue searching
         return;
@@ -1521,74 +1569,86 @@ inline void chessposition::CheckForImmediateStop()
 
 
 
-#ifdef STATISTICS
-void search_statistics()
+void search_statistics(statistic *st)
 {
     U64 n, i1, i2, i3;
     double f0, f1, f2, f3, f4, f5, f6, f7, f10, f11;
 
-    printf("(ST)====Statistics====================================================================================================================================\n");
+    printf("info string ====Statistics===================================================================================================================================\n");
 
     // quiescense search statistics
-    i1 = statistics.qs_n[0];
-    i2 = statistics.qs_n[1];
+    i1 = st->qs_n[0];
+    i2 = st->qs_n[1];
     n = i1 + i2;
     f0 = 100.0 * i2 / (double)n;
-    f1 = 100.0 * statistics.qs_tt / (double)n;
-    f2 = 100.0 * statistics.qs_pat / (double)n;
-    f3 = 100.0 * statistics.qs_delta / (double)n;
-    i3 = statistics.qs_move_delta + statistics.qs_moves;
-    f4 =  i3 / (double)statistics.qs_loop_n;
-    f5 = 100.0 * statistics.qs_move_delta / (double)i3;
-    f6 = 100.0 * statistics.qs_moves_fh / (double)statistics.qs_moves;
-    printf("(ST) QSearch: %12lld   %%InCheck:  %5.2f   %%TT-Hits:  %5.2f   %%Std.Pat: %5.2f   %%DeltaPr: %5.2f   Mvs/Lp: %5.2f   %%DlPrM: %5.2f   %%FailHi: %5.2f\n", n, f0, f1, f2, f3, f4, f5, f6);
+    f1 = 100.0 * st->qs_tt / (double)n;
+    f2 = 100.0 * st->qs_pat / (double)n;
+    f3 = 100.0 * st->qs_delta / (double)n;
+    i3 = st->qs_move_delta + st->qs_moves;
+    f4 =  i3 / (double)st->qs_loop_n;
+    f5 = 100.0 * st->qs_move_delta / (double)i3;
+    f6 = 100.0 * st->qs_moves_fh / (double)st->qs_moves;
+    f7 = 100.0 * st->qs_lazy / (double)n;
+    printf("info string QSearch: %12lld   %%InCheck:  %5.2f   %%TT-Hits:  %5.2f   %%Std.Pat: %5.2f   %%DeltaPr: %5.2f   Mvs/Lp: %5.2f   %%DlPrM: %5.2f   %%FailHi: %5.2f   %%LazyEv: %5.2f\n", n, f0, f1, f2, f3, f4, f5, f6, f7);
+
+    // static evaluation and eval cache
+    n = st->eval_n;
+    f0 = 100.0 * st->eval_cache_hit / (double)n;
+    f1 = 100.0 * st->eval_pawn_hit / (double)st->eval_pawn_n;
+    printf("info string Eval:    %12lld   %%CacheHit: %5.2f   %%PawnHit:  %5.2f\n", n, f0, f1);
+
+    // transposition table
+    n = st->tt_probe;
+    f0 = 100.0 * st->tt_hit / (double)n;
+    f1 = 100.0 * (st->qs_tt + st->ab_tt) / (double)n;
+    printf("info string TT:      %12lld   %%Hits:     %5.2f   %%Cutoffs:  %5.2f\n", n, f0, f1);
 
     // general aplhabeta statistics
-    n = statistics.ab_n;
-    f0 = 100.0 * statistics.ab_pv / (double)n;
-    f1 = 100.0 * statistics.ab_tt / (double)n;
-    f2 = 100.0 * statistics.ab_tb / (double)n;
-    f3 = 100.0 * statistics.ab_qs / (double)n;
-    f4 = 100.0 * statistics.ab_draw_or_win / (double)n;
-    printf("(ST) Total AB:%12lld   %%PV-Nodes: %5.2f   %%TT-Hits:  %5.2f   %%TB-Hits: %5.2f   %%QSCalls: %5.2f   %%Draw/Mates: %5.2f\n", n, f0, f1, f2, f3, f4);
+    n = st->ab_n;
+    f0 = 100.0 * st->ab_pv / (double)n;
+    f1 = 100.0 * st->ab_tt / (double)n;
+    f2 = 100.0 * st->ab_tb / (double)n;
+    f3 = 100.0 * st->ab_qs / (double)n;
+    f4 = 100.0 * st->ab_draw_or_win / (double)n;
+    printf("info string Total AB:%12lld   %%PV-Nodes: %5.2f   %%TT-Hits:  %5.2f   %%TB-Hits: %5.2f   %%QSCalls: %5.2f   %%Draw/Mates: %5.2f\n", n, f0, f1, f2, f3, f4);
 
     // node pruning
-    f0 = 100.0 * statistics.prune_futility / (double)n;
-    f1 = 100.0 * statistics.prune_nm / (double)n;
-    f2 = 100.0 * statistics.prune_probcut / (double)n;
-    f3 = 100.0 * statistics.prune_multicut / (double)n;
-    f4 = 100.0 * (statistics.prune_futility + statistics.prune_nm + statistics.prune_probcut + statistics.prune_multicut) / (double)n;
-    printf("(ST) Node pruning            %%Futility: %5.2f   %%NullMove: %5.2f   %%ProbeC.: %5.2f   %%MultiC.: %7.5f Total:  %5.2f\n", f0, f1, f2, f3, f4);
+    f0 = 100.0 * st->prune_futility / (double)n;
+    f1 = 100.0 * st->prune_nm / (double)n;
+    f2 = 100.0 * st->prune_probcut / (double)n;
+    f3 = 100.0 * st->prune_multicut / (double)n;
+    f4 = 100.0 * (st->prune_futility + st->prune_nm + st->prune_probcut + st->prune_multicut) / (double)n;
+    printf("info string Node pruning            %%Futility: %5.2f   %%NullMove: %5.2f   %%ProbeC.: %5.2f   %%MultiC.: %7.5f Total:  %5.2f\n", f0, f1, f2, f3, f4);
 
     // move statistics
-    i1 = statistics.moves_n[0]; // quiet moves
-    i2 = statistics.moves_n[1]; // tactical moves
+    i1 = st->moves_n[0]; // quiet moves
+    i2 = st->moves_n[1]; // tactical moves
     n = i1 + i2;
     f0 = 100.0 * i1 / (double)n;
     f1 = 100.0 * i2 / (double)n;
-    f2 = 100.0 * statistics.moves_pruned_lmp / (double)n;
-    f3 = 100.0 * statistics.moves_pruned_futility / (double)n;
-    f4 = 100.0 * statistics.moves_pruned_badsee / (double)n;
-    f5 = n / (double)statistics.moves_loop_n;
-    i3 = statistics.moves_played[0] + statistics.moves_played[1];
-    f6 = 100.0 * statistics.moves_fail_high / (double)i3;
-    f7 = 100.0 * statistics.moves_bad_hash / i2;
-    printf("(ST) Moves:   %12lld   %%Quiet-M.: %5.2f   %%Tact.-M.: %5.2f   %%BadHshM: %5.2f   %%LMP-M.:  %5.2f   %%FutilM.: %5.2f   %%BadSEE: %5.2f  Mvs/Lp: %5.2f   %%FailHi: %5.2f\n", n, f0, f1, f7, f2, f3, f4, f5, f6);
+    f2 = 100.0 * st->moves_pruned_lmp / (double)n;
+    f3 = 100.0 * st->moves_pruned_futility / (double)n;
+    f4 = 100.0 * st->moves_pruned_badsee / (double)n;
+    f5 = n / (double)st->moves_loop_n;
+    i3 = st->moves_played[0] + st->moves_played[1];
+    f6 = 100.0 * st->moves_fail_high / (double)i3;
+    f7 = 100.0 * st->moves_bad_hash / i2;
+    printf("info string Moves:   %12lld   %%Quiet-M.: %5.2f   %%Tact.-M.: %5.2f   %%BadHshM: %5.2f   %%LMP-M.:  %5.2f   %%FutilM.: %5.2f   %%BadSEE: %5.2f  Mvs/Lp: %5.2f   %%FailHi: %5.2f\n", n, f0, f1, f7, f2, f3, f4, f5, f6);
 
     // late move reduction statistics
-    U64 red_n = statistics.red_pi[0] + statistics.red_pi[1];
-    f10 = statistics.red_lmr[0] / (double)statistics.red_pi[0];
-    f11 = statistics.red_lmr[1] / (double)statistics.red_pi[1];
-    f1 = (statistics.red_lmr[0] + statistics.red_lmr[1]) / (double)red_n;
-    f2 = statistics.red_history / (double)red_n;
-    f3 = statistics.red_pv / (double)red_n;
-    f4 = statistics.red_correction / (double)red_n;
-    f5 = statistics.red_total / (double)red_n;
-    printf("(ST) Reduct.  %12lld   lmr[0]: %4.2f   lmr[1]: %4.2f   lmr: %4.2f   hist: %4.2f   pv: %4.2f   corr: %4.2f   total: %4.2f\n", red_n, f10, f11, f1, f2, f3, f4, f5);
-
-    f0 = 100.0 * statistics.extend_singular / (double)n;
-    printf("(ST) Extensions: %%singular: %7.4f\n", f0);
-
-    printf("(ST)==================================================================================================================================================\n");
+    U64 red_n = st->red_pi[0] + st->red_pi[1];
+    f10 = st->red_lmr[0] / (double)st->red_pi[0];
+    f11 = st->red_lmr[1] / (double)st->red_pi[1];
+    f1 = (st->red_lmr[0] + st->red_lmr[1]) / (double)red_n;
+    f2 = st->red_history / (double)red_n;
+    f3 = st->red_pv / (double)red_n;
+    f4 = st->red_correction / (double)red_n;
+    f5 = st->red_total / (double)red_n;
+    f6 = 100.0 * st->red_research / (double)red_n;
+    printf("info string Reduct.  %12lld   lmr[0]: %4.2f   lmr[1]: %4.2f   lmr: %4.2f   hist: %4.2f   pv: %4.2f   corr: %4.2f   total: %4.2f   %%research: %5.2f\n", red_n, f10, f11, f1, f2, f3, f4, f5, f6);
+
+    f0 = 100.0 * st->extend_singular / (double)n;
+    printf("info string Extensions: %%singular: %7.4f\n", f0);
+
+    printf("info string =================================================================================================================================================\n");
 }
-#endif
\ No newline at end of file
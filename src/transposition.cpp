@@ -17,12 +17,116 @@
 
 
 #include "RubiChess.h"
+#include <errno.h>
+
+#ifndef _WIN32
+#include <sys/mman.h> // mmap of the hash file
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define TTFILEMAP
+#endif
+
+
+// A hash file starts with a page holding the header followed by the table
+#define TTFILEHEADERSIZE 4096
+#define TTFILEMAGIC 0x0004545469627552ULL  // "RubiTT" and format version 4
+
+struct ttfileheader
+{
+    U64 magic;
+    U64 zobristcheck;   // the entries are only valid for the same hash keys
+    U64 clustersize;
+    U64 size;           // number of clusters
+    int32_t numOfSearchShiftTwo;
+    uint32_t epoch;
+    int32_t format;     // cluster format of the table
+};
+
+// Header of a table in shared memory. Every attached process holds a write lock on one byte of the
+// slot range at the start of the segment. The locks vanish with their process, so the segment knows
+// the living processes even after crashes: without lock holders it is free to be rebuilt or removed.
+struct ttshmheader
+{
+    ttfileheader h;
+    atomic<int> age;        // numOfSearchShiftTwo of the last search started by any process
+};
+
+static_assert(sizeof(ttshmheader) <= TTFILEHEADERSIZE, "ttshmheader doesn't fit into the header page");
+
+#ifdef TTFILEMAP
+#define SHMSLOTS 64         // maximum number of processes attached; the byte after the slots is the gate for builder waiters
 
-#if defined(__linux__) && !defined(__ANDROID__)
-static const size_t HashAlignBytes = 2ull << 20;
-#include <sys/mman.h> // madvise
+// Locks len bytes from start of the segment; len 0 means up to the end
+static bool lockShm(int fd, short type, off_t start, off_t len, bool wait)
+{
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = start;
+    fl.l_len = len;
+    return !fcntl(fd, wait ? F_SETLKW : F_SETLK, &fl);
+}
+
+// Counts the slots locked by other processes; F_GETLK doesn't report the own one
+static int attachedProcesses(int fd)
+{
+    int n = 1;
+    for (int i = 0; i < SHMSLOTS; i++)
+    {
+        struct flock fl;
+        memset(&fl, 0, sizeof(fl));
+        fl.l_type = F_WRLCK;
+        fl.l_whence = SEEK_SET;
+        fl.l_start = i;
+        fl.l_len = 1;
+        if (!fcntl(fd, F_GETLK, &fl) && fl.l_type != F_UNLCK)
+            n++;
+    }
+    return n;
+}
 #endif
 
+static U64 zobristCheck()
+{
+    U64 h = zb.s2m;
+    for (int i = 0; i < 64 * 16; i++)
+        h = rot(h, 7) ^ zb.boardtable[i];
+    return h;
+}
+
+static int ttClusterShift(int format)
+{
+    return (format == TTFORMAT3X10 || format == TTFORMAT4X8 ? 5 : 6);
+}
+
+uint16_t ttclusterpacked::get(int i, transpositionentry *e)
+{
+    U64 d = data[i];
+    e->movecode = (uint16_t)d;
+    e->value = (int16_t)(d >> 16);
+    e->staticeval = NOSCORE;
+    e->depth = (uint8_t)(d >> 32);
+    e->boundAndAge = (uint8_t)(d >> 40);
+    return (uint16_t)(d >> 48);
+}
+
+void ttclusterpacked::set(int i, uint16_t k, transpositionentry *e)
+{
+    data[i] = (U64)e->movecode | (U64)(uint16_t)e->value << 16 | (U64)e->depth << 32 | (U64)e->boundAndAge << 40 | (U64)k << 48;
+}
+
+// Rating of the entries for replacement; the entry with the lowest rating is replaced
+struct ttReplaceDepthAge {
+    static int rating(transpositionentry *e, int age) { return e->depth - ((259 + age - e->boundAndAge) & 0xfc) * 2; }
+};
+
+struct ttReplaceAgeDepth {
+    static int rating(transpositionentry *e, int age) { return e->depth - ((259 + age - e->boundAndAge) & 0xfc) * 256; }
+};
+
+
 /* A small noncryptographic PRNG */
 /* http://www.burtleburtle.net/bob/rand/smallprng.html */
 
@@ -149,139 +253,584 @@ u8 zobrist::getMaterialHash(chessposition *pos)
 
 transposition::~transposition()
 {
-    if (size > 0)
-        freealigned64(table);
+    stopBackgroundClean();
+    releaseTable();
+}
+
+void transposition::releaseTable()
+{
+    stopBackgroundClean();
+    if (!size)
+        return;
+#ifdef TTFILEMAP
+    if (filemap)
+    {
+        if (shm)
+        {
+            // the last process detaching removes the segment; only it can extend its slot lock to everything
+            if (lockShm(shmfd, F_WRLCK, 0, 0, false))
+                shm_unlink(("/" + shmname).c_str());
+            close(shmfd);
+            shm = nullptr;
+        }
+        else
+        {
+            saveFile();
+        }
+        munmap(filemap, filemapsize);
+        filemap = nullptr;
+        size = 0;
+        return;
+    }
+#endif
+    // without a mapping the hash file gets the table only here (and with Save Hash)
+    saveFile();
+    freeHuge(table, (size_t)(size << clustershift), pagemode);
+    size = 0;
 }
 
 int transposition::setSize(int sizeMb)
 {
     int restMb = 0;
     int msb = 0;
-    if (size > 0)
-        freealigned64(table);
-    U64 maxsize = ((U64)sizeMb << 20) / sizeof(transpositioncluster);
+    releaseTable();
+    clustershift = ttClusterShift(format);
+    U64 maxsize = ((U64)sizeMb << 20) >> clustershift;
     if (!maxsize) return 0;
     GETMSB(msb, maxsize);
     size = (1ULL << msb);
-    restMb = (int)(((maxsize ^ size) >> 20) * sizeof(transpositioncluster));  // return rest for pawnhash
+    restMb = (int)(((maxsize ^ size) >> 20) << clustershift);  // return rest for pawnhash
     sizemask = size - 1;
-    size_t allocsize = (size_t)(size * sizeof(transpositioncluster));
+    size_t allocsize = (size_t)(size << clustershift);
+
+    // A table of another size or format in the hash file is kept for a matching Hash setting
+    bool usefile = (hashfile != "" && !isForeignFile());
+
+#ifdef TTFILEMAP
+    // A table in shared memory is used by all processes attached to it
+    if (shmname != "" && mapShm())
+        return restMb;
+    // The hash file backs the table directly; its entries are paged in on demand
+    if (usefile && mapFile())
+        return restMb;
+#else
+    if (shmname != "")
+        en.send("info string Shared hash is not supported on this platform.\n");
+#endif
 
-#if defined(__linux__) && !defined(__ANDROID__) // Many thanks to Sami Kiminki for advise on the huge page theory and for this patch
-    // Round up hashSize to the next 2M for alignment
-    allocsize = ((allocsize + HashAlignBytes - 1u) / HashAlignBytes) * HashAlignBytes;
+    table = (char*)allocHuge(allocsize, &pagemode, en.pageMode);
+    en.sendPageModes(true, false);
 
-    table = (transpositioncluster*)aligned_alloc(HashAlignBytes, allocsize);
+    // Spread the table evenly over all nodes before the first touch in clean()
+    if (en.useNuma && !numaInterleaveMemory(table, allocsize))
+        en.send("info string NUMA: Cannot interleave the hash over the nodes.\n");
 
-    // Linux-specific call to request huge pages, in case the aligned_alloc()
-    // call above doesn't already trigger them (depends on transparent huge page
-    // settings)
-    madvise(table, allocsize, MADV_HUGEPAGE);
-#else
-    table = (transpositioncluster*)allocalign64(allocsize);
+    if (!usefile || !loadFile())
+        clean();
+    return restMb;
+}
+
+
+static bool checkFileHeader(ttfileheader *h, U64 size, int format)
+{
+    return h->magic == TTFILEMAGIC
+        && h->zobristcheck == zobristCheck()
+        && h->clustersize == (1ULL << ttClusterShift(format))
+        && h->size == size
+        && h->format == format;
+}
+
+static void initFileHeader(ttfileheader *h, U64 size, int age, uint32_t epoch, int format)
+{
+    h->magic = TTFILEMAGIC;
+    h->zobristcheck = zobristCheck();
+    h->clustersize = 1ULL << ttClusterShift(format);
+    h->size = size;
+    h->numOfSearchShiftTwo = age;
+    h->epoch = epoch;
+    h->format = format;
+}
+
+
+// Tells if the hash file holds a valid table of this engine that doesn't fit the current size or format
+bool transposition::isForeignFile()
+{
+    FILE *f = fopen(hashfile.c_str(), "rb");
+    if (!f)
+        return false;
+    ttfileheader h;
+    bool foreign = (fread(&h, sizeof(h), 1, f) == 1 && h.magic == TTFILEMAGIC && h.zobristcheck == zobristCheck()
+        && !checkFileHeader(&h, size, format));
+    fclose(f);
+    if (foreign)
+        en.send("info string Hash file %s holds a table of %d MB in another size or format. It is kept and not used; Save Hash replaces it.\n",
+            hashfile.c_str(), (int)((h.size * h.clustersize) >> 20));
+    return foreign;
+}
+
+
+#ifdef TTFILEMAP
+// Maps the hash file as table; a file without a valid table is initialized
+bool transposition::mapFile()
+{
+    size_t tablesize = (size_t)(size << clustershift);
+    size_t mapsize = TTFILEHEADERSIZE + tablesize;
+    int fd = open(hashfile.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        en.send("info string Cannot open hash file %s: %s. Using memory only.\n", hashfile.c_str(), strerror(errno));
+        return false;
+    }
+    struct stat st;
+    bool resized = (fstat(fd, &st) || (size_t)st.st_size != mapsize);
+    if (resized && ftruncate(fd, (off_t)mapsize))
+    {
+        en.send("info string Cannot resize hash file %s: %s. Using memory only.\n", hashfile.c_str(), strerror(errno));
+        close(fd);
+        return false;
+    }
+    void *p = mmap(nullptr, mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int err = errno;
+    close(fd);
+    if (p == MAP_FAILED)
+    {
+        en.send("info string Cannot map hash file %s: %s. Using memory only.\n", hashfile.c_str(), strerror(err));
+        return false;
+    }
+
+    filemap = (char*)p;
+    filemapsize = mapsize;
+    table = filemap + TTFILEHEADERSIZE;
+    ttfileheader *h = (ttfileheader*)filemap;
+    if (!resized && checkFileHeader(h, size, format))
+    {
+        // the stored entries are one search older now
+        numOfSearchShiftTwo = h->numOfSearchShiftTwo;
+        epoch = h->epoch;
+        nextSearch();
+        en.send("info string Hash file %s mapped with its entries.\n", hashfile.c_str());
+    }
+    else
+    {
+        clean();
+        initFileHeader(h, size, numOfSearchShiftTwo, epoch, format);
+        en.send("info string Hash file %s initialized.\n", hashfile.c_str());
+    }
+    return true;
+}
+
+
+// Attaches to the named shared memory table or creates it; the first process decides the size.
+// A stale segment of crashed processes is rebuilt by the next process attaching.
+bool transposition::mapShm()
+{
+    string name = "/" + shmname;
+    size_t mapsize = TTFILEHEADERSIZE + (size_t)(size << clustershift);
+    struct stat st;
+    int fd;
+    bool builder;
+    for (;;)
+    {
+        fd = shm_open(name.c_str(), O_RDWR | O_CREAT, 0600);
+        if (fd < 0)
+        {
+            en.send("info string Cannot open shared hash %s: %s. Using private memory.\n", shmname.c_str(), strerror(errno));
+            return false;
+        }
+
+        // Without lock holders the segment is new or left by crashed processes; build it under the
+        // write lock of the whole segment which keeps the others waiting at the gate
+        builder = lockShm(fd, F_WRLCK, 0, 0, false);
+        if (!builder)
+        {
+            lockShm(fd, F_RDLCK, SHMSLOTS, 1, true);
+            lockShm(fd, F_UNLCK, SHMSLOTS, 1, false);
+            int slot = 0;
+            while (slot < SHMSLOTS && !lockShm(fd, F_WRLCK, slot, 1, false))
+                slot++;
+            if (slot == SHMSLOTS)
+            {
+                close(fd);
+                en.send("info string Shared hash %s is used by %d processes already. Using private memory.\n", shmname.c_str(), SHMSLOTS);
+                return false;
+            }
+        }
+
+        if (fstat(fd, &st))
+        {
+            close(fd);
+            en.send("info string Cannot open shared hash %s: %s. Using private memory.\n", shmname.c_str(), strerror(errno));
+            return false;
+        }
+        // The last process detaching may have removed the segment after we opened it; open the new one then
+        if (st.st_nlink > 0)
+            break;
+        close(fd);
+    }
+
+    if (builder)
+    {
+        bool stale = (st.st_size > 0);
+        if ((stale && ftruncate(fd, 0)) || ftruncate(fd, (off_t)mapsize))
+        {
+            shm_unlink(name.c_str());
+            close(fd);
+            en.send("info string Cannot allocate shared hash %s: %s. Using private memory.\n", shmname.c_str(), strerror(errno));
+            return false;
+        }
+        if (stale)
+            en.send("info string Shared hash %s was left by a crashed process. Rebuilding it.\n", shmname.c_str());
+    }
+    else if ((size_t)st.st_size != mapsize)
+    {
+        close(fd);
+        en.send("info string Shared hash %s has a different size. Using private memory.\n", shmname.c_str());
+        return false;
+    }
+
+    void *p = mmap(nullptr, mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+    {
+        if (builder)
+            shm_unlink(name.c_str());
+        close(fd);
+        en.send("info string Cannot map shared hash %s: %s. Using private memory.\n", shmname.c_str(), strerror(errno));
+        return false;
+    }
+
+    ttshmheader *hdr = (ttshmheader*)p;
+    if (builder)
+    {
+        // truncating zero filled the segment so the table is clean already
+        initFileHeader(&hdr->h, size, 0, 0, format);
+        hdr->age = 0;
+        lockShm(fd, F_UNLCK, 1, 0, false);  // keep slot 0 and let the waiting processes in
+    }
+    else if (!checkFileHeader(&hdr->h, size, format))
+    {
+        munmap(p, mapsize);
+        close(fd);
+        en.send("info string Shared hash %s doesn't match this engine. Using private memory.\n", shmname.c_str());
+        return false;
+    }
+
+    filemap = (char*)p;
+    filemapsize = mapsize;
+    table = filemap + TTFILEHEADERSIZE;
+    shm = hdr;
+    shmfd = fd;
+    numOfSearchShiftTwo = shm->age;
+    epoch = 0;  // a shared table is never cleaned lazily
+    en.send("info string Shared hash %s attached by %d process(es).\n", shmname.c_str(), attachedProcesses(fd));
+    return true;
+}
 #endif
 
-    clean();
-    return restMb;
+
+void transposition::nextSearch()
+{
+#ifdef TTFILEMAP
+    if (shm)
+    {
+        // Only the first process starting a new search advances the shared age; the others join
+        // it, so the age advances once per move and not once per attached process
+        int age = numOfSearchShiftTwo;
+        if (shm->age.compare_exchange_strong(age, (age + 4) & 0xfc))
+            age = (age + 4) & 0xfc;
+        numOfSearchShiftTwo = age;
+        return;
+    }
+#endif
+    numOfSearchShiftTwo = (numOfSearchShiftTwo + 4) & 0xfc;
+}
+
+
+// Reads the table from the hash file when the memory isn't mapped to it
+bool transposition::loadFile()
+{
+    FILE *f = fopen(hashfile.c_str(), "rb");
+    if (!f)
+        return false;
+    ttfileheader h;
+    bool ok = (fread(&h, sizeof(h), 1, f) == 1 && checkFileHeader(&h, size, format)
+        && !fseek(f, TTFILEHEADERSIZE, SEEK_SET)
+        && fread(table, (size_t)1 << clustershift, (size_t)size, f) == (size_t)size);
+    fclose(f);
+    if (!ok)
+    {
+        en.send("info string Hash file %s doesn't match the current hash. Ignored.\n", hashfile.c_str());
+        return false;
+    }
+    numOfSearchShiftTwo = h.numOfSearchShiftTwo;
+    epoch = h.epoch;
+    nextSearch();
+    en.send("info string Hash file %s loaded.\n", hashfile.c_str());
+    return true;
 }
 
-void transposition::clean()
+
+// Writes the table to the hash file; a mapped table just gets flushed.
+// A table of another size or format in the file is only replaced when overwrite is set (Save Hash).
+bool transposition::saveFile(bool overwrite)
 {
-    size_t totalsize = size * sizeof(transpositioncluster);
-    size_t sizePerThread = totalsize / en.Threads;
-    thread tthread[MAXTHREADS];
-    for (int i = 0; i < en.Threads; i++)
+    if (hashfile == "" || !size)
+        return false;
+#ifdef TTFILEMAP
+    if (filemap && !shm)
+    {
+        ((ttfileheader*)filemap)->numOfSearchShiftTwo = numOfSearchShiftTwo;
+        ((ttfileheader*)filemap)->epoch = epoch;
+        if (msync(filemap, filemapsize, MS_SYNC))
+        {
+            en.send("info string Cannot flush hash file %s: %s\n", hashfile.c_str(), strerror(errno));
+            return false;
+        }
+        return true;
+    }
+#endif
+    if (!overwrite && isForeignFile())
+        return false;
+    FILE *f = fopen(hashfile.c_str(), "wb");
+    if (!f)
     {
-        void *start = (char*)table + i * sizePerThread;
-        tthread[i] = thread(memset, start, 0, sizePerThread);
+        en.send("info string Cannot open hash file %s for writing: %s\n", hashfile.c_str(), strerror(errno));
+        return false;
     }
-    memset((char*)table + en.Threads * sizePerThread, 0, totalsize - en.Threads * sizePerThread);
-    for (int i = 0; i < en.Threads; i++)
+    char header[TTFILEHEADERSIZE] = { 0 };
+    stopBackgroundClean();
+    initFileHeader((ttfileheader*)header, size, numOfSearchShiftTwo, epoch, format);
+    bool ok = (fwrite(header, TTFILEHEADERSIZE, 1, f) == 1
+        && fwrite(table, (size_t)1 << clustershift, (size_t)size, f) == (size_t)size);
+    int err = errno;
+    if (fclose(f) && ok)
     {
-        if (tthread[i].joinable())
-            tthread[i].join();
+        ok = false;
+        err = errno;
     }
+    if (!ok)
+        en.send("info string Cannot write hash file %s: %s\n", hashfile.c_str(), strerror(err));
+    return ok;
+}
+
+static void cleanTableSlice(searchthread *thr)
+{
+    size_t totalsize = (size_t)(tp.size << tp.clustershift);
+    size_t sizePerThread = totalsize / thr->numofthreads;
+    size_t start = thr->index * sizePerThread;
+    size_t len = (thr->index == thr->numofthreads - 1 ? totalsize - start : sizePerThread);
+    memset((char*)tp.table + start, 0, len);
+}
+
+// A lazy clean just starts a new epoch so all entries count as empty without touching the memory;
+// a shared table is used by other processes with their own epoch and is always cleaned completely
+// as well as the packed format that has no epoch. The 3x10 clusters keep only 16 bits of the epoch;
+// when they wrap to 0 the clusters the background clean never reached would be current again,
+// so that clean is a complete one which starts over with epoch 0.
+void transposition::clean(bool lazy)
+{
+    stopBackgroundClean();
     numOfSearchShiftTwo = 0;
+    bool epochWraps = (format == TTFORMAT3X10 && (uint16_t)(epoch + 1) == 0);
+    if (lazy && !shm && format != TTFORMAT4X8 && !epochWraps)
+    {
+        epoch++;
+        bgcleanstop = false;
+        bgclean = thread(&transposition::backgroundClean, this);
+        return;
+    }
+
+    epoch = 0;
+    if (en.sthread && en.stopLevel == ENGINETERMINATEDSEARCH)
+    {
+        // let the parked search threads clear their part of the table
+        en.startThreads(cleanTableSlice);
+        en.waitThreads();
+    }
+    else
+    {
+        memset(table, 0, (size_t)(size << clustershift));
+    }
+}
+
+
+// Zeroes the clusters of older epochs until the next search starts
+template <class Cluster>
+void transposition::cleanStale()
+{
+    Cluster *clusters = (Cluster*)table;
+    for (U64 i = 0; i < size && !bgcleanstop; i++)
+        if (!clusters[i].isCurrent(epoch))
+            clusters[i].renew(epoch);
+}
+
+void transposition::backgroundClean()
+{
+    switch (format)
+    {
+    case TTFORMAT3X10:
+        cleanStale<ttcluster3x10>();
+        break;
+    case TTFORMAT6X10:
+        cleanStale<ttcluster6x10>();
+        break;
+    case TTFORMAT5X12:
+        cleanStale<transpositioncluster>();
+        break;
+    }
+}
+
+
+void transposition::stopBackgroundClean()
+{
+    if (bgclean.joinable())
+    {
+        bgcleanstop = true;
+        bgclean.join();
+    }
 }
 
 
+template <class Cluster>
 unsigned int transposition::getUsedinPermill()
 {
+    Cluster *clusters = (Cluster*)table;
+    const int samples = 1000 / Cluster::buckets * Cluster::buckets;
     unsigned int used = 0;
 
     // Take 1000 samples
-    for (int i = 0; i < 1000 / TTBUCKETNUM; i++)
-        for (int j = 0; j < TTBUCKETNUM; j++)
-            if ((table[i].entry[j].boundAndAge & 0xfc) == numOfSearchShiftTwo)
+    for (int i = 0; i < samples / Cluster::buckets; i++)
+        for (int j = 0; j < Cluster::buckets; j++)
+        {
+            transpositionentry e;
+            clusters[i].get(j, &e);
+            if (clusters[i].isCurrent(epoch) && (e.boundAndAge & 0xfc) == numOfSearchShiftTwo)
                 used++;
+        }
 
-    return used;
+    return used * 1000 / samples;
+}
+
+
+unsigned int transposition::getUsedinPermill()
+{
+    switch (format)
+    {
+    case TTFORMAT3X10:
+        return getUsedinPermill<ttcluster3x10>();
+    case TTFORMAT6X10:
+        return getUsedinPermill<ttcluster6x10>();
+    case TTFORMAT4X8:
+        return getUsedinPermill<ttclusterpacked>();
+    default:
+        return getUsedinPermill<transpositioncluster>();
+    }
 }
 
 
+template <class Cluster, class Replace>
 void transposition::addHash(U64 hash, int val, int16_t staticeval, int bound, int depth, uint16_t movecode)
 {
-    unsigned long long index = hash & sizemask;
-    transpositioncluster *cluster = &table[index];
-    transpositionentry *e;
-    transpositionentry *leastValuableEntry;
+    Cluster *cluster = (Cluster*)getCluster(hash);
+    const auto hashupper = Cluster::key(hash);
+    int leastValuableIndex = 0;
 
-    for (int i = 0; i < TTBUCKETNUM; i++)
+    if (!cluster->isCurrent(epoch))
+        // first write to this cluster after a lazy clean; drop the stale entries
+        cluster->renew(epoch);
+
+    int leastValuableRating = INT_MAX;
+    int oldDepth = 0;
+    bool samePosition = false;
+
+    for (int i = 0; i < Cluster::buckets; i++)
     {
         // First try to find a free or matching entry
-        e = &(cluster->entry[i]);
-        if (cluster->entry[i].hashupper == GETHASHUPPER(hash) || !cluster->entry[i].hashupper)
+        transpositionentry e;
+        auto hu = cluster->get(i, &e);
+        if (hu == hashupper || !hu)
         {
-            leastValuableEntry = e;
+            leastValuableIndex = i;
+            samePosition = (hu == hashupper);
+            oldDepth = e.depth;
             break;
         }
 
-        if (i == 0)
-        {
-            // initialize leastValuableEntry
-            leastValuableEntry = e;
-            continue;
-        }
-
-        if (e->depth - ((259 + numOfSearchShiftTwo - e->boundAndAge) & 0xfc) * 2
-            < leastValuableEntry->depth - ((259 + numOfSearchShiftTwo - leastValuableEntry->boundAndAge) & 0xfc) * 2)
+        int rating = Replace::rating(&e, numOfSearchShiftTwo);
+        if (rating < leastValuableRating)
         {
             // found a new less valuable entry
-            leastValuableEntry = e;
+            leastValuableIndex = i;
+            leastValuableRating = rating;
         }
     }
 
     // Don't overwrite an entry from the same position, unless we have
     // an exact bound or depth that is nearly as good as the old one
     if (bound != HASHEXACT
-        &&  leastValuableEntry->hashupper == GETHASHUPPER(hash)
-        &&  depth < leastValuableEntry->depth - 3)
+        &&  samePosition
+        &&  depth < oldDepth - 3)
         return;
 
-    leastValuableEntry->hashupper = GETHASHUPPER(hash);
-    leastValuableEntry->depth = (uint8_t)depth;
-    leastValuableEntry->value = (short)val;
-    leastValuableEntry->boundAndAge = (uint8_t)(bound | numOfSearchShiftTwo);
-    leastValuableEntry->movecode = movecode;
-    leastValuableEntry->staticeval = staticeval;
+    transpositionentry e;
+    e.depth = (uint8_t)depth;
+    e.value = (short)val;
+    e.boundAndAge = (uint8_t)(bound | numOfSearchShiftTwo);
+    e.movecode = movecode;
+    e.staticeval = staticeval;
+    cluster->set(leastValuableIndex, hashupper, &e);
+}
+
+
+void transposition::addHash(U64 hash, int val, int16_t staticeval, int bound, int depth, uint16_t movecode)
+{
+    bool byAge = (replace == TTREPLACEAGEDEPTH);
+    switch (format)
+    {
+    case TTFORMAT3X10:
+        if (byAge)
+            addHash<ttcluster3x10, ttReplaceAgeDepth>(hash, val, staticeval, bound, depth, movecode);
+        else
+            addHash<ttcluster3x10, ttReplaceDepthAge>(hash, val, staticeval, bound, depth, movecode);
+        break;
+    case TTFORMAT6X10:
+        if (byAge)
+            addHash<ttcluster6x10, ttReplaceAgeDepth>(hash, val, staticeval, bound, depth, movecode);
+        else
+            addHash<ttcluster6x10, ttReplaceDepthAge>(hash, val, staticeval, bound, depth, movecode);
+        break;
+    case TTFORMAT4X8:
+        if (byAge)
+            addHash<ttclusterpacked, ttReplaceAgeDepth>(hash, val, staticeval, bound, depth, movecode);
+        else
+            addHash<ttclusterpacked, ttReplaceDepthAge>(hash, val, staticeval, bound, depth, movecode);
+        break;
+    default:
+        if (byAge)
+            addHash<transpositioncluster, ttReplaceAgeDepth>(hash, val, staticeval, bound, depth, movecode);
+        else
+            addHash<transpositioncluster, ttReplaceDepthAge>(hash, val, staticeval, bound, depth, movecode);
+        break;
+    }
 }
 
 
+template <class Cluster>
 void transposition::printHashentry(U64 hash)
 {
-    unsigned long long index = hash & sizemask;
-    transpositioncluster *data = &table[index];
+    Cluster *data = (Cluster*)getCluster(hash);
     printf("Hashentry for %llx\n", hash);
-    for (int i = 0; i < TTBUCKETNUM; i++)
+    for (int i = 0; i < Cluster::buckets && data->isCurrent(epoch); i++)
     {
-        if ((data->entry[i].hashupper) == GETHASHUPPER(hash))
+        transpositionentry e;
+        auto hu = data->get(i, &e);
+        if (hu == Cluster::key(hash))
         {
-            printf("Match in upper part: %x / %x\n", (unsigned int)data->entry[i].hashupper, (unsigned int)(hash >> 32));
-            printf("Move code: %x\n", (unsigned int)data->entry[i].movecode);
-            printf("Depth:     %d\n", data->entry[i].depth);
-            printf("Value:     %d\n", data->entry[i].value);
-            printf("Eval:      %d\n", data->entry[i].staticeval);
-            printf("BoundAge:  %d\n", data->entry[i].boundAndAge);
+            printf("Match in upper part: %x / %x\n", (unsigned int)hu, (unsigned int)Cluster::key(hash));
+            printf("Move code: %x\n", (unsigned int)e.movecode);
+            printf("Depth:     %d\n", e.depth);
+            printf("Value:     %d\n", e.value);
+            printf("Eval:      %d\n", e.staticeval);
+            printf("BoundAge:  %d\n", e.boundAndAge);
             return;
         }
     }
@@ -289,37 +838,53 @@ void transposition::printHashentry(U64 hash)
 }
 
 
-bool transposition::probeHash(U64 hash, int *val, int *staticeval, uint16_t *movecode, int depth, int alpha, int beta, int ply)
+void transposition::printHashentry(U64 hash)
 {
-#ifdef EVALTUNE
-    // don't use transposition table when tuning evaluation
-    return false;
-#endif
-    unsigned long long index = hash & sizemask;
-    transpositioncluster* data = &table[index];
-    for (int i = 0; i < TTBUCKETNUM; i++)
+    switch (format)
+    {
+    case TTFORMAT3X10:
+        return printHashentry<ttcluster3x10>(hash);
+    case TTFORMAT6X10:
+        return printHashentry<ttcluster6x10>(hash);
+    case TTFORMAT4X8:
+        return printHashentry<ttclusterpacked>(hash);
+    default:
+        return printHashentry<transpositioncluster>(hash);
+    }
+}
+
+
+template <class Cluster>
+bool transposition::probeHash(U64 hash, int *val, int *staticeval, uint16_t *movecode, int depth, int alpha, int beta, int ply, bool *found)
+{
+    Cluster *data = (Cluster*)getCluster(hash);
+    if (!data->isCurrent(epoch))
+        return false;
+    for (int i = 0; i < Cluster::buckets; i++)
     {
-        transpositionentry *e = &(data->entry[i]);
-        if (e->hashupper == GETHASHUPPER(hash))
+        transpositionentry e;
+        if (data->get(i, &e) == Cluster::key(hash))
         {
-            *movecode = e->movecode;
-            *staticeval = e->staticeval;
-            int bound = (e->boundAndAge & BOUNDMASK);
-            int v = FIXMATESCOREPROBE(e->value, ply);
+            if (found)
+                *found = true;
+            *movecode = e.movecode;
+            *staticeval = e.staticeval;
+            int bound = (e.boundAndAge & BOUNDMASK);
+            int v = FIXMATESCOREPROBE(e.value, ply);
             if (bound == HASHEXACT)
             {
                 *val = v;
-                return (e->depth >= depth);
+                return (e.depth >= depth);
             }
             if (bound == HASHALPHA && v <= alpha)
             {
                 *val = alpha;
-                return (e->depth >= depth);
+                return (e.depth >= depth);
             }
             if (bound == HASHBETA && v >= beta)
             {
                 *val = beta;
-                return (e->depth >= depth);
+                return (e.depth >= depth);
             }
             // value outside boundary
             return false;
@@ -330,19 +895,58 @@ bool transposition::probeHash(U64 hash, int *val, int *staticeval, uint16_t *mov
 }
 
 
+bool transposition::probeHash(U64 hash, int *val, int *staticeval, uint16_t *movecode, int depth, int alpha, int beta, int ply, bool *found)
+{
+#ifdef EVALTUNE
+    // don't use transposition table when tuning evaluation
+    return false;
+#endif
+    switch (format)
+    {
+    case TTFORMAT3X10:
+        return probeHash<ttcluster3x10>(hash, val, staticeval, movecode, depth, alpha, beta, ply, found);
+    case TTFORMAT6X10:
+        return probeHash<ttcluster6x10>(hash, val, staticeval, movecode, depth, alpha, beta, ply, found);
+    case TTFORMAT4X8:
+        return probeHash<ttclusterpacked>(hash, val, staticeval, movecode, depth, alpha, beta, ply, found);
+    default:
+        return probeHash<transpositioncluster>(hash, val, staticeval, movecode, depth, alpha, beta, ply, found);
+    }
+}
+
+
+template <class Cluster>
 uint16_t transposition::getMoveCode(U64 hash)
 {
-    unsigned long long index = hash & sizemask;
-    transpositioncluster *data = &table[index];
-    for (int i = 0; i < TTBUCKETNUM; i++)
+    Cluster *data = (Cluster*)getCluster(hash);
+    if (!data->isCurrent(epoch))
+        return 0;
+    for (int i = 0; i < Cluster::buckets; i++)
     {
-        if ((data->entry[i].hashupper) == GETHASHUPPER(hash))
-            return data->entry[i].movecode;
+        transpositionentry e;
+        if (data->get(i, &e) == Cluster::key(hash))
+            return e.movecode;
     }
     return 0;
 }
 
 
+uint16_t transposition::getMoveCode(U64 hash)
+{
+    switch (format)
+    {
+    case TTFORMAT3X10:
+        return getMoveCode<ttcluster3x10>(hash);
+    case TTFORMAT6X10:
+        return getMoveCode<ttcluster6x10>(hash);
+    case TTFORMAT4X8:
+        return getMoveCode<ttclusterpacked>(hash);
+    default:
+        return getMoveCode<transpositioncluster>(hash);
+    }
+}
+
+
 Pawnhash::Pawnhash(int sizeMb)
 {
     int msb = 0;
@@ -353,58 +957,59 @@ Pawnhash::Pawnhash(int sizeMb)
     size = (1ULL << msb);
 
     sizemask = size - 1;
+    // at least 16 MB and a power of two, so rounding up to 2 MB huge pages doesn't waste memory
     size_t tablesize = (size_t)size * sizeof(S_PAWNHASHENTRY);
-    table = (S_PAWNHASHENTRY*)allocalign64(tablesize);
+    table = (S_PAWNHASHENTRY*)allocHuge(tablesize, &pagemode, en.pageMode);
     memset(table, 0, tablesize);
 }
 
 Pawnhash::~Pawnhash()
 {
-    freealigned64(table);
+    freeHuge(table, (size_t)size * sizeof(S_PAWNHASHENTRY), pagemode);
 }
 
 
-bool Pawnhash::probeHash(U64 hash, pawnhashentry **entry)
+// Copies the entry so a shared pawn hash can be written by other threads meanwhile
+bool Pawnhash::probeHash(U64 hash, pawnhashentry *entry)
 {
-    unsigned long long index = hash & sizemask;
-    *entry = &table[index];
-    if (((*entry)->hashupper) == (hash >> 32))
-    {
+    *entry = table[hash & sizemask];
 #ifndef EVALTUNE
-        // don't use pawn hash when tuning evaluation
+    // don't use pawn hash when tuning evaluation
+    if ((entry->hashupper ^ PAWNHASHFOLD(entry)) == (uint32_t)(hash >> 32))
         return true;
 #endif
-    }
-    (*entry)->hashupper = (uint32_t)(hash >> 32);
-    (*entry)->value = 0;
-    (*entry)->semiopen[0] = (*entry)->semiopen[1] = 0xff;
-    (*entry)->passedpawnbb[0] = (*entry)->passedpawnbb[1] = 0ULL;
-    (*entry)->attacked[0] = (*entry)->attacked[1] = 0ULL;
-    (*entry)->attackedBy2[0] = (*entry)->attackedBy2[1] = 0ULL;
-
     return false;
 }
 
+void Pawnhash::addHash(U64 hash, pawnhashentry *entry)
+{
+    pawnhashentry *e = &table[hash & sizemask];
+    e->value = entry->value;
+    e->passedpawnbb = entry->passedpawnbb;
+    e->hashupper = (uint32_t)(hash >> 32) ^ PAWNHASHFOLD(entry);
+}
 
-Materialhash::Materialhash()
+
+Evalhash::Evalhash(int sizeMb)
 {
-    table = (Materialhashentry*)allocalign64(MATERIALHASHSIZE * sizeof(Materialhashentry));
+    int msb = 0;
+    size = ((U64)sizeMb << 20) / sizeof(U64);
+    GETMSB(msb, size);
+    size = (1ULL << msb);
+
+    sizemask = size - 1;
+    table = (U64*)allocalign64((size_t)size * sizeof(U64));
+    clean();
 }
 
-Materialhash::~Materialhash()
+Evalhash::~Evalhash()
 {
     freealigned64(table);
 }
 
-bool  Materialhash::probeHash(U64 hash, Materialhashentry **entry)
+void Evalhash::clean()
 {
-    *entry = &table[hash & MATERIALHASHMASK];
-    if ((*entry)->hash == hash)
-        return true;
-
-    (*entry)->endgame = nullptr;
-    (*entry)->hash = hash;
-    return false;
+    memset(table, 0, (size_t)size * sizeof(U64));
 }
 
 
@@ -304,6 +304,7 @@ static void writeFenToFile(ofstream *fenfile, string fenlines[], int gamepositio
 bool PGNtoFEN(string pgnfilename, bool quietonly, int ppg)
 {
     pos.pwnhsh = new Pawnhash(0);
+    pos.allocPlyBuffers(1);
     pos.tps.count = 0;
     int gamescount = 0;
     fenWritten = 0ULL;
@@ -1234,6 +1235,7 @@ void getCorrelation(string correlationParams)
 void TexelTune(string fenfilenames, bool noqs, bool bOptimizeK, string correlation)
 {
     pos.pwnhsh = new Pawnhash(0);
+    pos.allocPlyBuffers(1);
     pos.tps.count = 0;
     registerallevals(&pos);
     pos.noQs = noqs;
@@ -1412,6 +1414,224 @@ void Sleep(long x)
 #endif
 
 
+//
+// NUMA support
+// Topology is read from sysfs, threads are pinned with sched_setaffinity and memory placement
+// uses the mbind syscall directly so we don't depend on libnuma.
+//
+vector<numanode> numanodes;
+
+#if defined(__linux__) && !defined(__ANDROID__)
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#define NUMA_MPOL_BIND 2
+#define NUMA_MPOL_INTERLEAVE 3
+#define NUMA_MPOL_MF_MOVE (1 << 1)
+
+static vector<int> parseCpuList(string s)
+{
+    // format is like "0-3,8-11"
+    vector<int> cpus;
+    vector<string> ranges;
+    size_t start = 0, end;
+    while ((end = s.find(',', start)) != string::npos)
+    {
+        ranges.push_back(s.substr(start, end - start));
+        start = end + 1;
+    }
+    ranges.push_back(s.substr(start));
+    for (size_t i = 0; i < ranges.size(); i++)
+    {
+        try {
+            size_t dash = ranges[i].find('-');
+            int first = stoi(ranges[i]);
+            int last = (dash == string::npos ? first : stoi(ranges[i].substr(dash + 1)));
+            for (int c = first; c <= last; c++)
+                cpus.push_back(c);
+        }
+        catch (...) {}
+    }
+    return cpus;
+}
+
+bool numaInit()
+{
+    numanodes.clear();
+    for (int n = 0; n < 64; n++)
+    {
+        ifstream nodefile("/sys/devices/system/node/node" + to_string(n) + "/cpulist");
+        if (!nodefile.is_open())
+            continue;
+        string line;
+        getline(nodefile, line);
+        numanode nn;
+        nn.node = n;
+        nn.cpus = parseCpuList(line);
+        if (nn.cpus.size())
+            numanodes.push_back(nn);
+    }
+    if (!numanodes.size())
+    {
+        // no sysfs node information; treat the whole box as one node
+        numanode nn;
+        nn.node = 0;
+        for (int c = 0; c < (int)thread::hardware_concurrency(); c++)
+            nn.cpus.push_back(c);
+        numanodes.push_back(nn);
+    }
+    return true;
+}
+
+static long numaMbind(void *p, size_t size, int mode, unsigned long nodemask, unsigned flags)
+{
+    // mbind works on whole pages only; shrink the range to the pages completely owned by this object
+    size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t)p + pagesize - 1) & ~(pagesize - 1);
+    uintptr_t end = ((uintptr_t)p + size) & ~(pagesize - 1);
+    if (end <= start)
+        return 0;
+    return syscall(SYS_mbind, (void*)start, end - start, mode, &nodemask, sizeof(nodemask) * 8 + 1, flags);
+}
+
+int numaBindThread(int index)
+{
+    if (!numanodes.size())
+        return -1;
+    numanode *nn = &numanodes[index % numanodes.size()];
+    int cpu = nn->cpus[(index / numanodes.size()) % nn->cpus.size()];
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    sched_setaffinity(0, sizeof(cpu_set_t), &cpuset);
+    return nn->node;
+}
+
+bool numaBindMemory(void *p, size_t size, int node)
+{
+    return (node < 0 || node >= 64 || !numaMbind(p, size, NUMA_MPOL_BIND, 1UL << node, NUMA_MPOL_MF_MOVE));
+}
+
+bool numaInterleaveMemory(void *p, size_t size)
+{
+    unsigned long nodemask = 0;
+    for (size_t i = 0; i < numanodes.size(); i++)
+        if (numanodes[i].node < 64)
+            nodemask |= 1UL << numanodes[i].node;
+    return (numanodes.size() < 2 || !numaMbind(p, size, NUMA_MPOL_INTERLEAVE, nodemask, 0));
+}
+
+#else
+
+bool numaInit() { numanodes.clear(); return false; }
+int numaBindThread(int index) { (void)index; return -1; }
+bool numaBindMemory(void *p, size_t size, int node) { (void)p; (void)size; (void)node; return true; }
+bool numaInterleaveMemory(void *p, size_t size) { (void)p; (void)size; return true; }
+
+#endif
+
+
+//
+// Large allocations
+// Explicit huge pages need pages reserved by the admin (vm.nr_hugepages) but are guaranteed when the mmap succeeds.
+// Transparent huge pages depend on the THP settings, normal pages are the last resort.
+//
+static const char *pagemodenames[] = { "1 GB huge pages", "2 MB huge pages", "transparent huge pages", "normal pages" };
+
+const char *pageModeName(int mode)
+{
+    return pagemodenames[mode];
+}
+
+#if defined(__linux__) && !defined(__ANDROID__)
+#include <sys/mman.h>
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+static size_t hugePageSize(int mode)
+{
+    return (mode == PAGES1G ? 1ULL << 30 : 2ULL << 20);
+}
+
+static size_t roundUp(size_t size, size_t align)
+{
+    return (size + align - 1) / align * align;
+}
+
+static bool thpEnabled()
+{
+    // the active setting is in brackets, e.g. "always [madvise] never"
+    ifstream f("/sys/kernel/mm/transparent_hugepage/enabled");
+    string s;
+    getline(f, s);
+    return (s != "" && s.find("[never]") == string::npos);
+}
+
+// Huge page allocations are rounded up to whole pages; e.g. Hash 1 takes a 2 MB page
+void *allocHuge(size_t size, int *mode, int firstmode)
+{
+    for (int m = firstmode; m < PAGESNORMAL; m++)
+    {
+        size_t len = roundUp(size, hugePageSize(m));
+        void *p;
+        if (m == PAGESTHP)
+        {
+            // Many thanks to Sami Kiminki for advise on the huge page theory
+            if (!thpEnabled() || !(p = aligned_alloc(hugePageSize(m), len)))
+                continue;
+            madvise(p, len, MADV_HUGEPAGE);
+        }
+        else
+        {
+            // a 1 GB page for a smaller table would mostly be wasted
+            if (m == PAGES1G && size < hugePageSize(m))
+                continue;
+            p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (m == PAGES1G ? MAP_HUGE_1GB : MAP_HUGE_2MB), -1, 0);
+            if (p == MAP_FAILED)
+                continue;
+        }
+        *mode = m;
+        return p;
+    }
+    *mode = PAGESNORMAL;
+    return allocalign64(roundUp(size, 64));
+}
+
+void freeHuge(void *p, size_t size, int mode)
+{
+    if (mode == PAGES1G || mode == PAGES2M)
+        munmap(p, roundUp(size, hugePageSize(mode)));
+    else
+        freealigned64(p);
+}
+
+#else
+
+void *allocHuge(size_t size, int *mode, int firstmode)
+{
+    (void)firstmode;
+    *mode = PAGESNORMAL;
+    return allocalign64(size);
+}
+
+void freeHuge(void *p, size_t size, int mode)
+{
+    (void)size;
+    (void)mode;
+    freealigned64(p);
+}
+
+#endif
+
+
 #ifdef STACKDEBUG
 // Thanks to http://blog.aaronballman.com/2011/04/generating-a-stack-crawl/ for the following stacktracer
 void GetStackWalk(chessposition *pos, const char* message, const char* _File, int Line, int num, ...)